@@ -0,0 +1,554 @@
+#include <boost/program_options.hpp>
+
+import std;
+import Histogram;
+import pubsub_uring;
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+namespace po = boost::program_options;
+
+using namespace pubsub;
+
+// Loopback end-to-end latency harness. Spawns a broker, subscribes M sockets
+// to every channel in use, then drives N publishers on an open-loop schedule.
+// Each payload carries the time it was *supposed* to be sent; measuring from
+// that instead of the actual send time keeps a stalled publisher from hiding
+// the stall (coordinated omission).
+
+namespace {
+volatile sig_atomic_t STOP_REQUESTED = 0;
+
+void handleSignal(int signum) {
+  if (signum == SIGINT) {
+    STOP_REQUESTED = 1;
+  }
+}
+
+uint64_t nowNs() {
+  return chrono::duration_cast<chrono::nanoseconds>(
+             chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+struct Config {
+  string transport;
+  string brokerPath;
+  string host;
+  uint16_t port;
+  uint32_t publishers;
+  uint32_t subscribers;
+  uint32_t channels;
+  uint32_t rate;
+  double duration;
+  double warmup;
+  uint32_t payload;
+  uint32_t drainMs;
+  bool brokerOutput;
+
+  bool udp() const { return transport == "udp"; }
+};
+
+struct Window {
+  uint64_t startNs;   // first intended send
+  uint64_t measureNs; // end of warmup
+  uint64_t endNs;     // no sends intended at or after this
+};
+
+struct SubscriberResult {
+  misc::Histogram corrected;
+  misc::Histogram uncorrected;
+  uint64_t received = 0;
+  uint64_t bytes = 0;
+};
+
+sockaddr_in brokerAddress(const Config &cfg) {
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = ::htons(cfg.port);
+  if (::inet_pton(AF_INET, cfg.host.c_str(), &addr.sin_addr) <= 0) {
+    throw runtime_error(format("Invalid address: {}", cfg.host));
+  }
+  return addr;
+}
+
+socket_t openSocket(const Config &cfg) {
+  const auto addr = brokerAddress(cfg);
+  socket_t sock = ::socket(AF_INET, cfg.udp() ? SOCK_DGRAM : SOCK_STREAM, 0);
+  if (sock < 0) {
+    throw runtime_error(format("Socket creation failed: {}", strerror(errno)));
+  }
+  if (::connect(sock, (const sockaddr *)&addr, sizeof(addr)) < 0) {
+    int err = errno;
+    ::close(sock);
+    throw runtime_error(format("Connection failed: {}", strerror(err)));
+  }
+  return sock;
+}
+
+bool sendAll(socket_t sock, string_view data) {
+  while (!data.empty()) {
+    auto sent = ::send(sock, data.data(), data.size(), MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data.remove_prefix(sent);
+  }
+  return true;
+}
+
+pid_t spawnBroker(const Config &cfg) {
+  pid_t pid = ::fork();
+  if (pid < 0) {
+    throw runtime_error(format("fork failed: {}", strerror(errno)));
+  }
+  if (pid == 0) {
+    if (!cfg.brokerOutput) {
+      int devNull = ::open("/dev/null", O_WRONLY);
+      if (devNull >= 0) {
+        ::dup2(devNull, STDOUT_FILENO);
+        ::dup2(devNull, STDERR_FILENO);
+        ::close(devNull);
+      }
+    }
+    const auto port = to_string(cfg.port);
+    ::execl(cfg.brokerPath.c_str(), cfg.brokerPath.c_str(), "--host",
+            cfg.host.c_str(), "--port", port.c_str(), nullptr);
+    ::_exit(127);
+  }
+  return pid;
+}
+
+void waitForBroker(const Config &cfg, pid_t broker) {
+  const auto deadline = chrono::steady_clock::now() + chrono::seconds(5);
+  while (chrono::steady_clock::now() < deadline) {
+    if (int status; ::waitpid(broker, &status, WNOHANG) == broker) {
+      throw runtime_error(format("Broker {} exited during startup",
+                                 cfg.brokerPath));
+    }
+    if (cfg.udp()) {
+      // Nothing to probe, give it a moment to bind
+      this_thread::sleep_for(chrono::milliseconds(200));
+      return;
+    }
+    try {
+      ::close(openSocket(cfg));
+      return;
+    } catch (const runtime_error &) {
+      this_thread::sleep_for(chrono::milliseconds(20));
+    }
+  }
+  throw runtime_error("Timed out waiting for broker to listen");
+}
+
+string channelList(const Config &cfg) {
+  string list;
+  for (uint32_t ch = 1; ch <= cfg.channels; ++ch) {
+    list += format("{}{}", list.empty() ? "" : ",", ch);
+  }
+  return list;
+}
+
+// frame is a delivered payload: the broker strips the [CH:N] prefix
+void recordMessage(string_view frame, uint64_t recvNs, const Window &window,
+                   SubscriberResult &result) {
+  string_view payload = frame;
+  if (payload.ends_with('\n')) {
+    payload.remove_suffix(1);
+  }
+  auto stamp = codec::parseStamp(payload);
+  if (!stamp || stamp->intendedNs < window.measureNs)
+    return;
+
+  result.corrected.record(recvNs > stamp->intendedNs
+                              ? recvNs - stamp->intendedNs
+                              : 0);
+  result.uncorrected.record(recvNs > stamp->sentNs ? recvNs - stamp->sentNs
+                                                   : 0);
+  ++result.received;
+  result.bytes += frame.size();
+}
+
+void runSubscriber(const Config &cfg, socket_t sock, const Window &window,
+                   const atomic<bool> &stop, SubscriberResult &result) {
+  vector<char> buffer(64 * 1024);
+  size_t pending = 0;
+
+  while (!stop.load(memory_order_relaxed)) {
+    auto received = ::recv(sock, buffer.data() + pending,
+                           buffer.size() - pending, 0);
+    const uint64_t recvNs = nowNs();
+
+    if (received < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+        continue;
+      break;
+    }
+    if (received == 0) {
+      if (cfg.udp())
+        continue;
+      break;
+    }
+
+    if (cfg.udp()) {
+      recordMessage({buffer.data(), static_cast<size_t>(received)}, recvNs,
+                    window, result);
+      continue;
+    }
+
+    pending += received;
+    string_view data(buffer.data(), pending);
+    size_t consumed = 0;
+    for (size_t end; (end = codec::findFrameEnd(data.substr(consumed))) !=
+                     string_view::npos;
+         consumed += end) {
+      recordMessage(data.substr(consumed, end), recvNs, window, result);
+    }
+    pending -= consumed;
+    memmove(buffer.data(), buffer.data() + consumed, pending);
+    if (pending == buffer.size()) {
+      println(stderr, "\033[31mSubscriber frame exceeds buffer\033[0m");
+      break;
+    }
+  }
+}
+
+void runPublisher(const Config &cfg, uint32_t id, const Window &window,
+                  atomic<uint64_t> &measuredSent) {
+  socket_t sock = openSocket(cfg);
+  const uint8_t channel = static_cast<uint8_t>(id % cfg.channels + 1);
+
+  const auto handshake = codec::makePubHandshake(channel);
+  if (!sendAll(sock, handshake)) {
+    println(stderr, "\033[31mPublisher {} handshake failed: {}\033[0m", id,
+            strerror(errno));
+    ::close(sock);
+    return;
+  }
+
+  const uint64_t interval = 1'000'000'000ull / cfg.rate;
+  vector<char> payload(max<size_t>(cfg.payload, codec::MAX_STAMP_SIZE), 'x');
+  vector<char> frame(payload.size() + 16);
+  uint64_t sentInWindow = 0;
+
+  for (uint64_t seq = 0; !STOP_REQUESTED; ++seq) {
+    const uint64_t intended = window.startNs + seq * interval;
+    if (intended >= window.endNs)
+      break;
+
+    // Sleep while far from the deadline, spin for the last stretch
+    uint64_t now;
+    while ((now = nowNs()) < intended) {
+      if (intended - now > 200'000) {
+        this_thread::sleep_for(chrono::nanoseconds(intended - now - 100'000));
+      }
+    }
+
+    codec::Stamp stamp{intended, nowNs(), id, seq};
+    size_t stampLen = codec::encodeStamp(payload, stamp);
+    size_t payloadLen = max<size_t>(stampLen, cfg.payload);
+    size_t frameLen =
+        codec::encodeMessage(frame, channel, {payload.data(), payloadLen},
+                             !cfg.udp());
+
+    if (!sendAll(sock, {frame.data(), frameLen})) {
+      println(stderr, "\033[31mPublisher {} send failed: {}\033[0m", id,
+              strerror(errno));
+      break;
+    }
+    if (intended >= window.measureNs) {
+      ++sentInWindow;
+    }
+  }
+
+  measuredSent += sentInWindow;
+  sendAll(sock, cfg.udp() ? string(protocol::EXIT_MSG)
+                          : format("{}\n", protocol::EXIT_MSG));
+  ::close(sock);
+}
+
+void printLatency(FILE *out, string_view label, const misc::Histogram &h) {
+  println(out, "{:<12} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f}",
+          label, h.percentile(50) / 1e3, h.percentile(99) / 1e3,
+          h.percentile(99.9) / 1e3, h.max() / 1e3, h.mean() / 1e3);
+}
+
+string latencyJson(const misc::Histogram &h) {
+  return format(R"({{"p50": {}, "p90": {}, "p99": {}, "p999": {}, "max": {}, )"
+                R"("mean": {:.1f}, "count": {}}})",
+                h.percentile(50), h.percentile(90), h.percentile(99),
+                h.percentile(99.9), h.max(), h.mean(), h.count());
+}
+
+// Pulls "key": number out of a flat report, searching after scope if given
+optional<double> jsonNumber(string_view json, string_view key,
+                            string_view scope = {}) {
+  size_t from = 0;
+  if (!scope.empty()) {
+    from = json.find(format("\"{}\"", scope));
+    if (from == string_view::npos)
+      return nullopt;
+  }
+  size_t pos = json.find(format("\"{}\":", key), from);
+  if (pos == string_view::npos)
+    return nullopt;
+  pos += key.size() + 3;
+  while (pos < json.size() && json[pos] == ' ')
+    ++pos;
+  double value{};
+  auto [_, ec] = from_chars(json.data() + pos, json.data() + json.size(), value);
+  if (ec != errc{})
+    return nullopt;
+  return value;
+}
+} // namespace
+
+int main(int argc, char *argv[]) {
+  Config cfg;
+  string jsonPath;
+  string baselinePath;
+  double tolerance;
+  bool help;
+
+  po::options_description desc("Latency benchmark options");
+  desc.add_options()("help,h", po::bool_switch(&help), "Show help message")(
+      "transport,t", po::value<string>(&cfg.transport)->default_value("tcp"),
+      "Broker transport: tcp or udp")(
+      "broker", po::value<string>(&cfg.brokerPath),
+      "Broker executable (defaults to the one built alongside)")(
+      "host", po::value<string>(&cfg.host)->default_value("127.0.0.1"),
+      "Broker host address")(
+      "port,p", po::value<uint16_t>(&cfg.port)->default_value(5100),
+      "Broker port")(
+      "publishers,P", po::value<uint32_t>(&cfg.publishers)->default_value(1),
+      "Number of publishers")(
+      "subscribers,S", po::value<uint32_t>(&cfg.subscribers)->default_value(1),
+      "Number of subscribers")(
+      "channels,c", po::value<uint32_t>(&cfg.channels)->default_value(1),
+      "Publishers are spread over channels 1..N")(
+      "rate,r", po::value<uint32_t>(&cfg.rate)->default_value(1000),
+      "Messages per second per publisher")(
+      "duration,d", po::value<double>(&cfg.duration)->default_value(10),
+      "Measured seconds")(
+      "warmup,w", po::value<double>(&cfg.warmup)->default_value(1),
+      "Seconds sent before measuring")(
+      "payload", po::value<uint32_t>(&cfg.payload)->default_value(64),
+      "Payload bytes per message (at least the timestamp)")(
+      "drain", po::value<uint32_t>(&cfg.drainMs)->default_value(500),
+      "Milliseconds to wait for in-flight messages after the last send")(
+      "broker-output", po::bool_switch(&cfg.brokerOutput),
+      "Keep the broker's stdout/stderr")(
+      "json", po::value<string>(&jsonPath),
+      "Write a machine-readable report to this file ('-' for stdout)")(
+      "baseline", po::value<string>(&baselinePath),
+      "Compare against a previous --json report, exit 2 on regression")(
+      "tolerance", po::value<double>(&tolerance)->default_value(10),
+      "Allowed regression in percent for p99 and throughput");
+
+  po::variables_map vm;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+    if (help) {
+      cout << desc << '\n';
+      return 0;
+    }
+  } catch (const po::error &e) {
+    println(stderr, "\033[31mError parsing arguments: {}\033[0m", e.what());
+    cout << desc << '\n';
+    return 1;
+  }
+
+  if (cfg.transport != "tcp" && cfg.transport != "udp") {
+    println(stderr, "\033[31mUnknown transport: {}\033[0m", cfg.transport);
+    return 1;
+  }
+  if (cfg.rate == 0 || cfg.channels == 0 ||
+      cfg.channels > protocol::MAX_CHANNELS || cfg.publishers == 0) {
+    println(stderr, "\033[31mrate, channels (1-255) and publishers must be "
+                    "positive\033[0m");
+    return 1;
+  }
+  if (cfg.brokerPath.empty()) {
+    cfg.brokerPath = cfg.udp() ? BROKER_UDP_PATH : BROKER_TCP_PATH;
+  }
+
+  signal(SIGINT, handleSignal);
+  signal(SIGPIPE, SIG_IGN);
+
+  pid_t broker = -1;
+  vector<socket_t> subSockets;
+
+  try {
+    broker = spawnBroker(cfg);
+    waitForBroker(cfg, broker);
+
+    const auto handshake = codec::makeSubHandshake(channelList(cfg));
+    for (uint32_t i = 0; i < cfg.subscribers; ++i) {
+      socket_t sock = openSocket(cfg);
+      subSockets.push_back(sock);
+      if (cfg.udp()) {
+        timeval timeout{0, 100'000};
+        ::setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      }
+      if (!sendAll(sock, handshake)) {
+        throw runtime_error(
+            format("Subscriber handshake failed: {}", strerror(errno)));
+      }
+    }
+  } catch (const exception &e) {
+    println(stderr, "\033[31mFatal error: {}\033[0m", e.what());
+    for (socket_t sock : subSockets) {
+      ::close(sock);
+    }
+    if (broker > 0) {
+      ::kill(broker, SIGINT);
+      ::waitpid(broker, nullptr, 0);
+    }
+    return 1;
+  }
+
+  // Let the broker register every subscription before anything is published
+  this_thread::sleep_for(chrono::milliseconds(100));
+
+  Window window;
+  window.startNs = nowNs() + 50'000'000;
+  window.measureNs =
+      window.startNs + static_cast<uint64_t>(cfg.warmup * 1e9);
+  window.endNs = window.measureNs + static_cast<uint64_t>(cfg.duration * 1e9);
+
+  atomic<bool> stopSubscribers{false};
+  vector<SubscriberResult> results(cfg.subscribers);
+  vector<thread> threads;
+  for (uint32_t i = 0; i < cfg.subscribers; ++i) {
+    threads.emplace_back(runSubscriber, cref(cfg), subSockets[i], cref(window),
+                         cref(stopSubscribers), ref(results[i]));
+  }
+
+  atomic<uint64_t> measuredSent{0};
+  vector<thread> publishers;
+  for (uint32_t i = 0; i < cfg.publishers; ++i) {
+    publishers.emplace_back([&, i] {
+      try {
+        runPublisher(cfg, i, window, measuredSent);
+      } catch (const exception &e) {
+        println(stderr, "\033[31mPublisher {} failed: {}\033[0m", i, e.what());
+      }
+    });
+  }
+  for (auto &t : publishers) {
+    t.join();
+  }
+
+  this_thread::sleep_for(chrono::milliseconds(cfg.drainMs));
+  stopSubscribers = true;
+  for (socket_t sock : subSockets) {
+    ::shutdown(sock, SHUT_RDWR);
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  for (socket_t sock : subSockets) {
+    ::close(sock);
+  }
+
+  ::kill(broker, SIGINT);
+  ::waitpid(broker, nullptr, 0);
+
+  misc::Histogram corrected;
+  misc::Histogram uncorrected;
+  uint64_t received = 0;
+  uint64_t bytes = 0;
+  for (const auto &r : results) {
+    corrected.merge(r.corrected);
+    uncorrected.merge(r.uncorrected);
+    received += r.received;
+    bytes += r.bytes;
+  }
+
+  const uint64_t sent = measuredSent.load();
+  const uint64_t expected = sent * cfg.subscribers;
+  const double throughput = received / cfg.duration;
+  const double delivered = expected ? 100.0 * received / expected : 0.0;
+
+  // With --json - stdout carries only the JSON
+  FILE *out = jsonPath == "-" ? stderr : stdout;
+  println(out,
+          "transport={} publishers={} subscribers={} channels={} rate={}/s "
+          "duration={}s",
+          cfg.transport, cfg.publishers, cfg.subscribers, cfg.channels,
+          cfg.rate, cfg.duration);
+  println(out, "sent={} received={} expected={} delivered={:.2f}%", sent,
+          received, expected, delivered);
+  println(out, "throughput={:.0f} msg/s ({:.2f} MB/s)\n", throughput,
+          bytes / cfg.duration / 1e6);
+  println(out, "{:<12} {:>10} {:>10} {:>10} {:>10} {:>10}", "latency(us)",
+          "p50", "p99", "p99.9", "max", "mean");
+  printLatency(out, "corrected", corrected);
+  printLatency(out, "uncorrected", uncorrected);
+
+  const auto json = format(
+      R"({{"transport": "{}", "publishers": {}, "subscribers": {}, )"
+      R"("channels": {}, "rate": {}, "duration_s": {}, "payload": {}, )"
+      R"("sent": {}, "received": {}, "expected": {}, )"
+      R"("throughput_msgs": {:.1f}, "throughput_bytes": {:.1f}, )"
+      R"("latency_ns": {}, "latency_uncorrected_ns": {}}})",
+      cfg.transport, cfg.publishers, cfg.subscribers, cfg.channels, cfg.rate,
+      cfg.duration, cfg.payload, sent, received, expected, throughput,
+      bytes / cfg.duration, latencyJson(corrected), latencyJson(uncorrected));
+
+  if (jsonPath == "-") {
+    println("{}", json);
+  } else if (!jsonPath.empty()) {
+    ofstream out(jsonPath);
+    out << json << '\n';
+    if (!out) {
+      println(stderr, "\033[31mFailed to write {}\033[0m", jsonPath);
+      return 1;
+    }
+  }
+
+  if (received == 0) {
+    // Nothing was measured, a report of zeros must not pass for a result
+    println(stderr, "\033[31mNo stamped messages were received\033[0m");
+    return 1;
+  }
+
+  if (!baselinePath.empty()) {
+    ifstream in(baselinePath);
+    string baseline((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    auto baseP99 = jsonNumber(baseline, "p99", "latency_ns");
+    auto baseThroughput = jsonNumber(baseline, "throughput_msgs");
+    if (!baseP99 || !baseThroughput) {
+      println(stderr, "\033[31mCould not read baseline {}\033[0m",
+              baselinePath);
+      return 1;
+    }
+
+    const double p99 = corrected.percentile(99);
+    const bool slower = p99 > *baseP99 * (1 + tolerance / 100);
+    const bool fewer = throughput < *baseThroughput * (1 - tolerance / 100);
+    println(out, "\nbaseline p99={:.1f}us throughput={:.0f} msg/s -> {}",
+            *baseP99 / 1e3, *baseThroughput,
+            slower || fewer ? "\033[31mREGRESSION\033[0m"
+                            : "\033[32mok\033[0m");
+    if (slower || fewer) {
+      return 2;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,116 @@
+#include <boost/program_options.hpp>
+
+import std;
+import MessageGenerator;
+
+using namespace std;
+namespace po = boost::program_options;
+
+// Microbenchmark of the message generators: the std::function based
+// MessageGenerator against FastMessageGenerator, one message at a time and
+// in arena batches. Same seed for every run so the figures are comparable.
+
+namespace {
+struct Result {
+  string_view name;
+  uint64_t messages = 0;
+  uint64_t bytes = 0;
+  double seconds = 0;
+};
+
+// Runs body until it has produced at least count messages. body returns
+// {messages, bytes} for one call.
+template <typename Body>
+Result measure(string_view name, uint64_t count, Body &&body) {
+  Result r{name};
+  const auto start = chrono::steady_clock::now();
+  while (r.messages < count) {
+    auto [messages, bytes] = body();
+    r.messages += messages;
+    r.bytes += bytes;
+  }
+  r.seconds =
+      chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  return r;
+}
+
+void printResult(const Result &r, double baseline) {
+  const double nsPerMsg = r.seconds * 1e9 / r.messages;
+  println("{:<24} {:>10.1f} ns/msg {:>10.2f} Mmsg/s {:>9.1f} MB/s  x{:.1f}",
+          r.name, nsPerMsg, r.messages / r.seconds / 1e6,
+          r.bytes / r.seconds / 1e6, baseline / nsPerMsg);
+}
+} // namespace
+
+int main(int argc, char *argv[]) {
+  uint64_t count;
+  uint32_t seed;
+  uint32_t batch;
+  bool help;
+
+  po::options_description desc("Message generator benchmark options");
+  desc.add_options()("help,h", po::bool_switch(&help), "Show help message")(
+      "count,n", po::value<uint64_t>(&count)->default_value(5'000'000),
+      "Messages generated per variant")(
+      "seed,s", po::value<uint32_t>(&seed)->default_value(1),
+      "Generator seed")(
+      "batch,b", po::value<uint32_t>(&batch)->default_value(1024),
+      "Messages per generateBatch call");
+
+  po::variables_map vm;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+    if (help) {
+      cout << desc << '\n';
+      return 0;
+    }
+    if (count == 0 || batch == 0) {
+      throw po::error("--count and --batch must be at least 1");
+    }
+  } catch (const po::error &e) {
+    println(stderr, "\033[31mError parsing arguments: {}\033[0m", e.what());
+    cout << desc << '\n';
+    return 1;
+  }
+
+  array<char, 128> buffer;
+  // Read every message back so the work cannot be optimized away
+  uint64_t checksum = 0;
+
+  auto legacy = misc::makeMessageGenerator(seed);
+  const auto legacyResult = measure("MessageGenerator", count, [&] {
+    const auto n = legacy.generateMessage(buffer.data(), buffer.size());
+    checksum += static_cast<unsigned char>(buffer[n / 2]);
+    return pair<uint64_t, uint64_t>{1, n};
+  });
+
+  misc::FastMessageGenerator fast(seed);
+  const auto fastResult = measure("FastMessageGenerator", count, [&] {
+    const auto n = fast.generateMessage(buffer.data(), buffer.size());
+    checksum += static_cast<unsigned char>(buffer[n / 2]);
+    return pair<uint64_t, uint64_t>{1, n};
+  });
+
+  vector<char> arena(size_t{batch} *
+                     misc::FastMessageGenerator::maxMessageSize());
+  vector<string_view> messages(batch);
+  misc::FastMessageGenerator batched(seed);
+  const auto batchResult = measure("FastMessageGenerator/b", count, [&] {
+    const auto n = batched.generateBatch(arena, messages);
+    uint64_t bytes = 0;
+    for (auto message : span(messages).first(n)) {
+      bytes += message.size();
+    }
+    checksum += static_cast<unsigned char>(messages[n / 2].front());
+    return pair<uint64_t, uint64_t>{n, bytes};
+  });
+
+  const double baseline = legacyResult.seconds * 1e9 / legacyResult.messages;
+  println("{} messages per variant, seed {}, batch {}\n", count, seed, batch);
+  printResult(legacyResult, baseline);
+  printResult(fastResult, baseline);
+  printResult(batchResult, baseline);
+  println("\n(checksum {})", checksum);
+  return 0;
+}
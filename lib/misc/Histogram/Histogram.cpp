@@ -0,0 +1,77 @@
+module Histogram;
+
+import std;
+
+using namespace std;
+
+namespace misc {
+
+Histogram::Histogram(uint32_t precisionBits)
+    : bits(clamp<uint32_t>(precisionBits, 2, 16)), subCount(1ull << bits),
+      counts(subCount + (64 - bits) * (subCount / 2)) {}
+
+size_t Histogram::indexOf(uint64_t value) const {
+  if (value < subCount)
+    return value;
+  const uint32_t shift = bit_width(value) - bits;
+  const uint64_t mantissa = value >> shift; // in [subCount/2, subCount)
+  return subCount + (shift - 1) * (subCount / 2) + (mantissa - subCount / 2);
+}
+
+uint64_t Histogram::upperBound(size_t index) const {
+  if (index < subCount)
+    return index;
+  const uint64_t k = index - subCount;
+  const uint64_t shift = k / (subCount / 2) + 1;
+  const uint64_t mantissa = k % (subCount / 2) + subCount / 2;
+  return ((mantissa + 1) << shift) - 1;
+}
+
+void Histogram::record(uint64_t value, uint64_t count) {
+  counts[indexOf(value)] += count;
+  total += count;
+  sum += static_cast<long double>(value) * count;
+  minValue = std::min(minValue, value);
+  maxValue = std::max(maxValue, value);
+}
+
+void Histogram::merge(const Histogram &other) {
+  if (other.bits != bits) {
+    throw invalid_argument("Histogram precision mismatch");
+  }
+  for (size_t i = 0; i < counts.size(); ++i) {
+    counts[i] += other.counts[i];
+  }
+  total += other.total;
+  sum += other.sum;
+  minValue = std::min(minValue, other.minValue);
+  maxValue = std::max(maxValue, other.maxValue);
+}
+
+void Histogram::reset() {
+  ranges::fill(counts, 0);
+  total = 0;
+  sum = 0;
+  minValue = numeric_limits<uint64_t>::max();
+  maxValue = 0;
+}
+
+double Histogram::mean() const {
+  return total ? static_cast<double>(sum / total) : 0.0;
+}
+
+uint64_t Histogram::percentile(double p) const {
+  if (total == 0)
+    return 0;
+  const auto rank = static_cast<uint64_t>(
+      ceil(clamp(p, 0.0, 100.0) / 100.0 * static_cast<double>(total)));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < counts.size(); ++i) {
+    seen += counts[i];
+    if (seen >= std::max<uint64_t>(rank, 1))
+      return std::min(upperBound(i), maxValue);
+  }
+  return maxValue;
+}
+
+} // namespace misc
@@ -0,0 +1,43 @@
+export module Histogram;
+
+import std;
+
+using namespace std;
+
+export namespace misc {
+
+// Log-linear histogram in the style of HdrHistogram: values below 2^bits are
+// exact, above that every power of two is split into 2^(bits-1) linear
+// sub-buckets, so the relative error stays under 2^-(bits-1). Recording is a
+// couple of bit operations and an increment, no allocation.
+class Histogram {
+public:
+  explicit Histogram(uint32_t precisionBits = 8);
+
+  void record(uint64_t value, uint64_t count = 1);
+
+  void merge(const Histogram &other);
+  void reset();
+
+  uint64_t count() const { return total; }
+  uint64_t min() const { return total ? minValue : 0; }
+  uint64_t max() const { return maxValue; }
+  double mean() const;
+
+  // Upper bound of the bucket holding the given percentile (0-100)
+  uint64_t percentile(double p) const;
+
+private:
+  size_t indexOf(uint64_t value) const;
+  uint64_t upperBound(size_t index) const;
+
+  uint32_t bits;
+  uint64_t subCount;
+  vector<uint64_t> counts;
+  uint64_t total = 0;
+  uint64_t minValue = numeric_limits<uint64_t>::max();
+  uint64_t maxValue = 0;
+  long double sum = 0;
+};
+
+} // namespace misc
@@ -0,0 +1,134 @@
+module;
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+module MessageGenerator;
+
+import std;
+
+using namespace std;
+
+namespace misc {
+
+namespace {
+constexpr string_view MAGIC = "PSCORPUS";
+constexpr uint32_t VERSION = 1;
+
+// Records are stored in host order, which the format defines as little-endian
+static_assert(endian::native == endian::little);
+
+template <typename T> void writeValue(ofstream &out, T value) {
+  out.write(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+template <typename T> T readValue(const char *at) {
+  T value;
+  memcpy(&value, at, sizeof(value));
+  return value;
+}
+} // namespace
+
+uint32_t MessageCorpus::write(const string &path, uint64_t count,
+                              optional<uint32_t> seed) {
+  const uint32_t used = seed.value_or(MessageGenerator::initSeed());
+  FastMessageGenerator gen(used);
+
+  ofstream out(path, ios::binary | ios::trunc);
+  if (!out) {
+    throw runtime_error(format("Cannot create corpus {}: {}", path,
+                               strerror(errno)));
+  }
+
+  out.write(MAGIC.data(), MAGIC.size());
+  writeValue(out, VERSION);
+  writeValue(out, used);
+  writeValue(out, count);
+
+  vector<char> buffer(FastMessageGenerator::maxMessageSize() + 1);
+  for (uint64_t i = 0; i < count; ++i) {
+    const uint32_t n = gen.generateMessage(buffer.data(), buffer.size());
+    writeValue(out, n);
+    out.write(buffer.data(), n);
+  }
+
+  if (!out.flush()) {
+    throw runtime_error(format("Cannot write corpus {}", path));
+  }
+  return used;
+}
+
+MessageCorpus::MessageCorpus(const string &path) {
+  const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw runtime_error(
+        format("Cannot open corpus {}: {}", path, strerror(errno)));
+  }
+
+  struct stat st{};
+  if (::fstat(fd, &st) < 0 || size_t(st.st_size) < HEADER_SIZE) {
+    ::close(fd);
+    throw runtime_error(format("Corpus {} is truncated", path));
+  }
+  length = st.st_size;
+
+  // Populate up front so replay never takes a page fault
+  void *mapped =
+      ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  ::close(fd);
+  if (mapped == MAP_FAILED) {
+    throw runtime_error(
+        format("Cannot map corpus {}: {}", path, strerror(errno)));
+  }
+  base = static_cast<const char *>(mapped);
+
+  auto fail = [&](string_view why) {
+    ::munmap(const_cast<char *>(base), length);
+    return runtime_error(format("Invalid corpus {}: {}", path, why));
+  };
+
+  if (string_view(base, MAGIC.size()) != MAGIC)
+    throw fail("bad magic");
+  if (readValue<uint32_t>(base + 8) != VERSION)
+    throw fail("unsupported version");
+  seedValue = readValue<uint32_t>(base + 12);
+  count = readValue<uint64_t>(base + 16);
+  if (count == 0)
+    throw fail("no messages");
+
+  // Check every record once here so next() can trust the lengths
+  size_t at = HEADER_SIZE;
+  for (uint64_t i = 0; i < count; ++i) {
+    if (length - at < sizeof(uint32_t))
+      throw fail("truncated record header");
+    const uint32_t n = readValue<uint32_t>(base + at);
+    at += sizeof(uint32_t);
+    if (length - at < n)
+      throw fail("truncated record");
+    at += n;
+  }
+  if (at != length)
+    throw fail("trailing bytes after the last record");
+}
+
+MessageCorpus::~MessageCorpus() {
+  if (base) {
+    ::munmap(const_cast<char *>(base), length);
+  }
+}
+
+string_view MessageCorpus::next() {
+  if (offset == length) {
+    offset = HEADER_SIZE;
+  }
+  const uint32_t n = readValue<uint32_t>(base + offset);
+  string_view message(base + offset + sizeof(uint32_t), n);
+  offset += sizeof(uint32_t) + n;
+  return message;
+}
+} // namespace misc
@@ -14,6 +14,109 @@ constexpr array players{
 #include "players.txt"
 };
 
+namespace {
+enum class Slot : uint8_t { NONE, TEAM, PLAYER, MINUTE };
+
+// A message pattern pre-split around its placeholders:
+// text[0] slot[0] text[1] slot[1] text[2]
+struct Template {
+  array<string_view, 3> text{};
+  array<Slot, 2> slots{};
+};
+
+consteval Template makeTemplate(string_view pattern, Slot first,
+                                Slot second = Slot::NONE) {
+  Template t{{}, {first, second}};
+  size_t part = 0;
+  for (; part < t.slots.size() && t.slots[part] != Slot::NONE; ++part) {
+    const auto pos = pattern.find("{}");
+    if (pos == string_view::npos)
+      throw "template has fewer placeholders than slots";
+    t.text[part] = pattern.substr(0, pos);
+    pattern.remove_prefix(pos + 2);
+  }
+  if (pattern.find("{}") != string_view::npos)
+    throw "template has more placeholders than slots";
+  t.text[part] = pattern;
+  return t;
+}
+
+// Same patterns, in the same order, as makeMessageGenerator()
+constexpr array TEMPLATES{
+    makeTemplate("Gol de {} al minuto {}", Slot::TEAM, Slot::MINUTE),
+    makeTemplate("Cambio entra {}", Slot::PLAYER),
+    makeTemplate("Tarjeta amarilla 🟨 para {} al minuto {}", Slot::PLAYER,
+                 Slot::MINUTE),
+    makeTemplate("Tarjeta roja 🟥 para {} al minuto {}", Slot::PLAYER,
+                 Slot::MINUTE),
+    makeTemplate("Cambio sale {}", Slot::PLAYER),
+    makeTemplate("Se agregan 3 minutos al partido en {}", Slot::TEAM),
+    makeTemplate("{} está lesionado y pide atención médica", Slot::PLAYER),
+    makeTemplate("Penalti para {} al minuto {}", Slot::TEAM, Slot::MINUTE),
+    makeTemplate("Saque de esquina para {}", Slot::TEAM),
+    makeTemplate("Gran atajada del portero {}", Slot::PLAYER),
+    makeTemplate("Comienza el segundo tiempo en {}", Slot::TEAM),
+    makeTemplate("Finaliza el partido en {}", Slot::TEAM),
+};
+
+template <size_t N> constexpr auto toViews(const array<const char *, N> &src) {
+  array<string_view, N> out{};
+  for (size_t i = 0; i < N; ++i)
+    out[i] = src[i];
+  return out;
+}
+
+constexpr auto TEAM_NAMES = toViews(teams);
+constexpr auto PLAYER_NAMES = toViews(players);
+
+// Decimal text of minutes 1-90, indexed by minute
+constexpr auto MINUTE_TEXT = [] {
+  array<array<char, 2>, 91> out{};
+  for (uint32_t m = 1; m < out.size(); ++m) {
+    out[m] = m < 10 ? array{char('0' + m), '\0'}
+                    : array{char('0' + m / 10), char('0' + m % 10)};
+  }
+  return out;
+}();
+
+constexpr size_t slotWidth(Slot slot) {
+  const auto longest = [](const auto &names) {
+    size_t n = 0;
+    for (auto name : names)
+      n = std::max(n, name.size());
+    return n;
+  };
+  switch (slot) {
+  case Slot::TEAM:
+    return longest(TEAM_NAMES);
+  case Slot::PLAYER:
+    return longest(PLAYER_NAMES);
+  case Slot::MINUTE:
+    return 2;
+  case Slot::NONE:
+    break;
+  }
+  return 0;
+}
+
+constexpr uint32_t MAX_MESSAGE_SIZE = [] {
+  size_t best = 0;
+  for (const auto &t : TEMPLATES) {
+    size_t n = t.text[0].size() + t.text[1].size() + t.text[2].size();
+    for (auto slot : t.slots)
+      n += slotWidth(slot);
+    best = std::max(best, n);
+  }
+  return static_cast<uint32_t>(best);
+}();
+
+char *put(char *out, char *end, string_view text) {
+  const size_t n = min<size_t>(text.size(), end - out);
+  memcpy(out, text.data(), n);
+  return out + n;
+}
+} // namespace
+
 uint32_t MessageGenerator::initSeed() {
   if (const char *env = getenv("MsgGen_SEED")) {
     uint32_t value{};
@@ -170,4 +273,71 @@ MessageGenerator makeMessageGenerator(optional<uint32_t> seed) {
 
   return MessageGenerator(std::move(functors), seed);
 }
+
+FastMessageGenerator::FastMessageGenerator(optional<uint32_t> seed)
+    : state(seed.value_or(MessageGenerator::initSeed())) {}
+
+uint32_t FastMessageGenerator::maxMessageSize() { return MAX_MESSAGE_SIZE; }
+
+// splitmix64: one add and two multiplies per draw
+uint64_t FastMessageGenerator::next() {
+  uint64_t z = (state += 0x9e3779b97f4a7c15);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+  return z ^ (z >> 31);
+}
+
+// Multiply-shift reduction to [0, bound), no division
+uint32_t FastMessageGenerator::below(uint32_t bound) {
+  return static_cast<uint32_t>(((next() >> 32) * bound) >> 32);
+}
+
+char *FastMessageGenerator::write(char *out, char *end) {
+  const auto &t = TEMPLATES[below(TEMPLATES.size())];
+  out = put(out, end, t.text[0]);
+  for (size_t i = 0; i < t.slots.size() && t.slots[i] != Slot::NONE; ++i) {
+    string_view value;
+    switch (t.slots[i]) {
+    case Slot::TEAM:
+      value = TEAM_NAMES[below(TEAM_NAMES.size())];
+      break;
+    case Slot::PLAYER:
+      value = PLAYER_NAMES[below(PLAYER_NAMES.size())];
+      break;
+    case Slot::MINUTE: {
+      const uint32_t minute = 1 + below(90);
+      value = string_view(MINUTE_TEXT[minute].data(), minute < 10 ? 1 : 2);
+      break;
+    }
+    case Slot::NONE:
+      break;
+    }
+    out = put(out, end, value);
+    out = put(out, end, t.text[i + 1]);
+  }
+  return out;
+}
+
+uint32_t FastMessageGenerator::generateMessage(char *buffer, uint32_t sz) {
+  if (sz == 0)
+    return 0;
+  char *last = write(buffer, buffer + sz - 1);
+  *last = '\0';
+  return static_cast<uint32_t>(last - buffer);
+}
+
+size_t FastMessageGenerator::generateBatch(span<char> arena,
+                                           span<string_view> messages) {
+  char *out = arena.data();
+  char *const end = out + arena.size();
+  size_t count = 0;
+  // Only start a message that is sure to fit, so none is truncated
+  for (; count < messages.size() && size_t(end - out) >= MAX_MESSAGE_SIZE;
+       ++count) {
+    char *last = write(out, end);
+    messages[count] = string_view(out, last - out);
+    out = last;
+  }
+  return count;
+}
 } // namespace misc
@@ -24,4 +24,67 @@ private:
 };
 
 MessageGenerator makeMessageGenerator(optional<uint32_t> seed = nullopt);
+
+// Produces the same kinds of messages as makeMessageGenerator() without the
+// per-message std::function call, distribution objects or format parsing.
+// The templates are split into literal fragments at compile time and
+// generation is a table lookup plus a few memcpys.
+class FastMessageGenerator {
+public:
+  explicit FastMessageGenerator(optional<uint32_t> seed = nullopt);
+
+  // Longest message any template can produce, terminator excluded
+  static uint32_t maxMessageSize();
+
+  // Same contract as MessageGenerator::generateMessage: the output is
+  // truncated to sz - 1 bytes and NUL-terminated
+  uint32_t generateMessage(char *buffer, uint32_t sz);
+
+  // Writes messages back to back into arena, without terminators, filling
+  // messages with views of them. Returns how many were generated, which is
+  // less than messages.size() only if the arena ran out.
+  size_t generateBatch(span<char> arena, span<string_view> messages);
+
+private:
+  uint64_t next();
+  uint32_t below(uint32_t bound);
+  char *write(char *out, char *end);
+
+  uint64_t state;
+};
+
+// Pre-generated messages for replay. The file is a 24-byte header (magic
+// "PSCORPUS", u32 version, u32 seed, u64 count) followed by count records
+// of a u32 length and the message bytes, all little-endian.
+class MessageCorpus {
+public:
+  // Generates count messages with FastMessageGenerator into path. Without a
+  // seed, MsgGen_SEED or a random one is used; the seed used is returned.
+  static uint32_t write(const string &path, uint64_t count,
+                        optional<uint32_t> seed = nullopt);
+
+  // Maps the whole file read-only and validates it; throws runtime_error
+  explicit MessageCorpus(const string &path);
+  ~MessageCorpus();
+
+  MessageCorpus(const MessageCorpus &) = delete;
+  MessageCorpus &operator=(const MessageCorpus &) = delete;
+
+  uint64_t size() const { return count; }
+  uint32_t seed() const { return seedValue; }
+
+  // The next message, starting over after the last one. The view points
+  // into the mapping and stays valid for the corpus' lifetime.
+  string_view next();
+  void rewind() { offset = HEADER_SIZE; }
+
+private:
+  static constexpr size_t HEADER_SIZE = 24;
+
+  const char *base = nullptr;
+  size_t length = 0;
+  size_t offset = HEADER_SIZE;
+  uint64_t count = 0;
+  uint32_t seedValue = 0;
+};
 } // namespace misc
@@ -0,0 +1,120 @@
+module;
+
+#include <cerrno>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+module pubsub_client;
+
+import std;
+
+using namespace std;
+
+namespace pubsub {
+
+namespace {
+sockaddr_in inetAddress(const Endpoint &endpoint) {
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = ::htons(endpoint.port);
+  if (::inet_pton(AF_INET, endpoint.host.c_str(), &addr.sin_addr) <= 0) {
+    throw runtime_error(format("Invalid address: {}", endpoint.host));
+  }
+  return addr;
+}
+
+// With SOCK_NONBLOCK in type the connect may still be in progress
+socket_t connectTo(int domain, int type, const sockaddr *addr,
+                   socklen_t len) {
+  socket_t sock = ::socket(domain, type, 0);
+  if (sock < 0) {
+    throw runtime_error(format("Socket creation failed: {}", strerror(errno)));
+  }
+  if (::connect(sock, addr, len) < 0 &&
+      !((type & SOCK_NONBLOCK) && errno == EINPROGRESS)) {
+    const int error = errno;
+    ::close(sock);
+    throw runtime_error(format("Connection failed: {}", strerror(error)));
+  }
+  return sock;
+}
+
+socket_t streamTo(const Endpoint &endpoint, int flags) {
+  if (!endpoint.local()) {
+    const auto addr = inetAddress(endpoint);
+    return connectTo(AF_INET, SOCK_STREAM | flags, (const sockaddr *)&addr,
+                     sizeof(addr));
+  }
+
+  sockaddr_un addr{};
+  if (endpoint.unixPath.size() >= sizeof(addr.sun_path)) {
+    throw runtime_error(
+        format("Unix socket path too long: {}", endpoint.unixPath));
+  }
+  addr.sun_family = AF_UNIX;
+  ranges::copy(endpoint.unixPath, addr.sun_path);
+  return connectTo(AF_UNIX,
+                   (endpoint.seqpacket ? SOCK_SEQPACKET : SOCK_STREAM) | flags,
+                   (const sockaddr *)&addr, sizeof(addr));
+}
+} // namespace
+
+string Endpoint::describe() const {
+  return local() ? format("unix:{}", unixPath) : format("{}:{}", host, port);
+}
+
+socket_t connectStream(const Endpoint &endpoint) {
+  return streamTo(endpoint, 0);
+}
+
+socket_t startConnect(const Endpoint &endpoint) {
+  return streamTo(endpoint, SOCK_NONBLOCK);
+}
+
+int finishConnect(socket_t sock) {
+  int error = 0;
+  socklen_t len = sizeof(error);
+  if (::getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+    return -errno;
+  }
+  if (error != 0) {
+    return -error;
+  }
+  const int flags = ::fcntl(sock, F_GETFL);
+  if (flags < 0 || ::fcntl(sock, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+    return -errno;
+  }
+  return 0;
+}
+
+socket_t connectDatagram(const Endpoint &endpoint) {
+  const auto addr = inetAddress(endpoint);
+  return connectTo(AF_INET, SOCK_DGRAM, (const sockaddr *)&addr,
+                   sizeof(addr));
+}
+
+bool setTcpOption(socket_t sock, int option, int value) {
+  return ::setsockopt(sock, IPPROTO_TCP, option, &value, sizeof(value)) == 0;
+}
+
+bool sendAll(socket_t sock, string_view data) {
+  while (!data.empty()) {
+    auto sent = ::send(sock, data.data(), data.size(), MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data.remove_prefix(sent);
+  }
+  return true;
+}
+
+} // namespace pubsub
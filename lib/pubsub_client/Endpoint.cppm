@@ -0,0 +1,40 @@
+export module pubsub_client:Endpoint;
+
+import std;
+import pubsub_uring;
+
+using namespace std;
+
+export namespace pubsub {
+
+// Where a client finds the broker: TCP by default, a Unix socket when
+// unixPath is set (broker_tcp --unix, or --seqpacket with seqpacket)
+struct Endpoint {
+  string host = "127.0.0.1";
+  uint16_t port = 5000;
+  string unixPath;
+  bool seqpacket = false;
+
+  bool local() const { return !unixPath.empty(); }
+  // "host:port" or "unix:path", for messages
+  string describe() const;
+};
+
+// Blocking connect. Throws runtime_error on failure.
+socket_t connectStream(const Endpoint &endpoint);
+// The same without blocking, for a caller on a ring: starts the connect and
+// returns the socket. Wait for POLLOUT on it, then call finishConnect().
+socket_t startConnect(const Endpoint &endpoint);
+// 0 once a startConnect() socket is connected, else -errno. A connected
+// socket is made blocking again, like one from connectStream().
+int finishConnect(socket_t sock);
+// A UDP socket connected to host:port, so plain send() needs no address and
+// the broker sees a distinct source port per socket
+socket_t connectDatagram(const Endpoint &endpoint);
+
+bool setTcpOption(socket_t sock, int option, int value);
+
+// Blocking send of the whole of data, for handshakes and EXIT
+bool sendAll(socket_t sock, string_view data);
+
+} // namespace pubsub
@@ -0,0 +1,51 @@
+module pubsub_client;
+
+import std;
+import MessageGenerator;
+
+using namespace std;
+
+namespace pubsub {
+
+PayloadSource::PayloadSource(misc::FastMessageGenerator &gen,
+                             misc::MessageCorpus *corpus)
+    : gen(gen), corpus(corpus) {}
+
+void PayloadSource::stampAs(uint32_t first) {
+  stamps = true;
+  firstId = first;
+}
+
+string_view PayloadSource::next(size_t connection,
+                                chrono::steady_clock::time_point intended) {
+  string_view payload;
+  if (corpus) {
+    payload = corpus->next();
+  } else {
+    payload = {buffer.data(),
+               gen.generateMessage(buffer.data(), buffer.size())};
+  }
+  if (!stamps)
+    return payload;
+
+  if (seqs.size() <= connection) {
+    seqs.resize(connection + 1);
+  }
+  const codec::Stamp stamp{
+      static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(
+                                intended.time_since_epoch())
+                                .count()),
+      codec::stampClockNs(), firstId + static_cast<uint32_t>(connection),
+      seqs[connection]++};
+  stamped.resize(codec::MAX_STAMP_SIZE);
+  stamped.resize(codec::encodeStamp(stamped, stamp));
+  stamped.append(payload);
+  return stamped;
+}
+
+Task sleepFor(Uring &ring, chrono::milliseconds duration, bool &woke) {
+  co_await ring.timeout(duration);
+  woke = true;
+}
+
+} // namespace pubsub
@@ -0,0 +1,42 @@
+export module pubsub_client:Load;
+
+import std;
+import MessageGenerator;
+import pubsub_uring;
+
+using namespace std;
+
+export namespace pubsub {
+
+// Where a publisher's rate mode takes its payloads from: a replayed corpus
+// when one was given, the table-driven generator otherwise. Once stamping is
+// on, every payload starts with a codec::Stamp.
+class PayloadSource {
+public:
+  explicit PayloadSource(misc::FastMessageGenerator &gen,
+                         misc::MessageCorpus *corpus = nullptr);
+
+  // Connection i stamps as publisher firstId + i with a sequence of its own
+  void stampAs(uint32_t firstId);
+
+  // The next payload for connection, valid until the following call.
+  // intended is the pacer tick the message belongs to, so a subscriber's
+  // latency includes any time the publisher spent behind schedule.
+  string_view next(size_t connection,
+                   chrono::steady_clock::time_point intended);
+
+private:
+  misc::FastMessageGenerator &gen;
+  misc::MessageCorpus *corpus;
+  array<char, 128> buffer{};
+  bool stamps = false;
+  uint32_t firstId = 0;
+  vector<uint64_t> seqs;
+  string stamped;
+};
+
+// Sets woke once duration has passed on ring; the interactive publishers
+// sleep this way so their sends keep completing meanwhile
+Task sleepFor(Uring &ring, chrono::milliseconds duration, bool &woke);
+
+} // namespace pubsub
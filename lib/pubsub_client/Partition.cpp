@@ -0,0 +1,116 @@
+module pubsub_client;
+
+import std;
+
+using namespace std;
+
+namespace pubsub {
+
+namespace {
+// Fixed functions rather than std::hash, so clients built against different
+// standard libraries still agree
+uint64_t fnv1a(string_view text) {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (char c : text) {
+    hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001b3;
+  }
+  return hash;
+}
+
+uint64_t mix(uint64_t x) {
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+  return x ^ (x >> 31);
+}
+
+// The key is hashed once, each broker's score mixes it with the hash of
+// the broker's entry as spelled. Names are not resolved, a name can mean a
+// different machine to each client.
+size_t owner(uint64_t key, span<const Endpoint> pool) {
+  size_t best = 0;
+  uint64_t bestScore = 0;
+  for (size_t i = 0; i < pool.size(); ++i) {
+    const uint64_t score = mix(fnv1a(pool[i].describe()) ^ key);
+    if (i == 0 || score > bestScore) {
+      best = i;
+      bestScore = score;
+    }
+  }
+  return best;
+}
+} // namespace
+
+vector<Endpoint> parseEndpoints(string_view list) {
+  vector<Endpoint> pool;
+  for (auto part : views::split(list, ',')) {
+    string_view entry(part.begin(), part.end());
+    if (entry.empty())
+      continue;
+
+    Endpoint endpoint;
+    if (entry.starts_with("unix:")) {
+      endpoint.unixPath = entry.substr(5);
+      pool.push_back(std::move(endpoint));
+      continue;
+    }
+
+    const size_t colon = entry.rfind(':');
+    const string_view port =
+        colon == string_view::npos ? "" : entry.substr(colon + 1);
+    auto [ptr, ec] =
+        from_chars(port.data(), port.data() + port.size(), endpoint.port);
+    if (colon == 0 || port.empty() || ec != errc{} ||
+        ptr != port.data() + port.size()) {
+      throw runtime_error(format("Expected HOST:PORT, got {}", entry));
+    }
+    endpoint.host = entry.substr(0, colon);
+    pool.push_back(std::move(endpoint));
+  }
+  if (pool.empty()) {
+    throw runtime_error("Empty broker list");
+  }
+  return pool;
+}
+
+size_t ownerOf(channel_t channel, span<const Endpoint> pool) {
+  return owner(mix(channel), pool);
+}
+
+size_t ownerOf(string_view topic, span<const Endpoint> pool) {
+  // Topic names and channel numbers never collide, names never start with
+  // a digit
+  return owner(fnv1a(topic), pool);
+}
+
+vector<string> splitChannelList(string_view list, span<const Endpoint> pool) {
+  vector<string> lists(pool.size());
+  auto add = [&](size_t broker, string_view token) {
+    if (!lists[broker].empty()) {
+      lists[broker].push_back(',');
+    }
+    lists[broker].append(token);
+  };
+
+  for (auto part : views::split(list, ',')) {
+    string_view token(part.begin(), part.end());
+    if (token.empty())
+      continue;
+
+    const auto channel = isdigit(static_cast<unsigned char>(token.front()))
+                             ? codec::parseChannel(token)
+                             : nullopt;
+    if (channel && *channel != protocol::CHANNEL_BROADCAST) {
+      add(ownerOf(channel_t{*channel}, pool), token);
+    } else if (codec::isValidTopic(token)) {
+      add(ownerOf(token, pool), token);
+    } else {
+      // ALL, the broadcast channel or a wildcard pattern
+      for (size_t i = 0; i < pool.size(); ++i) {
+        add(i, token);
+      }
+    }
+  }
+  return lists;
+}
+
+} // namespace pubsub
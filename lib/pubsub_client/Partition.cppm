@@ -0,0 +1,35 @@
+export module pubsub_client:Partition;
+
+import std;
+import pubsub_uring;
+import :Endpoint;
+
+using namespace std;
+
+export namespace pubsub {
+
+// Client-side scale-out over a pool of independent brokers. Every channel
+// and topic belongs to one broker of the pool, chosen by rendezvous
+// (highest random weight) hashing: each broker scores the key and the
+// highest score wins. All clients with the same pool agree on the owner
+// whatever order they list it in, and adding or removing one of N brokers
+// moves only the keys it wins or owned, about 1/N of them.
+//
+// A broker is identified by its entry exactly as written, not by the address
+// it resolves to: localhost:5000 and 127.0.0.1:5000 score differently. Every
+// client must spell each pool entry the same way, or they disagree on owners.
+
+// "host:port,unix:/path,..." Throws runtime_error on a malformed entry.
+vector<Endpoint> parseEndpoints(string_view list);
+
+// Index in pool of the broker owning a numeric channel or a topic name
+size_t ownerOf(channel_t channel, span<const Endpoint> pool);
+size_t ownerOf(string_view topic, span<const Endpoint> pool);
+
+// Splits a subscription list such as "1,2,prices.*" into one list per
+// broker of pool, empty for brokers that own none of it. "ALL" and
+// wildcard patterns go to every broker, since their messages may be
+// published on any of them.
+vector<string> splitChannelList(string_view list, span<const Endpoint> pool);
+
+} // namespace pubsub
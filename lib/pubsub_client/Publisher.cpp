@@ -0,0 +1,250 @@
+module;
+
+#include <cerrno>
+#include <cstring>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+#include <liburing.h>
+
+module pubsub_client;
+
+import std;
+
+using namespace std;
+
+namespace pubsub {
+
+namespace {
+// Stream frames end with a newline, datagrams do not
+constexpr string_view EXIT_FRAME = "[[EXIT]]\n";
+} // namespace
+
+StreamPublisher::BatchTimer::BatchTimer() {
+  onComplete = [](Completion *self, int, uint32_t) {
+    auto *timer = static_cast<BatchTimer *>(self);
+    timer->armed = false;
+    timer->owner->onBatchTimer();
+  };
+}
+
+StreamPublisher::StreamPublisher(Uring &ring, const Endpoint &endpoint,
+                                 string_view handshake,
+                                 const PublisherOptions &options)
+    : ring(ring), options(options), S(connectStream(endpoint)),
+      records(endpoint.seqpacket) {
+  batchTimer.owner = this;
+  const bool optionsSet =
+      endpoint.local() ||
+      ((!options.noDelay || setTcpOption(S, TCP_NODELAY, 1)) &&
+       (!options.cork || setTcpOption(S, TCP_CORK, 1)));
+  if (!optionsSet) {
+    println(stderr, "\033[31mFailed to set TCP options: {}\033[0m",
+            strerror(errno));
+  }
+  if (!sendAll(S, handshake)) {
+    const int error = errno;
+    ::close(S);
+    throw runtime_error(
+        format("Failed to send handshake: {}", strerror(error)));
+  }
+}
+
+StreamPublisher::~StreamPublisher() {
+  // The timer's CQE must not outlive it; without a cancel it fires within
+  // batchDelay
+  pending.clear();
+  if (batchTimer.armed) {
+    ring.prepCancel(&batchTimer);
+  }
+  while (batchTimer.armed) {
+    if (int ret = ring.waitAndComplete(); ret < 0 && ret != -EINTR)
+      break;
+  }
+  ::close(S);
+}
+
+bool StreamPublisher::publish(channel_t channel, string_view payload) {
+  const size_t offset = pending.size();
+  if (offset >= options.maxPendingBytes)
+    return false;
+  if (offset == 0) {
+    pendingSince = chrono::steady_clock::now();
+    armBatchTimer();
+  }
+
+  // Encoded in place, the prefix and newline fit in the slack
+  pending.resize(offset + payload.size() + 16);
+  const auto frameLen =
+      codec::encodeMessage(span(pending).subspan(offset), channel, payload);
+  pending.resize(offset + frameLen);
+  return frameLen != 0;
+}
+
+void StreamPublisher::flush() {
+  if (!inFlight && !broken && !pending.empty()) {
+    writeBacklog();
+  }
+}
+
+void StreamPublisher::flushIfDue(chrono::steady_clock::time_point now) {
+  if (pending.size() >= options.batchBytes ||
+      now - pendingSince >= options.batchDelay) {
+    flush();
+  }
+}
+
+void StreamPublisher::armBatchTimer() {
+  // Without a byte threshold every flushIfDue() writes, nothing to time
+  if (batchTimer.armed || options.batchBytes == 0 ||
+      options.batchDelay <= chrono::microseconds::zero())
+    return;
+
+  // steady_clock is CLOCK_MONOTONIC, the clock absolute timeouts use
+  const auto ns = chrono::duration_cast<chrono::nanoseconds>(
+                      (pendingSince + options.batchDelay).time_since_epoch())
+                      .count();
+  batchTimer.ts.tv_sec = ns / 1'000'000'000;
+  batchTimer.ts.tv_nsec = ns % 1'000'000'000;
+  // Without an SQE the backlog waits for the next flushIfDue()
+  batchTimer.armed = ring.prepTimeout(&batchTimer.ts, &batchTimer, true);
+}
+
+void StreamPublisher::onBatchTimer() {
+  if (pending.empty() || broken)
+    return;
+  // Fired or cancelled for an older backlog: this one gets its own deadline
+  if (chrono::steady_clock::now() - pendingSince >= options.batchDelay) {
+    flush();
+  } else {
+    armBatchTimer();
+  }
+}
+
+bool StreamPublisher::drain(chrono::steady_clock::time_point deadline) {
+  while (busy() && chrono::steady_clock::now() < deadline) {
+    flush();
+    if (ring.pollAndComplete() < 0)
+      break;
+  }
+  return !busy() && !broken;
+}
+
+bool StreamPublisher::sendExit() {
+  return broken || sendAll(S, EXIT_FRAME);
+}
+
+Task StreamPublisher::writeBacklog() {
+  inFlight = true;
+
+  while (!pending.empty() && !broken) {
+    swap(pending, inflight);
+    string_view data = inflight;
+    // The backlog it was timing is on its way
+    if (batchTimer.armed) {
+      ring.prepCancel(&batchTimer);
+    }
+
+    while (!data.empty()) {
+      const auto chunk =
+          records ? data.substr(0, codec::findFrameEnd(data)) : data;
+      int res = co_await ring.send(S, chunk);
+      if (res == -EBUSY) {
+        co_await ring.yield();
+        continue;
+      }
+      if (res == -EINTR || res == -EAGAIN)
+        continue;
+      if (res <= 0) {
+        println(stderr, "\033[31mSend failed on fd={}: {}\033[0m", S,
+                res == 0 ? "connection closed" : strerror(-res));
+        broken = true;
+        break;
+      }
+      data.remove_prefix(res);
+    }
+    inflight.clear();
+
+    if (options.cork && !broken) {
+      // Pushes out the partial segment, then holds the next batch again
+      setTcpOption(S, TCP_CORK, 0);
+      setTcpOption(S, TCP_CORK, 1);
+    }
+  }
+
+  inFlight = false;
+}
+
+DatagramPublisher::Slot::Slot() {
+  onComplete = [](Completion *self, int res, uint32_t) {
+    auto *slot = static_cast<Slot *>(self);
+    slot->busy = false;
+    if (res < 0) {
+      ++*slot->errors;
+    }
+  };
+}
+
+DatagramPublisher::DatagramPublisher(Uring &ring, const Endpoint &endpoint,
+                                     string_view handshake)
+    : ring(ring), S(connectDatagram(endpoint)), slots(MAX_INFLIGHT) {
+  for (auto &slot : slots) {
+    slot.errors = &sendErrors;
+  }
+  if (!sendAll(S, handshake)) {
+    const int error = errno;
+    ::close(S);
+    throw runtime_error(
+        format("Failed to send handshake: {}", strerror(error)));
+  }
+}
+
+DatagramPublisher::~DatagramPublisher() {
+  // Slots must not go away while the kernel still reads them
+  while (busy()) {
+    if (int ret = ring.waitAndComplete(); ret < 0 && ret != -EINTR)
+      break;
+  }
+  ::close(S);
+}
+
+DatagramPublisher::Slot *DatagramPublisher::freeSlot() {
+  for (size_t i = 0; i < slots.size(); ++i) {
+    auto &slot = slots[(nextSlot + i) % slots.size()];
+    if (!slot.busy) {
+      nextSlot = (nextSlot + i + 1) % slots.size();
+      return &slot;
+    }
+  }
+  return nullptr;
+}
+
+DatagramPublisher::Result DatagramPublisher::publish(channel_t channel,
+                                                     string_view payload) {
+  auto *slot = freeSlot();
+  if (!slot)
+    return Result::FULL;
+
+  slot->len = codec::encodeMessage(slot->data, channel, payload, false);
+  if (slot->len == 0)
+    return Result::TOO_LARGE;
+  if (!ring.prepSend(S, span(slot->data.data(), slot->len), slot))
+    return Result::NO_SQE;
+  slot->busy = true;
+  queuedBytes += slot->len;
+  return Result::QUEUED;
+}
+
+bool DatagramPublisher::ready() const {
+  return ranges::any_of(slots, [](const Slot &s) { return !s.busy; });
+}
+
+bool DatagramPublisher::busy() const {
+  return ranges::any_of(slots, [](const Slot &s) { return s.busy; });
+}
+
+bool DatagramPublisher::sendExit() { return sendAll(S, protocol::EXIT_MSG); }
+
+} // namespace pubsub
@@ -0,0 +1,146 @@
+module;
+
+#include <liburing.h>
+
+export module pubsub_client:Publisher;
+
+import std;
+import pubsub_uring;
+import :Endpoint;
+
+using namespace std;
+
+export namespace pubsub {
+
+struct PublisherOptions {
+  // TCP only: TCP_NODELAY, or TCP_CORK released after every write so
+  // segments leave full
+  bool noDelay = false;
+  bool cork = false;
+  // flushIfDue() writes the backlog once it holds batchBytes or its oldest
+  // frame is batchDelay old, and a ring timeout writes it at that age
+  // between calls. 0 bytes writes it on every call.
+  uint32_t batchBytes = 0;
+  chrono::microseconds batchDelay{0};
+  // publish() refuses frames past this much backlog
+  size_t maxPendingBytes = 1 << 20;
+};
+
+// A publisher connection over TCP or a Unix socket. publish() only appends
+// the frame to a backlog; flush() hands the backlog to the ring as one send,
+// and frames published while it is in flight go out together in the next.
+// Must not move once used, the send and the batch timer hold references.
+class StreamPublisher {
+public:
+  // Connects and sends handshake. Throws runtime_error on failure.
+  StreamPublisher(Uring &ring, const Endpoint &endpoint, string_view handshake,
+                  const PublisherOptions &options = {});
+  // Waits for the batch timer's cancellation
+  ~StreamPublisher();
+
+  StreamPublisher(const StreamPublisher &) = delete;
+  StreamPublisher &operator=(const StreamPublisher &) = delete;
+
+  // false when the frame does not fit in the backlog
+  bool publish(channel_t channel, string_view payload);
+
+  // Starts writing the backlog unless a write is already in flight
+  void flush();
+  // flush() if the batching thresholds are met at now
+  void flushIfDue(chrono::steady_clock::time_point now);
+
+  // Flushes and drives the ring until the backlog is written, the
+  // connection fails or deadline passes. Returns true once it is written.
+  bool drain(chrono::steady_clock::time_point deadline);
+
+  // Says goodbye to the broker, blocking
+  bool sendExit();
+
+  socket_t fd() const { return S; }
+  size_t pendingBytes() const { return pending.size(); }
+  bool sending() const { return inFlight; }
+  bool failed() const { return broken; }
+  bool busy() const { return !broken && (inFlight || !pending.empty()); }
+
+private:
+  // Fires when the oldest pending frame is batchDelay old
+  struct BatchTimer : Completion {
+    StreamPublisher *owner = nullptr;
+    __kernel_timespec ts{};
+    bool armed = false;
+
+    BatchTimer();
+  };
+
+  Task writeBacklog();
+  void armBatchTimer();
+  void onBatchTimer();
+
+  Uring &ring;
+  PublisherOptions options;
+  socket_t S = -1;
+  string pending;
+  string inflight;
+  // When the first frame now in pending was added
+  chrono::steady_clock::time_point pendingSince;
+  // SOCK_SEQPACKET: each send is one record, so one frame per send
+  bool records = false;
+  bool inFlight = false;
+  bool broken = false;
+  BatchTimer batchTimer;
+};
+
+// Largest datagram a publisher sends, below a typical path MTU
+constexpr size_t MAX_DATAGRAM = 1400;
+
+// A publisher socket for broker_udp. Every message is its own datagram and
+// its own send SQE, from a fixed set of slots owned by the ring until the
+// send completes.
+class DatagramPublisher {
+public:
+  static constexpr size_t MAX_INFLIGHT = 32;
+
+  // Connects and sends handshake. Throws runtime_error on failure.
+  DatagramPublisher(Uring &ring, const Endpoint &endpoint,
+                    string_view handshake);
+  // Waits for the slots the kernel still reads
+  ~DatagramPublisher();
+
+  DatagramPublisher(const DatagramPublisher &) = delete;
+  DatagramPublisher &operator=(const DatagramPublisher &) = delete;
+
+  enum class Result { QUEUED, FULL, TOO_LARGE, NO_SQE };
+
+  // FULL when every slot is in flight
+  Result publish(channel_t channel, string_view payload);
+
+  bool ready() const;
+  bool busy() const;
+  uint64_t errors() const { return sendErrors; }
+  // Datagram bytes handed to the ring so far
+  uint64_t bytesQueued() const { return queuedBytes; }
+  socket_t fd() const { return S; }
+
+  bool sendExit();
+
+private:
+  struct Slot : Completion {
+    array<char, MAX_DATAGRAM> data;
+    size_t len = 0;
+    bool busy = false;
+    uint64_t *errors = nullptr;
+
+    Slot();
+  };
+
+  Slot *freeSlot();
+
+  Uring &ring;
+  socket_t S = -1;
+  vector<Slot> slots;
+  size_t nextSlot = 0;
+  uint64_t sendErrors = 0;
+  uint64_t queuedBytes = 0;
+};
+
+} // namespace pubsub
@@ -0,0 +1,96 @@
+module;
+
+#include <cerrno>
+#include <cstring>
+
+#include <unistd.h>
+
+module pubsub_client;
+
+import std;
+
+using namespace std;
+
+namespace pubsub {
+
+namespace {
+constexpr string_view EXIT_FRAME = "[[EXIT]]\n";
+} // namespace
+
+StreamSubscriber::StreamSubscriber(Uring &ring, BufferRing &buffers,
+                                   const Endpoint &endpoint,
+                                   string_view handshake)
+    : StreamSubscriber(ring, buffers, connectStream(endpoint), handshake) {}
+
+StreamSubscriber::StreamSubscriber(Uring &ring, BufferRing &buffers,
+                                   socket_t connected, string_view handshake)
+    : ring(ring), buffers(buffers), S(connected) {
+  if (!sendAll(S, handshake)) {
+    const int error = errno;
+    ::close(S);
+    throw runtime_error(
+        format("Failed to send handshake: {}", strerror(error)));
+  }
+}
+
+StreamSubscriber::~StreamSubscriber() { ::close(S); }
+
+Task StreamSubscriber::changeSubscription(bool subscribe, string channels) {
+  return sendControl(codec::makeControl(subscribe, channels));
+}
+
+Task StreamSubscriber::changeSession(bool subscribe, uint32_t session,
+                                     string channels) {
+  return sendControl(codec::makeSessionControl(subscribe, session, channels));
+}
+
+Task StreamSubscriber::openSessions(uint32_t count, string_view channels) {
+  string frames;
+  for (uint32_t session = 1; session <= count; ++session) {
+    frames += codec::makeSessionControl(true, session, channels);
+  }
+  return sendControl(std::move(frames));
+}
+
+Task StreamSubscriber::sendControl(string frames) {
+  string_view rest = frames;
+  while (!rest.empty()) {
+    int sent = co_await ring.send(S, rest);
+    if (sent == -EBUSY) {
+      co_await ring.yield();
+      continue;
+    }
+    if (sent == -EINTR || sent == -EAGAIN)
+      continue;
+    if (sent < 0) {
+      println(stderr, "\033[31mFailed to send {}: {}\033[0m",
+              frames.substr(0, frames.find('\n')), strerror(-sent));
+      co_return;
+    }
+    // Short write, send the rest
+    rest.remove_prefix(sent);
+  }
+}
+
+bool StreamSubscriber::sendExit() {
+  // The broker may already be gone
+  return sendAll(S, EXIT_FRAME) || isClosed;
+}
+
+DatagramSubscriber::DatagramSubscriber(Uring &ring, BufferRing &buffers,
+                                       const Endpoint &endpoint,
+                                       string_view handshake)
+    : ring(ring), buffers(buffers), S(connectDatagram(endpoint)) {
+  if (!sendAll(S, handshake)) {
+    const int error = errno;
+    ::close(S);
+    throw runtime_error(
+        format("Failed to send handshake: {}", strerror(error)));
+  }
+}
+
+DatagramSubscriber::~DatagramSubscriber() { ::close(S); }
+
+bool DatagramSubscriber::sendExit() { return sendAll(S, protocol::EXIT_MSG); }
+
+} // namespace pubsub
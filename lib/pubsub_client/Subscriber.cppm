@@ -0,0 +1,197 @@
+module;
+
+#include <cerrno>
+#include <cstring>
+
+export module pubsub_client:Subscriber;
+
+import std;
+import pubsub_uring;
+import :Endpoint;
+
+using namespace std;
+
+export namespace pubsub {
+
+// What a subscriber callback gets: one complete frame, pointing straight into
+// the ring's receive buffer. Valid only until the callback returns. The
+// broker strips the [CH:N] prefix, so a frame is the payload alone: with its
+// newline from a StreamSubscriber, without one from a DatagramSubscriber,
+// and as [S:1,5,9]payload plus newline from a [[MUX]] connection.
+using Frame = span<const byte>;
+
+inline string_view frameText(Frame frame) {
+  return {reinterpret_cast<const char *>(frame.data()), frame.size()};
+}
+
+// A subscriber connection over TCP or a Unix socket. Receives into the
+// provided buffers of a BufferRing shared by every subscriber on the ring
+// and hands frames to the callback in place; only a frame split across two
+// receives is copied, into a buffer that is reused.
+class StreamSubscriber {
+public:
+  // Longest frame carried over from one receive to the next
+  static constexpr size_t MAX_FRAME_SIZE = 64 * 1024;
+
+  // Connects and sends handshake. Throws runtime_error on failure.
+  StreamSubscriber(Uring &ring, BufferRing &buffers, const Endpoint &endpoint,
+                   string_view handshake);
+  // Takes over a connected socket, one from startConnect() for instance, and
+  // sends handshake. Closes it and throws runtime_error on failure.
+  StreamSubscriber(Uring &ring, BufferRing &buffers, socket_t connected,
+                   string_view handshake);
+  ~StreamSubscriber();
+
+  StreamSubscriber(const StreamSubscriber &) = delete;
+  StreamSubscriber &operator=(const StreamSubscriber &) = delete;
+
+  // Calls onMessage(Frame, recvNs) for every frame, newline included,
+  // until the broker closes the connection or onMessage returns false
+  template <typename OnMessage> Task receive(OnMessage onMessage) {
+    RecvStream stream(ring, S, buffers);
+    while (!isClosed) {
+      int res = co_await stream.next();
+      const uint64_t recvNs = codec::stampClockNs();
+
+      if (res == -EBUSY) {
+        // Not armed, nothing can be lost while the ring reaps
+        co_await ring.yield();
+        continue;
+      }
+      if (res == -ENOBUFS || res == -EINTR || res == -EAGAIN)
+        continue;
+      if (res <= 0) {
+        if (res < 0) {
+          println(stderr, "\033[31mReceive failed on fd={}: {}\033[0m", S,
+                  strerror(-res));
+        } else {
+          println("\033[33mConnection fd={} closed by broker\033[0m", S);
+        }
+        break;
+      }
+
+      bool more = true;
+      if (!feed(string_view(stream.data().data(), res), [&](string_view f) {
+            more = more && onMessage(as_bytes(span(f)), recvNs);
+          })) {
+        println(stderr, "\033[31mReceive buffer overflow on fd={}\033[0m", S);
+        break;
+      }
+      if (!more)
+        break;
+    }
+    isClosed = true;
+
+    stream.stop();
+    while (stream.armed()) {
+      co_await stream.next();
+    }
+  }
+
+  // Sends [[+SUB:channels]] or [[-SUB:channels]] through the ring
+  Task changeSubscription(bool subscribe, string channels);
+  // The same for one session of a [[MUX]] connection; the first subscribe
+  // opens it, empty channels with subscribe unset close it
+  Task changeSession(bool subscribe, uint32_t session, string channels);
+  // Opens sessions 1..count, all on channels, in one write
+  Task openSessions(uint32_t count, string_view channels);
+  // Control frames as codec::makeControl and makeSessionControl build them,
+  // several in one write
+  Task sendControl(string frames);
+
+  // Says goodbye to the broker, blocking
+  bool sendExit();
+
+  socket_t fd() const { return S; }
+  bool closed() const { return isClosed; }
+
+private:
+  // Calls onFrame for every complete frame in data. Returns false if a
+  // frame outgrows MAX_FRAME_SIZE.
+  template <typename OnFrame> bool feed(string_view data, OnFrame &&onFrame) {
+    if (!carry.empty()) {
+      const size_t end = codec::findFrameEnd(data);
+      if (end == string_view::npos) {
+        carry.append(data);
+        return carry.size() <= MAX_FRAME_SIZE;
+      }
+      carry.append(data.substr(0, end));
+      onFrame(string_view(carry));
+      carry.clear();
+      data.remove_prefix(end);
+    }
+
+    for (size_t end; (end = codec::findFrameEnd(data)) != string_view::npos;
+         data.remove_prefix(end)) {
+      onFrame(data.substr(0, end));
+    }
+    carry.assign(data);
+    return carry.size() <= MAX_FRAME_SIZE;
+  }
+
+  Uring &ring;
+  BufferRing &buffers;
+  socket_t S = -1;
+  // Start of a frame split across receives
+  string carry;
+  bool isClosed = false;
+};
+
+// A subscriber socket for broker_udp. Every datagram is one frame, without
+// a newline, so nothing is ever copied.
+class DatagramSubscriber {
+public:
+  // Connects and sends handshake. Throws runtime_error on failure.
+  DatagramSubscriber(Uring &ring, BufferRing &buffers,
+                     const Endpoint &endpoint, string_view handshake);
+  ~DatagramSubscriber();
+
+  DatagramSubscriber(const DatagramSubscriber &) = delete;
+  DatagramSubscriber &operator=(const DatagramSubscriber &) = delete;
+
+  // Calls onMessage(Frame, recvNs) for every non-empty datagram until
+  // onMessage returns false or the receive fails
+  template <typename OnMessage> Task receive(OnMessage onMessage) {
+    RecvStream stream(ring, S, buffers);
+    while (!isClosed) {
+      int res = co_await stream.next();
+      const uint64_t recvNs = codec::stampClockNs();
+
+      if (res == -EBUSY) {
+        // Not armed, nothing can be lost while the ring reaps
+        co_await ring.yield();
+        continue;
+      }
+      if (res == -ENOBUFS || res == -EINTR || res == -EAGAIN)
+        continue;
+      if (res < 0) {
+        println(stderr, "\033[31mReceive failed on fd={}: {}\033[0m", S,
+                strerror(-res));
+        break;
+      }
+      if (res > 0 &&
+          !onMessage(as_bytes(stream.data().first(res)), recvNs)) {
+        break;
+      }
+    }
+    isClosed = true;
+
+    stream.stop();
+    while (stream.armed()) {
+      co_await stream.next();
+    }
+  }
+
+  bool sendExit();
+
+  socket_t fd() const { return S; }
+  bool closed() const { return isClosed; }
+
+private:
+  Uring &ring;
+  BufferRing &buffers;
+  socket_t S = -1;
+  bool isClosed = false;
+};
+
+} // namespace pubsub
@@ -0,0 +1,7 @@
+export module pubsub_client;
+
+export import :Endpoint;
+export import :Load;
+export import :Partition;
+export import :Publisher;
+export import :Subscriber;
@@ -0,0 +1,1665 @@
+module;
+
+#include <cerrno>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+module pubsub_uring;
+
+import std;
+
+using namespace std;
+
+namespace pubsub {
+
+namespace {
+// Everything the event loop logs goes through the Logger ring; the order
+// here must match BROKER_LOG below
+enum class LogId : uint16_t {
+  CLIENT_ADDED,
+  CLIENT_REMOVED,
+  SUBSCRIBED,
+  SUBSCRIBED_TOPIC,
+  UNSUBSCRIBED,
+  UNSUBSCRIBED_TOPIC,
+  HANDSHAKE_PUBLISHER,
+  HANDSHAKE_PUBLISHER_TOPICS,
+  HANDSHAKE_SUBSCRIBER_ALL,
+  HANDSHAKE_SUBSCRIBER,
+  INVALID_HANDSHAKE,
+  MESSAGE_TOO_LARGE,
+  INVALID_MESSAGE,
+  EXIT,
+  ROUTE,
+  QUEUE_FULL,
+  ACCEPT_FAILED,
+  DISCONNECT,
+  RECV_FAILED,
+  SEND_FAILED,
+  INVALID_LOCAL_TOPIC,
+  HANDSHAKE_MUX,
+  SESSION_OPENED,
+  SESSION_CLOSED,
+  SESSION_LIMIT,
+  PEER_LINKED,
+  PEER_REJECTED,
+  PEER_LOST,
+  DIAL_FAILED,
+  HANDSHAKE_REPLICA,
+  REPLICA_REFUSED,
+  PRIMARY_LOST,
+  STANDBY_LINKED,
+  STANDBY_LOST,
+  STANDBY_BEHIND,
+  HANDOFF_STARTED,
+  HANDOFF_FAILED,
+  HANDED_OFF,
+  COUNT,
+};
+
+constexpr array<LogFormat, to_underlying(LogId::COUNT)> BROKER_LOG{{
+    {"\033[36m[+] Client fd={} added (state=HANDSHAKE)\033[0m"},
+    {"\033[36m[-] Client fd={} removed\033[0m"},
+    {"\033[33m[SUB] fd={} subscribed to channel {}\033[0m"},
+    {"\033[33m[SUB] fd={} subscribed to topic {}\033[0m"},
+    {"\033[33m[UNSUB] fd={} unsubscribed from channel {}\033[0m"},
+    {"\033[33m[UNSUB] fd={} unsubscribed from topic {}\033[0m"},
+    {"\033[32m[HANDSHAKE] fd={} registered as PUBLISHER on channel {}\033[0m"},
+    {"\033[32m[HANDSHAKE] fd={} registered as PUBLISHER on {} topic(s): "
+     "{}\033[0m"},
+    {"\033[32m[HANDSHAKE] fd={} registered as SUBSCRIBER on ALL "
+     "channels\033[0m"},
+    {"\033[32m[HANDSHAKE] fd={} registered as SUBSCRIBER on channels: "
+     "{}\033[0m"},
+    {"\033[31m[ERROR] Invalid handshake from fd={}\033[0m", true},
+    {"\033[31m[ERROR] Message too large from fd={}\033[0m", true},
+    {"\033[31m[ERROR] Invalid message format from fd={}: {}\033[0m", true},
+    {"\033[33m[EXIT] fd={} sent EXIT message\033[0m"},
+    {"\033[35m[ROUTE] Channel {} from fd={}: {}\033[0m"},
+    {"\033[31m[WARN] Send queue full for fd={}, dropping message\033[0m"},
+    {"\033[31mAccept failed: {}\033[0m", true},
+    {"\033[33m[DISCONNECT] fd={} closed connection\033[0m"},
+    {"\033[31m[ERROR] Recv failed on fd={}: {}\033[0m", true},
+    {"\033[31m[ERROR] Send failed on fd={}: {}\033[0m", true},
+    {"\033[31m[ERROR] Invalid topic from in-process publisher: {}\033[0m",
+     true},
+    {"\033[32m[HANDSHAKE] fd={} registered as MUX gateway\033[0m"},
+    {"\033[33m[SES] fd={} opened session {}\033[0m"},
+    {"\033[33m[SES] fd={} closed session {}\033[0m"},
+    {"\033[31m[ERROR] fd={} is over the session limit, dropped session "
+     "{}\033[0m",
+     true},
+    {"\033[32m[PEER] fd={} linked to broker {}\033[0m"},
+    {"\033[31m[ERROR] fd={} refused as peer broker {}\033[0m", true},
+    {"\033[33m[PEER] Link to broker {} lost\033[0m"},
+    {"\033[31m[LINK] Dialing {}:{} failed: {}\033[0m", true},
+    {"\033[32m[HANDSHAKE] fd={} registered as REPLICA link from a "
+     "primary\033[0m"},
+    {"\033[31m[ERROR] fd={} refused as replica link, not a standby\033[0m",
+     true},
+    {"\033[33m[REPL] Primary link fd={} lost, keeping {} sessions for "
+     "{}s\033[0m"},
+    {"\033[32m[REPL] Replicating to standby on fd={}\033[0m"},
+    {"\033[33m[REPL] Link to standby lost\033[0m"},
+    {"\033[31m[REPL] Standby fd={} fell behind, relinking\033[0m", true},
+    {"\033[33m[RESTART] fd={} is taking over, handing off\033[0m"},
+    {"\033[31m[RESTART] Handoff failed, carrying on: {}\033[0m", true},
+    {"\033[33m[RESTART] Handed {} listener(s) and {} client(s) to the new "
+     "broker\033[0m"},
+}};
+
+// Between attempts to dial a peer or the standby
+constexpr chrono::seconds PEER_RETRY{1};
+// Client::dialedFrom of the primary's link to its standby
+constexpr int DIALED_STANDBY = -2;
+// Between checks for the cancelled operations of a handoff to finish
+constexpr chrono::milliseconds HANDOFF_POLL{1};
+// Longest the successor waits for the old broker to exit
+constexpr chrono::seconds HANDOFF_EXIT_WAIT{5};
+
+sockaddr_un unixAddress(const string &path) {
+  sockaddr_un addr{};
+  if (path.size() >= sizeof(addr.sun_path)) {
+    throw runtime_error(format("Unix socket path too long: {}", path));
+  }
+  addr.sun_family = AF_UNIX;
+  ranges::copy(path, addr.sun_path);
+  return addr;
+}
+
+// payload and a newline, shared from the start so that routing the line to
+// local subscribers never copies it
+shared_ptr<const string> makeSharedLine(string_view payload) {
+  auto line = make_shared<string>();
+  line->reserve(payload.size() + 1);
+  line->append(payload).push_back('\n');
+  return line;
+}
+} // namespace
+
+Broker::Broker(bool verbose)
+    : Ring(256), RecvBuffers(protocol::BUFFER_SIZE, 64),
+      Metrics([](uint64_t fd) { return to_string(fd); }), Log(BROKER_LOG),
+      verbose(verbose) {
+  Ring.attachMetrics(&Metrics.ring);
+
+  Wake = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (Wake < 0) {
+    throw runtime_error(format("eventfd failed: {}", strerror(errno)));
+  }
+}
+
+Broker::~Broker() {
+  for (const auto &listener : Listeners) {
+    ::close(listener.S);
+    if (!listener.path.empty()) {
+      ::unlink(listener.path.c_str());
+    }
+  }
+  for (auto &[s, client] : Clients) {
+    ::close(s);
+  }
+  if (HandoffListener >= 0) {
+    ::close(HandoffListener);
+    if (!HandoffPath.empty()) {
+      ::unlink(HandoffPath.c_str());
+    }
+  }
+  // The successor reuses the segment's name once this broker is gone, so the
+  // old segment must be unlinked first rather than by the member destructors
+  Shm.reset();
+  // Last, the successor takes it closing to mean this broker is gone
+  if (Successor >= 0) {
+    ::close(Successor);
+  }
+  ::close(Wake);
+}
+
+void Broker::listenOn(Listener listener, const sockaddr *addr,
+                      socklen_t len) {
+  const socket_t fd = listener.S;
+
+  // Set non-blocking
+  int flags = ::fcntl(fd, F_GETFL, 0);
+  if (flags < 0 || ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    ::close(fd);
+    throw runtime_error(
+        format("Failed to set non-blocking: {}", strerror(errno)));
+  }
+
+  if (::bind(fd, addr, len) < 0) {
+    ::close(fd);
+    throw runtime_error(format("Bind failed: {}", strerror(errno)));
+  }
+
+  if (::listen(fd, SOMAXCONN) < 0) {
+    ::close(fd);
+    throw runtime_error(format("Listen failed: {}", strerror(errno)));
+  }
+
+  Listeners.push_back(std::move(listener));
+}
+
+void Broker::setupListenSocket(const string &host, uint16_t port) {
+  socket_t fd = ::socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    throw runtime_error(format("Socket creation failed: {}", strerror(errno)));
+  }
+
+  int opt = 1;
+  if (::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+    ::close(fd);
+    throw runtime_error(format("setsockopt failed: {}", strerror(errno)));
+  }
+
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = ::htons(port);
+  if (::inet_pton(AF_INET, host.c_str(), &addr.sin_addr) <= 0) {
+    ::close(fd);
+    throw runtime_error(format("Invalid address: {}", host));
+  }
+
+  listenOn({fd, false, {}}, (sockaddr *)&addr, sizeof(addr));
+  println("\033[32mBroker listening on {}:{}\033[0m", host, port);
+}
+
+void Broker::setupUnixSocket(const string &path, bool seqpacket) {
+  const sockaddr_un addr = unixAddress(path);
+  socket_t fd = ::socket(AF_UNIX, seqpacket ? SOCK_SEQPACKET : SOCK_STREAM, 0);
+  if (fd < 0) {
+    throw runtime_error(format("Socket creation failed: {}", strerror(errno)));
+  }
+
+  // A stale socket file from an earlier run would fail the bind
+  ::unlink(path.c_str());
+  listenOn({fd, seqpacket, path}, (sockaddr *)&addr, sizeof(addr));
+  println("\033[32mBroker listening on unix:{} ({})\033[0m", path,
+          seqpacket ? "seqpacket" : "stream");
+}
+
+void Broker::setupSharedMemory(const string &name) {
+  Shm.emplace(name);
+  println("\033[32mLocal subscribers can read shm:{}\033[0m", name);
+}
+
+void Broker::setupFederation(uint32_t id) {
+  if (id == 0) {
+    throw runtime_error("Federation id must not be 0");
+  }
+  FederationId = id;
+  // Starts at the wall clock, so a restarted broker's messages are newer
+  // than whatever its peers remember of it
+  ForwardSeq = chrono::duration_cast<chrono::nanoseconds>(
+                   chrono::system_clock::now().time_since_epoch())
+                   .count();
+  println("\033[32mFederated as broker {}\033[0m", id);
+}
+
+void Broker::addPeer(const string &host, uint16_t port) {
+  in_addr addr{};
+  if (FederationId == 0) {
+    throw runtime_error("Peers need a federation id");
+  }
+  if (::inet_pton(AF_INET, host.c_str(), &addr) <= 0) {
+    throw runtime_error(format("Invalid peer address: {}", host));
+  }
+  PeerAddresses.push_back({host, port});
+}
+
+void Broker::setupReplication(const string &host, uint16_t port) {
+  in_addr addr{};
+  if (::inet_pton(AF_INET, host.c_str(), &addr) <= 0) {
+    throw runtime_error(format("Invalid standby address: {}", host));
+  }
+  StandbyAddress = PeerAddress{host, port};
+  println("\033[32mReplicating to standby {}:{}\033[0m", host, port);
+}
+
+void Broker::setupHandoff(const string &path) {
+  const sockaddr_un addr = unixAddress(path);
+  socket_t fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    throw runtime_error(format("Socket creation failed: {}", strerror(errno)));
+  }
+
+  // Still bound by the broker this one took over from, if any
+  ::unlink(path.c_str());
+  if (::bind(fd, (const sockaddr *)&addr, sizeof(addr)) < 0 ||
+      ::listen(fd, 1) < 0) {
+    const int err = errno;
+    ::close(fd);
+    throw runtime_error(
+        format("Handoff socket {} failed: {}", path, strerror(err)));
+  }
+  HandoffListener = fd;
+  HandoffPath = path;
+  println("\033[32mA broker started with --restart-socket {} takes over "
+          "from this one\033[0m",
+          path);
+}
+
+bool Broker::takeOver(const string &path) {
+  const sockaddr_un addr = unixAddress(path);
+  socket_t fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    throw runtime_error(format("Socket creation failed: {}", strerror(errno)));
+  }
+  if (::connect(fd, (const sockaddr *)&addr, sizeof(addr)) < 0) {
+    // A first start, or a stale socket file
+    ::close(fd);
+    return false;
+  }
+
+  size_t listeners = 0;
+  size_t clients = 0;
+  try {
+    while (true) {
+      auto record = handoff::receiveRecord(fd);
+      if (!record) {
+        throw runtime_error("The old broker went away during the handoff");
+      }
+      if (record->kind == handoff::Kind::DONE)
+        break;
+
+      if (record->kind == handoff::Kind::LISTENER) {
+        auto listener = handoff::decodeListener(record->payload);
+        if (record->fd < 0 || !listener) {
+          ::close(record->fd);
+          throw runtime_error("Invalid listener in the handoff");
+        }
+        Listeners.push_back(
+            {record->fd, listener->first, std::move(listener->second)});
+        ++listeners;
+      } else {
+        auto state = handoff::decodeClient(record->payload);
+        if (record->kind != handoff::Kind::CLIENT || record->fd < 0 ||
+            !state) {
+          ::close(record->fd);
+          throw runtime_error("Invalid client in the handoff");
+        }
+        restoreClient(record->fd, *state);
+        ++clients;
+      }
+    }
+  } catch (...) {
+    ::close(fd);
+    throw;
+  }
+
+  // The old broker closes its end as it exits
+  const auto wait = HANDOFF_EXIT_WAIT;
+  timeval timeout{static_cast<time_t>(wait.count()), 0};
+  ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  char byte;
+  while (::recv(fd, &byte, 1, 0) > 0) {
+  }
+  ::close(fd);
+
+  checkInterest();
+  println("\033[32mTook over {} listener(s) and {} client(s) from the old "
+          "broker\033[0m",
+          listeners, clients);
+  return true;
+}
+
+void Broker::setupStandby() {
+  Standby = true;
+  println("\033[32mStandby: accepting a primary's replication link\033[0m");
+}
+
+Client &Broker::addClient(socket_t fd, bool records) {
+  auto [it, _] = Clients.emplace(fd, Client(fd));
+  it->second.records = records;
+  it->second.recvBufferId = RecvBuffers.acquire();
+  it->second.metrics = Metrics.attach(fd);
+  Metrics.clients.set(Clients.size());
+  if (verbose) {
+    Log.log(LogId::CLIENT_ADDED, fd);
+  }
+  return it->second;
+}
+
+void Broker::removeClient(socket_t fd) {
+  auto it = Clients.find(fd);
+  if (it == Clients.end())
+    return;
+
+  auto &client = it->second;
+
+  // Remove from channel subscribers, one swap-remove per subscription
+  Routes.unsubscribeAll(client.subscriptions);
+  if (client.type == ClientType::SUBSCRIBER) {
+    replicateClose(fd);
+  }
+  if (client.type == ClientType::REPLICA && client.dialedFrom == -1 &&
+      !client.sessions.empty()) {
+    // The primary may be gone for good: its subscribers keep this broker's
+    // interest up until they have had time to come over
+    vector<socket_t> orphans;
+    for (const auto &[session, sub] : client.sessions) {
+      Sessions.at(sub).fd = -1;
+      orphans.push_back(sub);
+    }
+    Log.log(LogId::PRIMARY_LOST, fd, orphans.size(), REPLICA_GRACE.count());
+    releaseSessions(std::move(orphans));
+  } else {
+    for (const auto &[session, sub] : client.sessions) {
+      Routes.unsubscribeAll(Sessions.at(sub).subscriptions);
+      Sessions.erase(sub);
+      replicateClose(sub);
+    }
+  }
+  if (erase(PeerLinks, fd) != 0) {
+    Log.log(LogId::PEER_LOST, client.peer);
+  }
+  if (fd == ReplicaLink) {
+    ReplicaLink = -1;
+    ReplicaBatch.clear();
+    Log.log(LogId::STANDBY_LOST);
+  }
+  if (client.dialedFrom != -1 && !Stopping.load(memory_order_relaxed)) {
+    dial(client.dialedFrom, true);
+  }
+  checkInterest();
+
+  if (verbose) {
+    Log.log(LogId::CLIENT_REMOVED, fd);
+  }
+  tracepoint(Stage::CLOSE, fd);
+
+  ::close(fd);
+  RecvBuffers.release(client.recvBufferId);
+  Metrics.detach(client.metrics);
+  Clients.erase(it);
+  Metrics.clients.set(Clients.size());
+}
+
+void Broker::resumeClients() {
+  for (auto &[fd, client] : Clients) {
+    if (client.state == ClientState::CLOSING)
+      continue;
+    if (!client.recvInProgress) {
+      clientSession(client);
+    }
+    if (!client.sendInProgress && !client.sendQueue.empty()) {
+      flushSendQueue(client);
+    }
+  }
+}
+
+Client *Broker::getClient(socket_t fd) {
+  auto it = Clients.find(fd);
+  return it != Clients.end() ? &it->second : nullptr;
+}
+
+void Broker::closeClient(Client &client) {
+  client.state = ClientState::CLOSING;
+  if (client.recvInProgress || client.sendInProgress) {
+    ::shutdown(client.S, SHUT_RDWR);
+    return;
+  }
+  removeClient(client.S);
+}
+
+void Broker::subscribeToChannel(Client &client, uint8_t channel) {
+  client.channels.set(channel);
+  Routes.subscribe(client.S, client.subscriptions, channel);
+
+  if (verbose) {
+    Log.log(LogId::SUBSCRIBED, client.S, channel);
+  }
+}
+
+void Broker::unsubscribeFromChannel(Client &client, uint8_t channel) {
+  client.channels.reset(channel);
+  if (Routes.unsubscribe(client.subscriptions, channel) && verbose) {
+    Log.log(LogId::UNSUBSCRIBED, client.S, channel);
+  }
+}
+
+void Broker::subscribe(Client &client, const ChannelSet &channels,
+                       span<const string_view> patterns) {
+  if (channels.test(protocol::CHANNEL_BROADCAST)) {
+    // Broadcast subscribers get every channel, one entry covers them all
+    subscribeToChannel(client, protocol::CHANNEL_BROADCAST);
+  } else {
+    for (size_t ch = 0; ch < protocol::CHANNEL_COUNT; ++ch) {
+      if (channels.test(ch)) {
+        subscribeToChannel(client, static_cast<uint8_t>(ch));
+      }
+    }
+  }
+  for (auto pattern : patterns) {
+    Routes.subscribePattern(client.S, client.subscriptions, pattern,
+                            [this](socket_t fd, channel_t topic) {
+                              onTopicSubscribed(fd, topic);
+                            });
+  }
+}
+
+void Broker::unsubscribe(Client &client, const ChannelSet &channels,
+                         span<const string_view> patterns) {
+  if (client.subscriptions.broadcast &&
+      !channels.test(protocol::CHANNEL_BROADCAST) && channels.any()) {
+    // Leaving part of a broadcast subscription: it becomes one
+    // subscription per remaining numeric channel
+    unsubscribeFromChannel(client, protocol::CHANNEL_BROADCAST);
+    for (size_t ch = 1; ch < protocol::CHANNEL_COUNT; ++ch) {
+      if (!channels.test(ch)) {
+        subscribeToChannel(client, static_cast<uint8_t>(ch));
+      }
+    }
+  } else {
+    for (size_t ch = 0; ch < protocol::CHANNEL_COUNT; ++ch) {
+      if (channels.test(ch)) {
+        unsubscribeFromChannel(client, static_cast<uint8_t>(ch));
+      }
+    }
+  }
+  for (auto pattern : patterns) {
+    Routes.unsubscribePattern(
+        client.subscriptions, pattern, [&](channel_t topic) {
+          if (verbose) {
+            Log.log(LogId::UNSUBSCRIBED_TOPIC, client.S,
+                    Routes.topicTable().name(topic));
+          }
+        });
+  }
+}
+
+void Broker::subscribeSet(socket_t sub, Subscriptions &owner,
+                          const ChannelSet &channels,
+                          span<const string_view> patterns) {
+  if (channels.test(protocol::CHANNEL_BROADCAST)) {
+    Routes.subscribe(sub, owner, protocol::CHANNEL_BROADCAST);
+  } else {
+    for (size_t ch = 0; ch < protocol::CHANNEL_COUNT; ++ch) {
+      if (channels.test(ch)) {
+        Routes.subscribe(sub, owner, static_cast<channel_t>(ch));
+      }
+    }
+  }
+  for (auto pattern : patterns) {
+    Routes.subscribePattern(sub, owner, pattern,
+                            [this](socket_t fd, channel_t topic) {
+                              onTopicSubscribed(fd, topic);
+                            });
+  }
+}
+
+void Broker::unsubscribeSet(socket_t sub, Subscriptions &owner,
+                            const ChannelSet &channels,
+                            span<const string_view> patterns) {
+  if (owner.broadcast && !channels.test(protocol::CHANNEL_BROADCAST) &&
+      channels.any()) {
+    // Same split as for a client's partial unsubscribe
+    Routes.unsubscribe(owner, protocol::CHANNEL_BROADCAST);
+    for (size_t ch = 1; ch < protocol::CHANNEL_COUNT; ++ch) {
+      if (!channels.test(ch)) {
+        Routes.subscribe(sub, owner, static_cast<channel_t>(ch));
+      }
+    }
+  } else {
+    for (size_t ch = 0; ch < protocol::CHANNEL_COUNT; ++ch) {
+      if (channels.test(ch)) {
+        Routes.unsubscribe(owner, static_cast<channel_t>(ch));
+      }
+    }
+  }
+  for (auto pattern : patterns) {
+    Routes.unsubscribePattern(owner, pattern, [](channel_t) {});
+  }
+}
+
+void Broker::sessionControl(Client &client, const codec::Control &control) {
+  const uint32_t session = *control.session;
+  if (control.closesSession()) {
+    closeSession(client, session);
+    return;
+  }
+
+  // The first [[+SES:...]] for an id opens the session
+  auto it = client.sessions.find(session);
+  if (it == client.sessions.end()) {
+    if (!control.subscribe)
+      return;
+    if (client.type == ClientType::MUX &&
+        client.sessions.size() >= protocol::MAX_SESSIONS) {
+      Log.log(LogId::SESSION_LIMIT, client.S, session);
+      return;
+    }
+    const socket_t sub = NextLocal.fetch_sub(1, memory_order_relaxed);
+    it = client.sessions.emplace(session, sub).first;
+    Sessions.emplace(sub, Session{client.S, session, {}});
+    if (verbose) {
+      Log.log(LogId::SESSION_OPENED, client.S, session);
+    }
+  }
+
+  auto &owner = Sessions.at(it->second).subscriptions;
+  if (control.subscribe) {
+    subscribeSet(it->second, owner, control.channels, control.topics);
+  } else {
+    unsubscribeSet(it->second, owner, control.channels, control.topics);
+  }
+  replicateSubscription(it->second, control.subscribe, control.channels,
+                        control.topics);
+}
+
+void Broker::closeSession(Client &client, uint32_t session) {
+  auto it = client.sessions.find(session);
+  if (it == client.sessions.end())
+    return;
+
+  Routes.unsubscribeAll(Sessions.at(it->second).subscriptions);
+  Sessions.erase(it->second);
+  replicateClose(it->second);
+  client.sessions.erase(it);
+  if (verbose) {
+    Log.log(LogId::SESSION_CLOSED, client.S, session);
+  }
+}
+
+void Broker::onTopicSubscribed(socket_t fd, channel_t topic) {
+  if (verbose) {
+    Log.log(LogId::SUBSCRIBED_TOPIC, fd, Routes.topicTable().name(topic));
+  }
+}
+
+channel_t Broker::registerTopic(string_view name) {
+  const channel_t known = Routes.topicTable().channelCount();
+  const channel_t id =
+      Routes.registerTopic(name, [this](socket_t fd, channel_t topic) {
+        onTopicSubscribed(fd, topic);
+      });
+  if (id >= known) {
+    Metrics.nameTopic(id, name);
+    if (ReplicaLink >= 0) {
+      codec::appendTopicRecord(ReplicaBatch, id, name);
+    }
+  }
+  return id;
+}
+
+void Broker::onHandshake(Client &client, const codec::Handshake &handshake) {
+  if (client.type == ClientType::MUX) {
+    Log.log(LogId::HANDSHAKE_MUX, client.S);
+    return;
+  }
+
+  if (client.type == ClientType::PEER) {
+    const bool linked = ranges::any_of(PeerLinks, [&](socket_t fd) {
+      return getClient(fd)->peer == handshake.peer;
+    });
+    if (FederationId == 0 || handshake.peer == FederationId || linked) {
+      Log.log(LogId::PEER_REJECTED, client.S, handshake.peer);
+      closeClient(client);
+      return;
+    }
+    linkPeer(client, handshake.peer);
+    return;
+  }
+
+  if (client.type == ClientType::REPLICA) {
+    if (!Standby) {
+      Log.log(LogId::REPLICA_REFUSED, client.S);
+      closeClient(client);
+      return;
+    }
+    // Numeric channels keep their ids, topic records fill in the rest
+    client.topics.resize(protocol::CHANNEL_COUNT);
+    iota(client.topics.begin(), client.topics.end(), channel_t{0});
+    Log.log(LogId::HANDSHAKE_REPLICA, client.S);
+    return;
+  }
+
+  if (client.type == ClientType::PUBLISHER) {
+    if (handshake.topics.empty()) {
+      client.channels = handshake.channels;
+      Log.log(LogId::HANDSHAKE_PUBLISHER, client.S,
+              firstChannel(handshake.channels));
+      return;
+    }
+
+    // Interned once here, messages then index client.topics
+    for (auto name : handshake.topics) {
+      client.topics.push_back(registerTopic(name));
+    }
+    Log.log(LogId::HANDSHAKE_PUBLISHER_TOPICS, client.S,
+            handshake.topics.size(), handshake.topics.front());
+    return;
+  }
+
+  subscribe(client, handshake.channels, handshake.topics);
+  replicateSubscription(client.S, true, handshake.channels, handshake.topics);
+  checkInterest();
+
+  if (handshake.channels.all()) {
+    Log.log(LogId::HANDSHAKE_SUBSCRIBER_ALL, client.S);
+    return;
+  }
+
+  // Built on the stack; the record keeps as much as fits
+  array<char, Logger::TEXT_SIZE> list;
+  auto out = list.begin();
+  const char *sep = "";
+  for (size_t ch = 0; ch < protocol::CHANNEL_COUNT; ++ch) {
+    if (handshake.channels.test(ch)) {
+      out = format_to_n(out, list.end() - out, "{}{}", sep, ch).out;
+      sep = ",";
+    }
+  }
+  for (auto pattern : handshake.topics) {
+    out = format_to_n(out, list.end() - out, "{}{}", sep, pattern).out;
+    sep = ",";
+  }
+  Log.log(LogId::HANDSHAKE_SUBSCRIBER, client.S,
+          string_view(list.begin(), out));
+}
+
+void Broker::onMessage(Client &client, const codec::Message &message) {
+  tracepoint(Stage::PARSE, client.S, ++MessageSeq);
+
+  // Topic publishers index their handshake topics
+  channel_t id = message.channel;
+  if (!client.topics.empty()) {
+    if (id >= client.topics.size() ||
+        client.topics[id] == TopicTable::NONE) {
+      onInvalid(client, message.content);
+      return;
+    }
+    id = client.topics[id];
+  } else if (id > protocol::MAX_CHANNELS) {
+    onInvalid(client, message.content);
+    return;
+  }
+
+  auto &channel = Metrics.channel(id);
+  channel.messagesIn.add();
+  channel.bytesIn.add(message.content.size());
+  client.metrics->messagesIn.add();
+  client.metrics->bytesIn.add(message.content.size());
+
+  routeMessage(id, message.content, client.S);
+  // A primary's peers already had it from the primary
+  if (!PeerLinks.empty() && id <= protocol::MAX_CHANNELS &&
+      client.type != ClientType::REPLICA) {
+    sendToPeers(id, message.content, FederationId, ++ForwardSeq, client.S);
+  }
+}
+
+void Broker::onControl(Client &client, const codec::Control &control) {
+  if (control.session) {
+    sessionControl(client, control);
+  } else {
+    if (control.subscribe) {
+      subscribe(client, control.channels, control.topics);
+    } else {
+      unsubscribe(client, control.channels, control.topics);
+    }
+    replicateSubscription(client.S, control.subscribe, control.channels,
+                          control.topics);
+  }
+  checkInterest();
+}
+
+void Broker::onForward(Client &client, const codec::Forward &forward) {
+  // Back around a cycle of links, or over a second path
+  if (forward.origin == FederationId ||
+      !firstSighting(forward.origin, forward.seq)) {
+    return;
+  }
+  tracepoint(Stage::PARSE, client.S, ++MessageSeq);
+
+  auto &channel = Metrics.channel(forward.channel);
+  channel.messagesIn.add();
+  channel.bytesIn.add(forward.content.size());
+  client.metrics->messagesIn.add();
+  client.metrics->bytesIn.add(forward.content.size());
+
+  routeMessage(forward.channel, forward.content, client.S);
+  sendToPeers(forward.channel, forward.content, forward.origin, forward.seq,
+              client.S);
+}
+
+void Broker::onPeerInterest(Client &client, const ChannelSet &interest) {
+  client.channels = interest;
+  // What the other peers are told includes it
+  checkInterest();
+}
+
+void Broker::onReplicaTopic(Client &client, const codec::TopicRecord &topic) {
+  if (topic.id < TopicTable::FIRST_TOPIC) {
+    onInvalid(client, topic.name);
+    return;
+  }
+  if (topic.id >= client.topics.size()) {
+    client.topics.resize(topic.id + 1, TopicTable::NONE);
+  }
+  client.topics[topic.id] = registerTopic(topic.name);
+}
+
+void Broker::onInvalid(Client &client, string_view data) {
+  if (client.type == ClientType::UNKNOWN) {
+    Log.log(LogId::INVALID_HANDSHAKE, client.S);
+  } else if (client.state == ClientState::CLOSING) {
+    Log.log(LogId::MESSAGE_TOO_LARGE, client.S);
+  } else if (verbose) {
+    Log.log(LogId::INVALID_MESSAGE, client.S, data);
+  }
+}
+
+void Broker::onExit(Client &client) { Log.log(LogId::EXIT, client.S); }
+
+void Broker::routeMessage(channel_t channel, string_view message,
+                          socket_t senderFd) {
+  if (verbose) {
+    Log.log(LogId::ROUTE, channel, senderFd, message);
+  }
+
+  Routes.route(channel, [&](socket_t subFd) {
+    tracepoint(Stage::ROUTE, subFd, MessageSeq);
+    enqueueMessage(subFd, channel, message);
+  });
+  Shared.reset();
+  if (!MuxTargets.empty()) {
+    flushSessionTargets(channel, message);
+  }
+
+  // One copy however many local readers there are
+  if (Shm && Shm->write(channel, message)) {
+    auto &stats = Metrics.channel(channel);
+    stats.messagesOut.add();
+    stats.bytesOut.add(message.size());
+  }
+
+  // Likewise one copy for the standby, sent with the rest of the batch
+  if (ReplicaLink >= 0) {
+    codec::appendMessage(ReplicaBatch, channel, message);
+  }
+}
+
+void Broker::enqueueMessage(socket_t fd, channel_t channel,
+                            string_view message) {
+  if (fd < 0) {
+    // A session: collected, its connection gets one frame for all of them
+    if (auto session = Sessions.find(fd); session != Sessions.end()) {
+      // Sessions replicated from a primary are only kept warm
+      auto *client = getClient(session->second.fd);
+      if (!client || client->state != ClientState::READY ||
+          client->type == ClientType::REPLICA)
+        return;
+      if (client->targets.empty()) {
+        MuxTargets.push_back(client->S);
+      }
+      client->targets.push_back(session->second.id);
+      return;
+    }
+
+    // In-process subscriber: one shared copy for all of them
+    auto it = Locals.find(fd);
+    if (it == Locals.end())
+      return;
+    if (!Shared) {
+      Shared = make_shared<const string>(message);
+    }
+    auto &stats = Metrics.channel(channel);
+    stats.messagesOut.add();
+    stats.bytesOut.add(message.size());
+    it->second.callback(SharedMessage{channel, Shared});
+    return;
+  }
+
+  auto *client = getClient(fd);
+  if (!client || client->state != ClientState::READY)
+    return;
+  enqueueFrame(*client, channel, message);
+}
+
+void Broker::enqueueFrame(Client &client, channel_t channel,
+                          string_view frame) {
+  auto &stats = Metrics.channel(channel);
+
+  if (client.sendQueue.size() >= protocol::MAX_SEND_QUEUE) {
+    stats.drops.add();
+    client.metrics->drops.add();
+    if (verbose) {
+      Log.log(LogId::QUEUE_FULL, client.S);
+    }
+    return;
+  }
+
+  client.sendQueue.emplace(frame);
+  tracepoint(Stage::ENQUEUE, client.S, MessageSeq);
+  stats.messagesOut.add();
+  stats.bytesOut.add(frame.size());
+  client.metrics->queueHighWater.raise(client.sendQueue.size());
+  Metrics.queueHighWater.raise(client.sendQueue.size());
+
+  // If not already sending, start sending
+  if (!client.sendInProgress) {
+    flushSendQueue(client);
+  }
+}
+
+void Broker::flushSessionTargets(channel_t channel, string_view message) {
+  for (socket_t fd : MuxTargets) {
+    auto *client = getClient(fd);
+    if (!client)
+      continue;
+
+    MuxFrame.assign(protocol::SESSION_PREFIX);
+    const char *sep = "";
+    for (uint32_t session : client->targets) {
+      format_to(back_inserter(MuxFrame), "{}{}", sep, session);
+      sep = ",";
+    }
+    MuxFrame.push_back(']');
+    MuxFrame.append(message);
+    client->targets.clear();
+    enqueueFrame(*client, channel, MuxFrame);
+  }
+  MuxTargets.clear();
+}
+
+void Broker::forward(channel_t channel, string_view line) {
+  auto &stats = Metrics.channel(channel);
+  stats.messagesIn.add();
+  stats.bytesIn.add(line.size());
+  ++MessageSeq;
+  routeMessage(channel, line, -1);
+  if (!PeerLinks.empty() && channel <= protocol::MAX_CHANNELS) {
+    sendToPeers(channel, line, FederationId, ++ForwardSeq, -1);
+  }
+}
+
+void Broker::onInterest(InterestCallback callback) {
+  InterestChanged = std::move(callback);
+}
+
+ChannelSet Broker::localInterest() const {
+  ChannelSet wanted;
+  if (!Routes.subscribers(protocol::CHANNEL_BROADCAST).empty()) {
+    wanted.set();
+    return wanted;
+  }
+  for (channel_t ch = 1; ch < protocol::CHANNEL_COUNT; ++ch) {
+    if (!Routes.subscribers(ch).empty() || (Shm && Shm->hasReaders(ch))) {
+      wanted.set(ch);
+    }
+  }
+  return wanted;
+}
+
+void Broker::checkInterest() {
+  if (!InterestChanged && PeerLinks.empty())
+    return;
+
+  const ChannelSet local = localInterest();
+  if (InterestChanged) {
+    ChannelSet wanted = local;
+    wanted.reset(protocol::CHANNEL_BROADCAST);
+    if (wanted != Interest) {
+      Interest = wanted;
+      InterestChanged(Interest);
+    }
+  }
+
+  // A peer hears what this broker and its other peers want, never its own
+  // interest echoed back
+  for (socket_t fd : PeerLinks) {
+    auto &client = *getClient(fd);
+    if (client.state != ClientState::READY)
+      continue;
+    ChannelSet wanted = local;
+    for (socket_t other : PeerLinks) {
+      if (other != fd) {
+        wanted |= getClient(other)->channels;
+      }
+    }
+    if (wanted != client.advertised) {
+      client.advertised = wanted;
+      queueControl(client, codec::makeInterest(wanted));
+    }
+  }
+}
+
+void Broker::linkPeer(Client &client, uint32_t peer) {
+  client.peer = peer;
+  if (client.dialedFrom < 0) {
+    // The dialing side sent its handshake first
+    queueControl(client, codec::makePeerHandshake(FederationId));
+  }
+  PeerLinks.push_back(client.S);
+  Log.log(LogId::PEER_LINKED, client.S, peer);
+  checkInterest();
+}
+
+bool Broker::firstSighting(uint32_t origin, uint64_t seq) {
+  auto &seen = Seen[origin];
+  if (seq > seen.highest) {
+    const uint64_t shift = seq - seen.highest;
+    if (shift >= seen.recent.size()) {
+      seen.recent.reset();
+    } else {
+      seen.recent <<= shift;
+    }
+    seen.recent.set(0);
+    seen.highest = seq;
+    return true;
+  }
+
+  const uint64_t age = seen.highest - seq;
+  if (age >= seen.recent.size() || seen.recent.test(age))
+    return false;
+  seen.recent.set(age);
+  return true;
+}
+
+void Broker::sendToPeers(channel_t channel, string_view message,
+                         uint32_t origin, uint64_t seq, socket_t from) {
+  ForwardFrame.clear();
+  for (socket_t fd : PeerLinks) {
+    auto *client = getClient(fd);
+    if (fd == from || client->state != ClientState::READY ||
+        !client->channels.test(channel)) {
+      continue;
+    }
+    if (ForwardFrame.empty()) {
+      codec::appendForward(ForwardFrame, {origin, seq, channel, message});
+    }
+    enqueueFrame(*client, channel, ForwardFrame);
+  }
+}
+
+void Broker::queueControl(Client &client, string frame) {
+  client.sendQueue.push(std::move(frame));
+  if (!client.sendInProgress) {
+    flushSendQueue(client);
+  }
+}
+
+void Broker::linkStandby(Client &client) {
+  client.type = ClientType::REPLICA;
+  client.state = ClientState::READY;
+  ReplicaLink = client.S;
+  Log.log(LogId::STANDBY_LINKED, client.S);
+  replicateSnapshot();
+}
+
+void Broker::replicateSnapshot() {
+  // Whatever was collected before the link came up is in the snapshot
+  ReplicaBatch.clear();
+  const auto &topics = Routes.topicTable();
+  for (channel_t id = TopicTable::FIRST_TOPIC; id < topics.channelCount();
+       ++id) {
+    codec::appendTopicRecord(ReplicaBatch, id, topics.name(id));
+  }
+  for (const auto &[fd, client] : Clients) {
+    if (client.type == ClientType::SUBSCRIBER) {
+      replicateSubscriptions(fd, client.subscriptions);
+    }
+    // A standby passes its own primary's subscribers down the chain
+    for (const auto &[session, sub] : client.sessions) {
+      replicateSubscriptions(sub, Sessions.at(sub).subscriptions);
+    }
+  }
+}
+
+void Broker::replicateSubscription(socket_t sub, bool subscribe,
+                                   const ChannelSet &channels,
+                                   span<const string_view> patterns) {
+  if (ReplicaLink < 0)
+    return;
+
+  // The standby keys the subscriber by its id here. One record per pattern
+  // keeps every record well inside a frame.
+  const auto session = static_cast<uint32_t>(sub);
+  if (channels.any()) {
+    ReplicaBatch += codec::makeSessionControl(
+        subscribe, session, codec::formatChannelList(channels));
+  }
+  for (auto pattern : patterns) {
+    ReplicaBatch += codec::makeSessionControl(subscribe, session, pattern);
+  }
+}
+
+void Broker::replicateSubscriptions(socket_t sub,
+                                    const Subscriptions &owner) {
+  ChannelSet channels;
+  vector<string_view> patterns;
+  describe(owner, channels, patterns);
+  replicateSubscription(sub, true, channels, patterns);
+}
+
+void Broker::describe(const Subscriptions &owner, ChannelSet &channels,
+                      vector<string_view> &patterns) const {
+  if (owner.broadcast) {
+    channels.set();
+  } else {
+    // Topics are left to the patterns that picked them up
+    for (const auto &[channel, slot] : owner.slots) {
+      if (channel < protocol::CHANNEL_COUNT) {
+        channels.set(channel);
+      }
+    }
+  }
+  for (uint32_t pattern : owner.patterns) {
+    patterns.push_back(Routes.topicTable().pattern(pattern));
+  }
+}
+
+string Broker::subscriptionList(const Subscriptions &owner) const {
+  ChannelSet channels;
+  vector<string_view> patterns;
+  describe(owner, channels, patterns);
+  string list = codec::formatChannelList(channels);
+  if (channels.all())
+    return list; // "ALL" stands alone, and covers every pattern
+  for (auto pattern : patterns) {
+    if (!list.empty()) {
+      list.push_back(',');
+    }
+    list.append(pattern);
+  }
+  return list;
+}
+
+void Broker::replicateClose(socket_t sub) {
+  if (ReplicaLink >= 0) {
+    ReplicaBatch += codec::makeSessionControl(
+        false, static_cast<uint32_t>(sub), {});
+  }
+}
+
+void Broker::flushReplica() {
+  if (ReplicaBatch.empty())
+    return;
+
+  auto *client = getClient(ReplicaLink);
+  if (!client || client->state != ClientState::READY) {
+    ReplicaBatch.clear();
+    return;
+  }
+  if (client->sendQueue.size() >= protocol::MAX_SEND_QUEUE) {
+    // Dropping records would leave the standby wrong; the next link starts
+    // over from a snapshot instead
+    Log.log(LogId::STANDBY_BEHIND, client->S);
+    ReplicaBatch.clear();
+    closeClient(*client);
+    return;
+  }
+  queueControl(*client, exchange(ReplicaBatch, {}));
+}
+
+handoff::ClientState Broker::saveClient(const Client &client) const {
+  handoff::ClientState state;
+  state.type = client.type;
+  state.ready = client.state == ClientState::READY;
+  state.records = client.records;
+  if (client.type == ClientType::PUBLISHER) {
+    state.channels = codec::formatChannelList(client.channels);
+    for (channel_t topic : client.topics) {
+      state.topics.emplace_back(Routes.topicTable().name(topic));
+    }
+  } else if (client.type == ClientType::SUBSCRIBER) {
+    state.channels = subscriptionList(client.subscriptions);
+  }
+  for (const auto &[session, sub] : client.sessions) {
+    state.sessions.emplace_back(
+        session, subscriptionList(Sessions.at(sub).subscriptions));
+  }
+  state.recvBuffer = client.recvBuffer;
+  // A copy, the client stays whole in case the handoff fails
+  for (auto queue = client.sendQueue; !queue.empty(); queue.pop()) {
+    state.sendQueue.push_back(std::move(queue.front()));
+  }
+  return state;
+}
+
+void Broker::restoreClient(socket_t fd, handoff::ClientState &state) {
+  auto &client = addClient(fd, state.records);
+  client.type = state.type;
+  client.state = state.ready ? ClientState::READY : ClientState::HANDSHAKE;
+  client.recvBuffer = std::move(state.recvBuffer);
+  for (auto &frame : state.sendQueue) {
+    client.sendQueue.push(std::move(frame));
+  }
+
+  // Written by saveClient, so they parse
+  ChannelSet channels;
+  vector<string_view> patterns;
+  codec::parseChannelList(state.channels, channels, patterns);
+  if (client.type == ClientType::PUBLISHER) {
+    // Ids differ in this broker, the publisher's indexes do not
+    client.channels = channels;
+    for (const auto &name : state.topics) {
+      client.topics.push_back(registerTopic(name));
+    }
+  } else if (client.type == ClientType::SUBSCRIBER) {
+    subscribe(client, channels, patterns);
+  }
+  for (const auto &[session, list] : state.sessions) {
+    codec::Control control{true, {}, {}, session};
+    codec::parseChannelList(list, control.channels, control.topics);
+    sessionControl(client, control);
+  }
+}
+
+void Broker::handOff(socket_t successor) {
+  for (const auto &listener : Listeners) {
+    handoff::sendRecord(successor, handoff::Kind::LISTENER, listener.S,
+                        handoff::encodeListener(listener.records,
+                                                listener.path));
+  }
+  size_t clients = 0;
+  for (const auto &[fd, client] : Clients) {
+    // Links to other brokers are dialed again, by the successor or by the
+    // broker at the other end
+    if (client.type == ClientType::PEER ||
+        client.type == ClientType::REPLICA ||
+        client.state == ClientState::CLOSING) {
+      continue;
+    }
+    handoff::sendRecord(successor, handoff::Kind::CLIENT, fd,
+                        handoff::encodeClient(saveClient(client)));
+    ++clients;
+  }
+  handoff::sendRecord(successor, handoff::Kind::DONE, -1, {});
+
+  // The successor owns these files now
+  for (auto &listener : Listeners) {
+    listener.path.clear();
+  }
+  HandoffPath.clear();
+  Log.log(LogId::HANDED_OFF, Listeners.size(), clients);
+}
+
+void Broker::stop() {
+  Stopping.store(true, memory_order_relaxed);
+  const uint64_t one = 1;
+  [[maybe_unused]] auto n = ::write(Wake, &one, sizeof(one));
+}
+
+void Broker::post(Command command) {
+  Commands.push(std::move(command));
+  if (!WakePending.exchange(true, memory_order_acq_rel)) {
+    const uint64_t one = 1;
+    [[maybe_unused]] auto n = ::write(Wake, &one, sizeof(one));
+  }
+}
+
+void Broker::publish(channel_t channel, string_view payload) {
+  post({.kind = Command::PUBLISH,
+        .channel = channel,
+        .data = makeSharedLine(payload)});
+}
+
+void Broker::publish(string_view topic, string_view payload) {
+  post({.kind = Command::PUBLISH,
+        .topic = string(topic),
+        .data = makeSharedLine(payload)});
+}
+
+LocalSubscription Broker::subscribe(const ChannelSet &channels,
+                                    span<const string_view> patterns,
+                                    LocalCallback callback) {
+  const LocalSubscription id = NextLocal.fetch_sub(1, memory_order_relaxed);
+  Command command{.kind = Command::SUBSCRIBE,
+                  .id = id,
+                  .channels = channels,
+                  .callback = std::move(callback)};
+  for (auto pattern : patterns) {
+    command.patterns.emplace_back(pattern);
+  }
+  post(std::move(command));
+  return id;
+}
+
+void Broker::unsubscribe(LocalSubscription id) {
+  post({.kind = Command::UNSUBSCRIBE, .id = id});
+}
+
+void Broker::drainCommands() {
+  // Cleared before draining, so a post() racing with the drain wakes us
+  // again instead of being left in the queue
+  WakePending.store(false, memory_order_release);
+  while (auto command = Commands.pop()) {
+    runCommand(*command);
+  }
+}
+
+void Broker::runCommand(Command &command) {
+  switch (command.kind) {
+  case Command::PUBLISH: {
+    channel_t id = command.channel;
+    if (!command.topic.empty()) {
+      if (!codec::isValidTopic(command.topic)) {
+        Log.log(LogId::INVALID_LOCAL_TOPIC, command.topic);
+        return;
+      }
+      id = registerTopic(command.topic);
+    } else if (id > protocol::MAX_CHANNELS) {
+      return;
+    }
+    // Local subscribers get the posted line itself, not a copy. Held here
+    // as well: routing drops Shared before the peers are sent the line.
+    const auto line = std::move(command.data);
+    Shared = line;
+    forward(id, *line);
+    return;
+  }
+
+  case Command::SUBSCRIBE: {
+    auto &local = Locals[command.id];
+    local.callback = std::move(command.callback);
+    vector<string_view> patterns(command.patterns.begin(),
+                                 command.patterns.end());
+    subscribeSet(command.id, local.subscriptions, command.channels, patterns);
+    checkInterest();
+    return;
+  }
+
+  case Command::UNSUBSCRIBE:
+    if (auto it = Locals.find(command.id); it != Locals.end()) {
+      Routes.unsubscribeAll(it->second.subscriptions);
+      Locals.erase(it);
+      checkInterest();
+    }
+    return;
+  }
+}
+
+Task Broker::acceptLoop(const Listener &listener) {
+  ++AcceptLoops;
+  while (!Stopping.load(memory_order_relaxed)) {
+    socket_t newFd = co_await Ring.accept(listener.S);
+    if (newFd < 0) {
+      if (HandingOff)
+        break;
+      if (newFd == -EBUSY) {
+        co_await Ring.yield();
+      } else if (newFd != -EINTR && newFd != -EAGAIN) {
+        Log.log(LogId::ACCEPT_FAILED, strerror(-newFd));
+      }
+      continue;
+    }
+
+    // Set non-blocking
+    int flags = ::fcntl(newFd, F_GETFL, 0);
+    if (flags >= 0) {
+      ::fcntl(newFd, F_SETFL, flags | O_NONBLOCK);
+    }
+
+    auto &client = addClient(newFd, listener.records);
+    if (HandingOff)
+      break; // Accepted just before the cancel, handed off with the rest
+    clientSession(client);
+  }
+  --AcceptLoops;
+}
+
+Task Broker::clientSession(Client &client) {
+  client.recvInProgress = true;
+  auto buffer = RecvBuffers.buffer(client.recvBufferId);
+
+  while (client.state != ClientState::CLOSING) {
+    if (HandingOff) {
+      // The successor receives from here on, whatever is buffered goes
+      // with the client
+      client.recvInProgress = false;
+      co_return;
+    }
+    // A record socket reports the full length of a record it cut short
+    int res = client.records ? co_await Ring.recvRecord(client.S, buffer)
+                             : co_await Ring.recv(client.S, buffer);
+
+    if (res <= 0) {
+      if (res == -EBUSY) {
+        // No SQE: let the ring reap before asking again
+        co_await Ring.yield();
+        continue;
+      }
+      if (res == -EAGAIN || res == -EINTR ||
+          (res == -ECANCELED && HandingOff)) {
+        continue;
+      }
+      if (res == 0) {
+        if (verbose) {
+          Log.log(LogId::DISCONNECT, client.S);
+        }
+      } else if (verbose) {
+        Log.log(LogId::RECV_FAILED, client.S, strerror(-res));
+      }
+      break;
+    }
+
+    tracepoint(Stage::RECV_CQE, client.S);
+
+    if (client.records) {
+      const auto length = static_cast<size_t>(res);
+      processClientRecord(
+          client, string_view(buffer.data(), min(length, buffer.size())),
+          length > buffer.size(), *this);
+      continue;
+    }
+
+    // Append received data to buffer and process it
+    client.recvBuffer.append(buffer.data(), res);
+    processClientBuffer(client, *this);
+  }
+
+  client.recvInProgress = false;
+  closeClient(client);
+}
+
+Task Broker::flushSendQueue(Client &client) {
+  client.sendInProgress = true;
+  bool traced = false;
+
+  // A handoff takes the queue as it is, a partly sent front included
+  while (!client.sendQueue.empty() && client.state == ClientState::READY &&
+         !HandingOff) {
+    // The queued string stays put until it is popped below
+    auto &front = client.sendQueue.front();
+    if (!traced) {
+      tracepoint(Stage::SEND_SQE, client.S);
+      traced = true;
+    }
+    int res = co_await Ring.send(client.S, front);
+
+    if (res < 0) {
+      if (res == -EBUSY) {
+        co_await Ring.yield();
+        continue;
+      }
+      if (res == -EAGAIN || res == -EINTR ||
+          (res == -ECANCELED && HandingOff)) {
+        continue; // Retry the same message
+      }
+      if (verbose) {
+        Log.log(LogId::SEND_FAILED, client.S, strerror(-res));
+      }
+      client.state = ClientState::CLOSING;
+      break;
+    }
+
+    client.metrics->bytesOut.add(res);
+    if (static_cast<size_t>(res) < front.size()) {
+      // Short write, send the rest
+      front.erase(0, res);
+    } else {
+      client.sendQueue.pop();
+      client.metrics->messagesOut.add();
+      tracepoint(Stage::SEND_CQE, client.S);
+      traced = false;
+    }
+  }
+
+  client.sendInProgress = false;
+  if (client.state == ClientState::CLOSING) {
+    closeClient(client);
+  }
+}
+
+Task Broker::commandLoop() {
+  while (!Stopping.load(memory_order_relaxed)) {
+    int res = co_await Ring.poll(Wake, POLLIN);
+    if (res == -EBUSY) {
+      co_await Ring.yield();
+    } else if (res < 0 && res != -EINTR && res != -EAGAIN) {
+      println(stderr, "\033[31mPolling the command queue failed: {}\033[0m",
+              strerror(-res));
+      co_return;
+    }
+
+    uint64_t count;
+    [[maybe_unused]] auto n = ::read(Wake, &count, sizeof(count));
+    drainCommands();
+  }
+}
+
+Task Broker::dial(int target, bool retry) {
+  const bool standby = target == DIALED_STANDBY;
+  const auto &peer = standby ? *StandbyAddress : PeerAddresses[target];
+  if (retry) {
+    co_await Ring.timeout(PEER_RETRY);
+  }
+
+  const string handshake = standby
+                               ? string(protocol::HANDSHAKE_REPLICA)
+                               : codec::makePeerHandshake(FederationId);
+  while (!Stopping.load(memory_order_relaxed)) {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = ::htons(peer.port);
+    ::inet_pton(AF_INET, peer.host.c_str(), &addr.sin_addr);
+
+    socket_t fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int res = fd < 0 ? -errno : 0;
+    if (res == 0 && ::connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+      res = -errno;
+      if (res == -EINPROGRESS) {
+        res = co_await Ring.poll(fd, POLLOUT);
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (res >= 0) {
+          ::getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
+          res = -error;
+        }
+      }
+    }
+    if (res == 0 && HandingOff) {
+      // Nothing new on this ring until the handoff is through
+      res = -EAGAIN;
+    }
+    // Fits in the fresh socket's buffer, the reply comes through the ring
+    if (res == 0 && ::send(fd, handshake.data(), handshake.size(),
+                           MSG_NOSIGNAL) !=
+                        static_cast<ssize_t>(handshake.size())) {
+      res = errno != 0 ? -errno : -EIO;
+    }
+
+    if (res == 0) {
+      auto &client = addClient(fd, false);
+      client.dialedFrom = target;
+      if (standby) {
+        // Nothing comes back, the records start at once
+        linkStandby(client);
+      }
+      clientSession(client);
+      co_return;
+    }
+
+    if (verbose) {
+      Log.log(LogId::DIAL_FAILED, peer.host, peer.port, strerror(-res));
+    }
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    co_await Ring.timeout(PEER_RETRY);
+  }
+}
+
+Task Broker::releaseSessions(vector<socket_t> subs) {
+  co_await Ring.timeout(REPLICA_GRACE);
+  for (socket_t sub : subs) {
+    if (auto it = Sessions.find(sub); it != Sessions.end()) {
+      Routes.unsubscribeAll(it->second.subscriptions);
+      Sessions.erase(it);
+      replicateClose(sub);
+    }
+  }
+  checkInterest();
+}
+
+Task Broker::handoffLoop() {
+  socket_t successor = -1;
+  while (successor < 0 && !Stopping.load(memory_order_relaxed)) {
+    successor = co_await Ring.accept(HandoffListener);
+    if (successor == -EBUSY) {
+      co_await Ring.yield();
+    } else if (successor < 0 && successor != -EINTR && successor != -EAGAIN) {
+      Log.log(LogId::ACCEPT_FAILED, strerror(-successor));
+    }
+  }
+  if (successor < 0)
+    co_return;
+
+  Log.log(LogId::HANDOFF_STARTED, successor);
+  HandingOff = true;
+  // Withdraws every accept, recv and send this broker still has queued,
+  // without touching the sockets: the successor gets them as they are
+  for (const auto &listener : Listeners) {
+    Ring.prepCancelFd(listener.S);
+  }
+  for (const auto &[fd, client] : Clients) {
+    Ring.prepCancelFd(fd);
+  }
+  while (AcceptLoops > 0 || ranges::any_of(Clients, [](const auto &entry) {
+           return entry.second.recvInProgress || entry.second.sendInProgress;
+         })) {
+    if (co_await Ring.timeout(HANDOFF_POLL) == -EBUSY) {
+      co_await Ring.yield();
+    }
+  }
+
+  try {
+    handOff(successor);
+  } catch (const exception &e) {
+    Log.log(LogId::HANDOFF_FAILED, e.what());
+    ::close(successor);
+    HandingOff = false;
+    for (const auto &listener : Listeners) {
+      acceptLoop(listener);
+    }
+    resumeClients();
+    handoffLoop();
+    co_return;
+  }
+  Successor = successor;
+  stop();
+}
+
+Task Broker::interestLoop() {
+  // Readers attach to the rings without telling the broker, and may die
+  // without detaching
+  while (!Stopping.load(memory_order_relaxed)) {
+    if (co_await Ring.timeout(SHM_INTEREST_INTERVAL) == -EBUSY) {
+      co_await Ring.yield();
+    }
+    Shm->reap();
+    checkInterest();
+  }
+}
+
+void Broker::run() {
+  for (const auto &listener : Listeners) {
+    acceptLoop(listener);
+  }
+  // Clients taken over from an old broker carry on where they were
+  resumeClients();
+  commandLoop();
+  for (size_t i = 0; i < PeerAddresses.size(); ++i) {
+    dial(static_cast<int>(i), false);
+  }
+  if (StandbyAddress) {
+    dial(DIALED_STANDBY, false);
+  }
+  if (Shm) {
+    interestLoop();
+  }
+  if (HandoffListener >= 0) {
+    handoffLoop();
+  }
+
+  while (!Stopping.load(memory_order_relaxed)) {
+    int ret = Ring.waitAndComplete();
+    // One wakeup and one replication write per batch of completions
+    if (Shm) {
+      Shm->wake();
+    }
+    flushReplica();
+    if (ret < 0) {
+      if (ret == -EINTR) {
+        continue;
+      }
+      println(stderr, "\033[31mio_uring wait failed: {}\033[0m",
+              strerror(-ret));
+      break;
+    }
+  }
+
+  println("\n\033[33mShutting down broker...\033[0m");
+}
+
+} // namespace pubsub
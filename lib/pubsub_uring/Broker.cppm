@@ -0,0 +1,357 @@
+module;
+
+#include <sys/socket.h>
+
+export module pubsub_uring:Broker;
+
+import std;
+import :Protocol;
+import :Codec;
+import :BufferPool;
+import :Metrics;
+import :Log;
+import :Uring;
+import :Task;
+import :Connection;
+import :Router;
+import :Shm;
+import :MpscQueue;
+import :Handoff;
+
+using namespace std;
+
+export namespace pubsub {
+
+// A message as in-process subscribers see it. Every local subscriber of a
+// message shares one copy, which stays valid for as long as any of them
+// holds on to data.
+struct SharedMessage {
+  channel_t channel;
+  // The routed line, trailing newline included
+  shared_ptr<const string> data;
+
+  string_view payload() const {
+    string_view line = *data;
+    if (line.ends_with('\n')) {
+      line.remove_suffix(1);
+    }
+    return line;
+  }
+};
+
+// Runs on the broker's ring thread; must not block
+using LocalCallback = function<void(const SharedMessage &)>;
+
+// Runs on the broker's ring thread with the numeric channels someone reads
+using InterestCallback = function<void(const ChannelSet &wanted)>;
+
+// Returned by Broker::subscribe, pass it back to unsubscribe
+using LocalSubscription = socket_t;
+
+// A listening socket. Clients accepted on a SOCK_SEQPACKET listener send
+// one frame per record.
+struct Listener {
+  socket_t S = -1;
+  bool records = false;
+  // Unlinked on shutdown, empty for TCP
+  string path;
+};
+
+// The TCP broker's event loop, usable in-process. run() owns the calling
+// thread until stop(); remote clients connect to whatever listeners were set
+// up before it. Other threads of the application publish and subscribe
+// through a lock-free queue that the ring thread drains when woken through
+// an eventfd, so they never touch the routing tables themselves.
+class Broker {
+public:
+  explicit Broker(bool verbose = false);
+  ~Broker();
+
+  Broker(const Broker &) = delete;
+  Broker &operator=(const Broker &) = delete;
+
+  void setupListenSocket(const string &host, uint16_t port);
+  // Local clients skip the TCP/IP stack. With seqpacket the kernel keeps
+  // frame boundaries, so their frames are not scanned for newlines.
+  void setupUnixSocket(const string &path, bool seqpacket);
+  void setupSharedMemory(const string &name);
+  // Federation: id names this broker to its peers and must be unique and
+  // non-zero among linked brokers. Peer handshakes are refused without it.
+  void setupFederation(uint32_t id);
+  // Dialed from run(), and again whenever the link drops. Each link only
+  // needs to be configured on one of its two brokers.
+  void addPeer(const string &host, uint16_t port);
+  // Hot standby: this broker streams everything it routes and every
+  // subscription change to the standby at host:port, in one write per pass
+  // of the event loop. Dialed from run(), and again whenever the link drops.
+  void setupReplication(const string &host, uint16_t port);
+  // Accepts a primary's link. Its subscribers become sessions that nothing
+  // is delivered to, so the routing table, topic ids, interest and shm rings
+  // are warm when they fail over here; they are dropped REPLICA_GRACE after
+  // the link goes down.
+  void setupStandby();
+  static constexpr chrono::seconds REPLICA_GRACE{10};
+  // Hot restart. The next broker started with the same path takes this
+  // one's listeners and clients over, and this one stops.
+  void setupHandoff(const string &path);
+  // The successor's side, called before setting up any listener: asks the
+  // broker serving path for its listeners and clients. Returns false when
+  // nobody serves it, and the caller sets up its own listeners. Returns
+  // once the old broker has exited, so its cleanup cannot remove the files
+  // this one creates afterwards.
+  bool takeOver(const string &path);
+
+  const BrokerMetrics &metrics() const { return Metrics; }
+
+  // Tasks started on the broker's ring run on its thread, between
+  // completions; only they may call forward()
+  Uring &ring() { return Ring; }
+
+  // callback gets the numeric channels 1-255 that some subscriber of this
+  // broker reads whenever that set changes. Broadcast subscribers read every
+  // channel; shared-memory readers are noticed within SHM_INTEREST_INTERVAL,
+  // and so are readers that died.
+  // Set before run().
+  void onInterest(InterestCallback callback);
+  static constexpr chrono::milliseconds SHM_INTEREST_INTERVAL{100};
+
+  // Ring thread only: routes line, newline included, at once, as if a
+  // remote publisher had sent it on channel
+  void forward(channel_t channel, string_view line);
+
+  // Blocks until stop()
+  void run();
+  // Safe from any thread and from signal handlers
+  void stop();
+
+  // In-process API, safe from any thread. payload is one message without
+  // its newline; messages from one thread are routed in order.
+  void publish(channel_t channel, string_view payload);
+  void publish(string_view topic, string_view payload);
+
+  // callback gets every message on channels and on topics matching
+  // patterns, from the first one routed after the ring thread picks the
+  // request up
+  LocalSubscription subscribe(const ChannelSet &channels,
+                              span<const string_view> patterns,
+                              LocalCallback callback);
+  // No callback runs for the subscription once the ring thread handles this
+  void unsubscribe(LocalSubscription id);
+
+  // ConnectionSink callbacks, driven by processClientBuffer
+  void onHandshake(Client &client, const codec::Handshake &handshake);
+  void onMessage(Client &client, const codec::Message &message);
+  void onControl(Client &client, const codec::Control &control);
+  void onForward(Client &client, const codec::Forward &forward);
+  void onPeerInterest(Client &client, const ChannelSet &interest);
+  void onReplicaTopic(Client &client, const codec::TopicRecord &topic);
+  void onInvalid(Client &client, string_view data);
+  void onExit(Client &client);
+
+private:
+  // Handed from application threads to the ring thread
+  struct Command {
+    enum Kind : uint8_t { PUBLISH, SUBSCRIBE, UNSUBSCRIBE };
+
+    Kind kind;
+    LocalSubscription id = 0;
+    channel_t channel = 0;
+    // Publish by name when not empty
+    string topic{};
+    // Publish: the line to route, handed to local subscribers as it is.
+    // Subscribe: unused.
+    shared_ptr<const string> data{};
+    ChannelSet channels{};
+    vector<string> patterns{};
+    LocalCallback callback{};
+  };
+
+  struct LocalSubscriber {
+    Subscriptions subscriptions;
+    LocalCallback callback;
+  };
+
+  struct PeerAddress {
+    string host;
+    uint16_t port;
+  };
+
+  // Sequence numbers recently seen from one origin broker. A message is new
+  // unless it is in the window or older than all of it.
+  struct SeenWindow {
+    uint64_t highest = 0;
+    // Bit i: highest - i was seen
+    bitset<1024> recent;
+  };
+
+  // One logical subscriber of a MUX connection
+  struct Session {
+    socket_t fd;
+    uint32_t id;
+    Subscriptions subscriptions;
+  };
+
+  // Binds and registers listener, closing its socket on failure
+  void listenOn(Listener listener, const sockaddr *addr, socklen_t len);
+
+  Client &addClient(socket_t fd, bool records);
+  void removeClient(socket_t fd);
+  Client *getClient(socket_t fd);
+  // The Client is only freed once neither its recv session nor its send
+  // flush is suspended on the ring; shutdown() wakes whichever is pending.
+  void closeClient(Client &client);
+  // Starts receiving and sending for clients that are not yet, e.g. ones
+  // taken over from an old broker
+  void resumeClients();
+
+  void subscribeToChannel(Client &client, uint8_t channel);
+  void unsubscribeFromChannel(Client &client, uint8_t channel);
+  // Shared by the handshake and [[+SUB:...]]
+  void subscribe(Client &client, const ChannelSet &channels,
+                 span<const string_view> patterns);
+  // [[-SUB:...]]
+  void unsubscribe(Client &client, const ChannelSet &channels,
+                   span<const string_view> patterns);
+  // The same for an in-process subscriber or a session, by Router id
+  void subscribeSet(socket_t sub, Subscriptions &owner,
+                    const ChannelSet &channels,
+                    span<const string_view> patterns);
+  void unsubscribeSet(socket_t sub, Subscriptions &owner,
+                      const ChannelSet &channels,
+                      span<const string_view> patterns);
+  // [[+SES:...]] and [[-SES:...]]
+  void sessionControl(Client &client, const codec::Control &control);
+  void closeSession(Client &client, uint32_t session);
+  // Called by the Router for every topic a pattern subscription picks up,
+  // at subscribe time or when a publisher registers the topic later
+  void onTopicSubscribed(socket_t fd, channel_t topic);
+  channel_t registerTopic(string_view name);
+
+  void routeMessage(channel_t channel, string_view message, socket_t senderFd);
+  void enqueueMessage(socket_t fd, channel_t channel, string_view message);
+  void enqueueFrame(Client &client, channel_t channel, string_view frame);
+  // One frame per MUX connection the message reached, listing its sessions
+  void flushSessionTargets(channel_t channel, string_view message);
+
+  // Numeric channels some local subscriber or shm reader wants, all of them
+  // if anyone subscribed to the broadcast channel
+  ChannelSet localInterest() const;
+  // Reports changed interest to InterestChanged and to peer brokers
+  void checkInterest();
+
+  // Federation
+  void linkPeer(Client &client, uint32_t peer);
+  bool firstSighting(uint32_t origin, uint64_t seq);
+  // Passes a message on to every peer that wants channel except from
+  void sendToPeers(channel_t channel, string_view message, uint32_t origin,
+                   uint64_t seq, socket_t from);
+  // Queues a frame that is not a routed message
+  void queueControl(Client &client, string frame);
+
+  // Replication, no-ops while no standby is linked. Records collect in
+  // ReplicaBatch until flushReplica() hands them to the link in one piece.
+  void linkStandby(Client &client);
+  // Everything the standby needs to catch up with a fresh link
+  void replicateSnapshot();
+  void replicateSubscription(socket_t sub, bool subscribe,
+                             const ChannelSet &channels,
+                             span<const string_view> patterns);
+  void replicateSubscriptions(socket_t sub, const Subscriptions &owner);
+  // The numeric channels and patterns owner subscribed to
+  void describe(const Subscriptions &owner, ChannelSet &channels,
+                vector<string_view> &patterns) const;
+  // The same as a channel list, "1,2,a.*"
+  string subscriptionList(const Subscriptions &owner) const;
+  void replicateClose(socket_t sub);
+  void flushReplica();
+
+  // Hot restart
+  handoff::ClientState saveClient(const Client &client) const;
+  void restoreClient(socket_t fd, handoff::ClientState &state);
+  // Sends every listener and client to successor. Throws runtime_error,
+  // and this broker carries on, when the successor goes away.
+  void handOff(socket_t successor);
+
+  void post(Command command);
+  // Ring thread: runs everything application threads queued
+  void drainCommands();
+  void runCommand(Command &command);
+
+  Task acceptLoop(const Listener &listener);
+  Task clientSession(Client &client);
+  Task flushSendQueue(Client &client);
+  Task commandLoop();
+  Task interestLoop();
+  // target is a PeerAddresses index, or the standby
+  Task dial(int target, bool retry);
+  // Standby: drops what a lost primary link left behind
+  Task releaseSessions(vector<socket_t> subs);
+  Task handoffLoop();
+
+  Uring Ring;
+  // Stable addresses, accept loops hold references
+  deque<Listener> Listeners;
+  map<socket_t, Client> Clients;
+  Router<socket_t> Routes;
+  BufferPool RecvBuffers;
+  BrokerMetrics Metrics;
+  Logger Log;
+  // Local subscribers' rings, see --shm
+  optional<ShmWriter> Shm;
+  // Number of the message being routed, for tracepoints
+  uint32_t MessageSeq = 0;
+  bool verbose;
+
+  // In-process subscribers and MUX sessions, keyed by negative ids so they
+  // share the Router with client fds
+  map<LocalSubscription, LocalSubscriber> Locals;
+  unordered_map<socket_t, Session> Sessions;
+  // MUX connections with targets for the message being routed
+  vector<socket_t> MuxTargets;
+  string MuxFrame;
+  // The current message's shared copy, made for the first local subscriber
+  // unless it was published in-process and is shared already
+  shared_ptr<const string> Shared;
+  MpscQueue<Command> Commands;
+  // Readable when Commands has work or stop() was called
+  int Wake = -1;
+  // Set by the first post() since the ring thread last drained, so a burst
+  // of publishes costs one eventfd write
+  atomic<bool> WakePending{false};
+  atomic<bool> Stopping{false};
+  atomic<LocalSubscription> NextLocal{-1};
+
+  InterestCallback InterestChanged;
+  // As last reported to InterestChanged
+  ChannelSet Interest;
+
+  // 0 when not federated
+  uint32_t FederationId = 0;
+  vector<PeerAddress> PeerAddresses;
+  // Linked peer connections, dialed or accepted
+  vector<socket_t> PeerLinks;
+  unordered_map<uint32_t, SeenWindow> Seen;
+  // Sequence of the messages this broker originates
+  uint64_t ForwardSeq = 0;
+  // The [F:...] frame of the message being passed on, built once
+  string ForwardFrame;
+
+  optional<PeerAddress> StandbyAddress;
+  // The link to the standby once it is up
+  socket_t ReplicaLink = -1;
+  string ReplicaBatch;
+  bool Standby = false;
+
+  socket_t HandoffListener = -1;
+  // Unlinked on shutdown unless a successor took it over
+  string HandoffPath;
+  // Set from the start of a handoff until it fails: nothing new is started
+  // on the sockets the successor is about to share
+  bool HandingOff = false;
+  int AcceptLoops = 0;
+  // Kept open until this broker is destroyed; the successor waits for it
+  // to close
+  socket_t Successor = -1;
+};
+
+} // namespace pubsub
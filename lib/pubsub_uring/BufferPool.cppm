@@ -0,0 +1,57 @@
+export module pubsub_uring:BufferPool;
+
+import std;
+
+using namespace std;
+
+export namespace pubsub {
+
+// Fixed-size buffers handed out by index. Storage is allocated in chunks that
+// never move, so a buffer stays valid while the kernel writes into it.
+class BufferPool {
+public:
+  static constexpr uint32_t INVALID = numeric_limits<uint32_t>::max();
+
+  BufferPool(size_t bufferSize, uint32_t buffersPerChunk)
+      : bufSize(bufferSize), perChunk(buffersPerChunk) {}
+
+  uint32_t acquire() {
+    if (freeList.empty()) {
+      grow();
+    }
+    uint32_t id = freeList.back();
+    freeList.pop_back();
+    return id;
+  }
+
+  void release(uint32_t id) {
+    if (id != INVALID) {
+      freeList.push_back(id);
+    }
+  }
+
+  span<char> buffer(uint32_t id) {
+    return {chunks[id / perChunk].get() + (id % perChunk) * bufSize, bufSize};
+  }
+
+  size_t bufferSize() const { return bufSize; }
+
+  size_t capacity() const { return chunks.size() * perChunk; }
+
+private:
+  void grow() {
+    const auto base = static_cast<uint32_t>(capacity());
+    chunks.push_back(make_unique_for_overwrite<char[]>(perChunk * bufSize));
+    // Hand out low ids first
+    for (uint32_t i = perChunk; i > 0; --i) {
+      freeList.push_back(base + i - 1);
+    }
+  }
+
+  size_t bufSize;
+  uint32_t perChunk;
+  vector<unique_ptr<char[]>> chunks;
+  vector<uint32_t> freeList;
+};
+
+} // namespace pubsub
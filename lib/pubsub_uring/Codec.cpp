@@ -0,0 +1,463 @@
+module pubsub_uring;
+
+import std;
+
+using namespace std;
+
+namespace pubsub::codec {
+
+optional<uint8_t> parseChannel(string_view text) {
+  unsigned value{};
+  auto [ptr, ec] = from_chars(text.data(), text.data() + text.size(), value);
+  if (ec != errc{} || ptr != text.data() + text.size() ||
+      value > protocol::MAX_CHANNELS) {
+    return nullopt;
+  }
+  return static_cast<uint8_t>(value);
+}
+
+bool isValidTopic(string_view name, bool pattern) {
+  if (name.empty() || name.size() > protocol::MAX_TOPIC_SIZE)
+    return false;
+  // Where channels and topics share a list, a leading digit means a channel
+  // and ALL means every channel
+  if (isdigit(static_cast<unsigned char>(name.front())) ||
+      name == protocol::SUB_ALL)
+    return false;
+
+  while (true) {
+    size_t dot = name.find(protocol::TOPIC_SEPARATOR);
+    string_view segment = name.substr(0, dot);
+    if (segment.empty())
+      return false;
+
+    if (segment == protocol::TOPIC_REST) {
+      // Only as the last segment
+      if (!pattern || dot != string_view::npos)
+        return false;
+    } else if (segment == protocol::TOPIC_ANY) {
+      if (!pattern)
+        return false;
+    } else {
+      for (char c : segment) {
+        if (!isalnum(static_cast<unsigned char>(c)) && c != '_' &&
+            c != '-' && c != ':')
+          return false;
+      }
+    }
+
+    if (dot == string_view::npos)
+      return true;
+    name.remove_prefix(dot + 1);
+  }
+}
+
+bool parseChannelList(string_view text, ChannelSet &channels,
+                      vector<string_view> &topics) {
+  if (text == protocol::SUB_ALL) {
+    channels.set();
+    return true;
+  }
+
+  while (!text.empty()) {
+    size_t comma = text.find(',');
+    string_view token = text.substr(0, comma);
+    if (!token.empty()) {
+      if (isdigit(static_cast<unsigned char>(token.front()))) {
+        auto channel = parseChannel(token);
+        if (!channel)
+          return false;
+        channels.set(*channel);
+      } else if (isValidTopic(token, true)) {
+        topics.push_back(token);
+      } else {
+        return false;
+      }
+    }
+    if (comma == string_view::npos)
+      break;
+    text.remove_prefix(comma + 1);
+  }
+  return true;
+}
+
+string formatChannelList(const ChannelSet &channels) {
+  if (channels.all())
+    return string(protocol::SUB_ALL);
+
+  string list;
+  for (size_t ch = 0; ch < protocol::CHANNEL_COUNT; ++ch) {
+    if (channels.test(ch)) {
+      format_to(back_inserter(list), "{}{}", list.empty() ? "" : ",", ch);
+    }
+  }
+  return list;
+}
+
+ParseStatus parseHandshake(string_view data, Handshake &handshake) {
+  const bool isPub = data.starts_with(protocol::HANDSHAKE_PUB);
+  const bool isSub = !isPub && data.starts_with(protocol::HANDSHAKE_SUB);
+
+  if (data.starts_with(protocol::HANDSHAKE_PEER)) {
+    const size_t end = data.find(protocol::HANDSHAKE_END);
+    if (end == string_view::npos)
+      return ParseStatus::INCOMPLETE;
+    const char *first = data.data() + protocol::HANDSHAKE_PEER.size();
+    const char *last = data.data() + end;
+    auto [ptr, ec] = from_chars(first, last, handshake.peer);
+    if (ec != errc{} || ptr != last || handshake.peer == 0)
+      return ParseStatus::INVALID;
+    handshake.type = ClientType::PEER;
+    handshake.channels.reset();
+    handshake.topics.clear();
+    handshake.consumed = end + protocol::HANDSHAKE_END.size();
+    return ParseStatus::OK;
+  }
+
+  if (data.starts_with(protocol::HANDSHAKE_MUX)) {
+    // Sessions subscribe afterwards, one control frame each
+    handshake.type = ClientType::MUX;
+    handshake.channels.reset();
+    handshake.topics.clear();
+    handshake.consumed = protocol::HANDSHAKE_MUX.size();
+    return ParseStatus::OK;
+  }
+
+  if (data.starts_with(protocol::HANDSHAKE_REPLICA)) {
+    // The primary's records follow at once
+    handshake.type = ClientType::REPLICA;
+    handshake.channels.reset();
+    handshake.topics.clear();
+    handshake.consumed = protocol::HANDSHAKE_REPLICA.size();
+    return ParseStatus::OK;
+  }
+
+  if (!isPub && !isSub) {
+    // A prefix of a valid handshake may still complete
+    if (protocol::HANDSHAKE_PUB.starts_with(data) ||
+        protocol::HANDSHAKE_SUB.starts_with(data) ||
+        protocol::HANDSHAKE_MUX.starts_with(data) ||
+        protocol::HANDSHAKE_PEER.starts_with(data) ||
+        protocol::HANDSHAKE_REPLICA.starts_with(data)) {
+      return ParseStatus::INCOMPLETE;
+    }
+    return ParseStatus::INVALID;
+  }
+
+  size_t end = data.find(protocol::HANDSHAKE_END);
+  if (end == string_view::npos)
+    return ParseStatus::INCOMPLETE;
+
+  // Both prefixes have the same length
+  string_view body = data.substr(protocol::HANDSHAKE_PUB.size(),
+                                 end - protocol::HANDSHAKE_PUB.size());
+
+  handshake.channels.reset();
+  handshake.topics.clear();
+  if (isPub) {
+    handshake.type = ClientType::PUBLISHER;
+    if (body.empty()) {
+      handshake.channels.set(protocol::CHANNEL_BROADCAST);
+    } else if (auto channel = parseChannel(body)) {
+      handshake.channels.set(*channel);
+    } else {
+      // A list of topic names, wildcards are for subscribers only
+      for (auto topic : views::split(body, ',')) {
+        string_view name(topic.begin(), topic.end());
+        if (!isValidTopic(name))
+          return ParseStatus::INVALID;
+        handshake.topics.push_back(name);
+      }
+    }
+  } else {
+    handshake.type = ClientType::SUBSCRIBER;
+    if (!parseChannelList(body, handshake.channels, handshake.topics))
+      return ParseStatus::INVALID;
+  }
+
+  handshake.consumed = end + protocol::HANDSHAKE_END.size();
+  return ParseStatus::OK;
+}
+
+optional<Control> parseControl(string_view line) {
+  const bool session = line.starts_with(protocol::CONTROL_SESSION_SUB) ||
+                       line.starts_with(protocol::CONTROL_SESSION_UNSUB);
+  const bool subscribe = line.starts_with(protocol::CONTROL_SUB) ||
+                         line.starts_with(protocol::CONTROL_SESSION_SUB);
+  if (!session && !subscribe && !line.starts_with(protocol::CONTROL_UNSUB))
+    return nullopt;
+
+  size_t end = line.find(protocol::HANDSHAKE_END);
+  if (end == string_view::npos)
+    return nullopt;
+
+  // All four prefixes have the same length
+  string_view body = line.substr(protocol::CONTROL_SUB.size(),
+                                 end - protocol::CONTROL_SUB.size());
+  Control control{subscribe, {}, {}, nullopt};
+  if (session) {
+    // The id never contains ':', topics after it may
+    const size_t colon = body.find(':');
+    const string_view id = body.substr(0, colon);
+    uint32_t value{};
+    auto [ptr, ec] = from_chars(id.data(), id.data() + id.size(), value);
+    if (id.empty() || ec != errc{} || ptr != id.data() + id.size())
+      return nullopt;
+    control.session = value;
+    if (colon == string_view::npos) {
+      // Only [[-SES:id]] may leave out the list
+      return subscribe ? nullopt : optional(control);
+    }
+    body.remove_prefix(colon + 1);
+  }
+  if (body.empty() ||
+      !parseChannelList(body, control.channels, control.topics)) {
+    return nullopt;
+  }
+  return control;
+}
+
+optional<Message> parseMessage(string_view data) {
+  if (!data.starts_with(protocol::MSG_PREFIX)) {
+    return nullopt;
+  }
+
+  size_t chEnd = data.find(']');
+  if (chEnd == string_view::npos)
+    return nullopt;
+
+  // Range checks are up to the broker, topic publishers index past 255
+  const char *first = data.data() + protocol::MSG_PREFIX.size();
+  const char *last = data.data() + chEnd;
+  channel_t channel{};
+  auto [ptr, ec] = from_chars(first, last, channel);
+  if (ec != errc{} || ptr != last)
+    return nullopt;
+
+  return Message{channel, data.substr(chEnd + 1)};
+}
+
+optional<string_view> parseSessions(string_view frame,
+                                    vector<uint32_t> &sessions) {
+  if (!frame.starts_with(protocol::SESSION_PREFIX))
+    return nullopt;
+  const size_t end = frame.find(']');
+  if (end == string_view::npos)
+    return nullopt;
+
+  const char *first = frame.data() + protocol::SESSION_PREFIX.size();
+  const char *last = frame.data() + end;
+  while (first < last) {
+    uint32_t session{};
+    auto [ptr, ec] = from_chars(first, last, session);
+    if (ec != errc{} || (ptr != last && *ptr != ','))
+      return nullopt;
+    sessions.push_back(session);
+    first = ptr + 1;
+  }
+  return frame.substr(end + 1);
+}
+
+optional<ChannelSet> parseInterest(string_view line) {
+  constexpr size_t DIGITS = protocol::CHANNEL_COUNT / 4;
+  if (!line.starts_with(protocol::INTEREST_PREFIX))
+    return nullopt;
+  line.remove_prefix(protocol::INTEREST_PREFIX.size());
+  if (line.size() < DIGITS ||
+      !line.substr(DIGITS).starts_with(protocol::HANDSHAKE_END)) {
+    return nullopt;
+  }
+
+  ChannelSet channels;
+  for (size_t i = 0; i < DIGITS; ++i) {
+    unsigned nibble{};
+    auto [ptr, ec] = from_chars(&line[i], &line[i] + 1, nibble, 16);
+    if (ec != errc{})
+      return nullopt;
+    for (size_t bit = 0; bit < 4; ++bit) {
+      channels.set(i * 4 + bit, (nibble >> bit) & 1);
+    }
+  }
+  return channels;
+}
+
+optional<Forward> parseForward(string_view data) {
+  if (!data.starts_with(protocol::FORWARD_PREFIX))
+    return nullopt;
+  const size_t end = data.find(']');
+  if (end == string_view::npos)
+    return nullopt;
+
+  const char *p = data.data() + protocol::FORWARD_PREFIX.size();
+  const char *last = data.data() + end;
+  Forward forward{};
+  auto field = [&](auto &value, bool final) {
+    auto [next, ec] = from_chars(p, last, value);
+    if (ec != errc{} || (final ? next != last : next == last || *next != ':'))
+      return false;
+    p = next + 1;
+    return true;
+  };
+  if (!field(forward.origin, false) || !field(forward.seq, false) ||
+      !field(forward.channel, true) ||
+      forward.channel > protocol::MAX_CHANNELS) {
+    return nullopt;
+  }
+  forward.content = data.substr(end + 1);
+  return forward;
+}
+
+optional<TopicRecord> parseTopicRecord(string_view line) {
+  if (!line.starts_with(protocol::TOPIC_RECORD))
+    return nullopt;
+  const size_t end = line.find(protocol::HANDSHAKE_END);
+  if (end == string_view::npos)
+    return nullopt;
+
+  const char *first = line.data() + protocol::TOPIC_RECORD.size();
+  const char *last = line.data() + end;
+  TopicRecord record{};
+  auto [ptr, ec] = from_chars(first, last, record.id);
+  if (ec != errc{} || ptr == last || *ptr != ':')
+    return nullopt;
+  record.name = string_view(ptr + 1, last);
+  if (!isValidTopic(record.name))
+    return nullopt;
+  return record;
+}
+
+size_t findFrameEnd(string_view data) {
+  const void *newline = memchr(data.data(), '\n', data.size());
+  if (!newline)
+    return string_view::npos;
+  return static_cast<const char *>(newline) - data.data() + 1;
+}
+
+size_t encodeMessage(span<char> out, channel_t channel, string_view payload,
+                     bool terminate) {
+  array<char, 10> digits;
+  const auto digitsEnd = to_chars(digits.begin(), digits.end(), channel).ptr;
+  const size_t digitCount = static_cast<size_t>(digitsEnd - digits.begin());
+
+  // "[CH:" + digits + "]"
+  const size_t needed = protocol::MSG_PREFIX.size() + digitCount + 1 +
+                        payload.size() + (terminate ? 1 : 0);
+  if (out.size() < needed)
+    return 0;
+
+  char *p = out.data();
+  p = copy(protocol::MSG_PREFIX.begin(), protocol::MSG_PREFIX.end(), p);
+  p = copy(digits.begin(), digitsEnd, p);
+  *p++ = ']';
+  memcpy(p, payload.data(), payload.size());
+  p += payload.size();
+  if (terminate)
+    *p++ = '\n';
+  return static_cast<size_t>(p - out.data());
+}
+
+size_t encodeStamp(span<char> out, const Stamp &stamp) {
+  if (out.size() < MAX_STAMP_SIZE)
+    return 0;
+
+  char *p = out.data();
+  char *end = p + out.size();
+  *p++ = '@';
+  p = to_chars(p, end, stamp.intendedNs).ptr;
+  *p++ = ':';
+  p = to_chars(p, end, stamp.sentNs).ptr;
+  *p++ = ':';
+  p = to_chars(p, end, stamp.publisher).ptr;
+  *p++ = ':';
+  p = to_chars(p, end, stamp.seq).ptr;
+  *p++ = '|';
+  return static_cast<size_t>(p - out.data());
+}
+
+optional<Stamp> parseStamp(string_view content) {
+  if (!content.starts_with('@'))
+    return nullopt;
+
+  const char *p = content.data() + 1;
+  const char *end = content.data() + content.size();
+  Stamp stamp{};
+
+  auto field = [&](auto &value, char sep) {
+    auto [next, ec] = from_chars(p, end, value);
+    if (ec != errc{} || next == end || *next != sep)
+      return false;
+    p = next + 1;
+    return true;
+  };
+
+  if (!field(stamp.intendedNs, ':') || !field(stamp.sentNs, ':') ||
+      !field(stamp.publisher, ':') || !field(stamp.seq, '|')) {
+    return nullopt;
+  }
+  return stamp;
+}
+
+string makePubHandshake(uint8_t channel) {
+  return format("{}{}{}", protocol::HANDSHAKE_PUB, channel,
+                protocol::HANDSHAKE_END);
+}
+
+string makePubHandshake(string_view topics) {
+  return format("{}{}{}", protocol::HANDSHAKE_PUB, topics,
+                protocol::HANDSHAKE_END);
+}
+
+string makeSubHandshake(string_view channels) {
+  return format("{}{}{}", protocol::HANDSHAKE_SUB, channels,
+                protocol::HANDSHAKE_END);
+}
+
+string makeControl(bool subscribe, string_view channels) {
+  return format("{}{}{}\n",
+                subscribe ? protocol::CONTROL_SUB : protocol::CONTROL_UNSUB,
+                channels, protocol::HANDSHAKE_END);
+}
+
+string makePeerHandshake(uint32_t id) {
+  return format("{}{}{}", protocol::HANDSHAKE_PEER, id,
+                protocol::HANDSHAKE_END);
+}
+
+string makeInterest(const ChannelSet &channels) {
+  string frame(protocol::INTEREST_PREFIX);
+  for (size_t i = 0; i < protocol::CHANNEL_COUNT; i += 4) {
+    const unsigned nibble = channels.test(i) | channels.test(i + 1) << 1 |
+                            channels.test(i + 2) << 2 |
+                            channels.test(i + 3) << 3;
+    frame.push_back("0123456789abcdef"[nibble]);
+  }
+  frame.append(protocol::HANDSHAKE_END).push_back('\n');
+  return frame;
+}
+
+void appendForward(string &out, const Forward &forward) {
+  format_to(back_inserter(out), "{}{}:{}:{}]", protocol::FORWARD_PREFIX,
+            forward.origin, forward.seq, forward.channel);
+  out.append(forward.content);
+}
+
+void appendMessage(string &out, channel_t channel, string_view content) {
+  format_to(back_inserter(out), "{}{}]", protocol::MSG_PREFIX, channel);
+  out.append(content);
+}
+
+void appendTopicRecord(string &out, channel_t id, string_view name) {
+  format_to(back_inserter(out), "{}{}:{}{}\n", protocol::TOPIC_RECORD, id,
+            name, protocol::HANDSHAKE_END);
+}
+
+string makeSessionControl(bool subscribe, uint32_t session,
+                          string_view channels) {
+  return format("{}{}{}{}{}\n",
+                subscribe ? protocol::CONTROL_SESSION_SUB
+                          : protocol::CONTROL_SESSION_UNSUB,
+                session, channels.empty() ? "" : ":", channels,
+                protocol::HANDSHAKE_END);
+}
+
+} // namespace pubsub::codec
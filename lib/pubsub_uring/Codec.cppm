@@ -0,0 +1,155 @@
+export module pubsub_uring:Codec;
+
+import std;
+import :Protocol;
+
+using namespace std;
+
+export namespace pubsub::codec {
+
+enum class ParseStatus { OK, INCOMPLETE, INVALID };
+
+struct Handshake {
+  ClientType type = ClientType::UNKNOWN;
+  ChannelSet channels;
+  // Topic names of a publisher or topic patterns of a subscriber, in order.
+  // They view the parsed input.
+  vector<string_view> topics;
+  // Bytes of the input taken by the handshake frame
+  size_t consumed = 0;
+  // PEER: the other broker's id
+  uint32_t peer = 0;
+};
+
+// A topic publisher's channel is the index of the topic in its handshake
+// [[+SUB:...]] or [[-SUB:...]] from a subscriber that is already READY, or
+// the [[+SES:...]] / [[-SES:...]] form from a MUX connection
+struct Control {
+  bool subscribe;
+  ChannelSet channels;
+  // Topic patterns, viewing the parsed input
+  vector<string_view> topics;
+  // Set for the session form
+  optional<uint32_t> session;
+
+  // [[-SES:id]]
+  bool closesSession() const {
+    return session && !subscribe && channels.none() && topics.empty();
+  }
+};
+
+struct Message {
+  channel_t channel;
+  // Everything after the channel prefix, including the trailing newline on
+  // stream transports
+  string_view content;
+};
+
+// A message one broker passes to another. seq is per origin broker and
+// lets a broker drop what reaches it twice around a cycle of links.
+struct Forward {
+  uint32_t origin;
+  uint64_t seq;
+  channel_t channel;
+  // As in Message
+  string_view content;
+};
+
+// [[TOPIC:id:name]] from a primary broker: the id it interned name under
+struct TopicRecord {
+  channel_t id;
+  string_view name;
+};
+
+optional<uint8_t> parseChannel(string_view text);
+
+// Dot-separated segments of letters, digits, '_', '-' and ':', not starting
+// with a digit and not "ALL", so a token in a channel list is never both a
+// channel and a topic. Patterns may also use "*" segments and a final ">"
+// segment.
+bool isValidTopic(string_view name, bool pattern = false);
+
+// Parses "1,2,3" or "ALL". Tokens that are not numbers must be valid topic
+// patterns and are appended to topics; empty tokens are skipped.
+bool parseChannelList(string_view text, ChannelSet &channels,
+                      vector<string_view> &topics);
+
+// "ALL" when every channel is set, else "1,2,3"
+string formatChannelList(const ChannelSet &channels);
+
+// [[PUB:123]], [[PUB:a.b,a.c]] or [[SUB:1,2,a.*]] / [[SUB:ALL]], [[MUX]],
+// [[PEER:id]] or [[REPL]]
+ParseStatus parseHandshake(string_view data, Handshake &handshake);
+
+// [[+SUB:1,a.*]] or [[-SUB:ALL]], [[+SES:7:1,a.*]] or [[-SES:7]]; whatever
+// follows the frame on the line is ignored
+optional<Control> parseControl(string_view line);
+
+// [CH:123]message content
+optional<Message> parseMessage(string_view data);
+
+// Splits [S:1,5,9]rest into the session ids, appended to sessions, and rest
+optional<string_view> parseSessions(string_view frame,
+                                    vector<uint32_t> &sessions);
+
+// [[INT:...]] from a peer broker: 64 hex digits, four channels each, channel
+// 0 in the lowest bit of the first
+optional<ChannelSet> parseInterest(string_view line);
+
+// [F:origin:seq:channel]message content
+optional<Forward> parseForward(string_view data);
+
+optional<TopicRecord> parseTopicRecord(string_view line);
+
+// Offset one past the next '\n', or npos when no complete frame is buffered
+size_t findFrameEnd(string_view data);
+
+// Writes [CH:N]payload (plus '\n' when terminate is set) into out. Returns
+// the number of bytes written, 0 if it does not fit.
+size_t encodeMessage(span<char> out, channel_t channel, string_view payload,
+                     bool terminate = true);
+
+// Benchmark payloads start with "@intended:sent:publisher:seq|". Times are
+// steady_clock nanoseconds, so both ends must run on the same host.
+struct Stamp {
+  uint64_t intendedNs;
+  uint64_t sentNs;
+  uint32_t publisher;
+  uint64_t seq;
+};
+
+constexpr size_t MAX_STAMP_SIZE = 1 + 20 + 1 + 20 + 1 + 10 + 1 + 20 + 1;
+
+// The clock stamps are taken from
+inline uint64_t stampClockNs() {
+  return chrono::duration_cast<chrono::nanoseconds>(
+             chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Returns bytes written, 0 if out is too small
+size_t encodeStamp(span<char> out, const Stamp &stamp);
+
+optional<Stamp> parseStamp(string_view content);
+
+string makePubHandshake(uint8_t channel);
+// Comma-separated topic names
+string makePubHandshake(string_view topics);
+string makeSubHandshake(string_view channels);
+// Newline-terminated, it follows the handshake on a stream
+string makeControl(bool subscribe, string_view channels);
+string makePeerHandshake(uint32_t id);
+// Newline-terminated
+string makeInterest(const ChannelSet &channels);
+// Appends [F:origin:seq:channel] and content to out
+void appendForward(string &out, const Forward &forward);
+// Appends [CH:channel] and content to out
+void appendMessage(string &out, channel_t channel, string_view content);
+// Appends [[TOPIC:id:name]] and a newline to out
+void appendTopicRecord(string &out, channel_t id, string_view name);
+// [[+SES:session:channels]] or [[-SES:session:channels]], newline-terminated.
+// Empty channels with subscribe unset closes the session.
+string makeSessionControl(bool subscribe, uint32_t session,
+                          string_view channels);
+
+} // namespace pubsub::codec
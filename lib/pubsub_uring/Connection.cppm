@@ -0,0 +1,207 @@
+export module pubsub_uring:Connection;
+
+import std;
+import :Protocol;
+import :Codec;
+import :BufferPool;
+import :Metrics;
+import :Router;
+
+using namespace std;
+
+export namespace pubsub {
+
+enum class ClientState { HANDSHAKE, READY, CLOSING };
+
+struct Client {
+  socket_t S;
+  ClientType type;
+  ClientState state;
+  // Publisher: its channel. PEER: the channels the other broker wants.
+  ChannelSet channels;
+  // Publisher: the ids of its handshake topics, indexed by message channel.
+  // REPLICA: this broker's id for each of the primary's channel ids.
+  vector<channel_t> topics;
+  // Subscriber: every channel, topic and pattern it is in
+  Subscriptions subscriptions;
+  string recvBuffer;
+  queue<string> sendQueue;
+  bool sendInProgress;
+  bool recvInProgress;
+  // SOCK_SEQPACKET: every recv is one whole frame, nothing is buffered
+  bool records = false;
+  // MUX: session id -> the session's subscriber id in the Router. REPLICA:
+  // the same for the primary's subscribers, keyed by its Router ids.
+  unordered_map<uint32_t, socket_t> sessions;
+  // MUX: sessions the message being routed goes to
+  vector<uint32_t> targets;
+  // PEER: the other broker's id, and the channels last advertised to it
+  uint32_t peer = 0;
+  ChannelSet advertised;
+  // PEER: index of the configured peer this link was dialed to, -1 when
+  // the other broker dialed. The primary's link to its standby is -2.
+  int dialedFrom = -1;
+  uint32_t recvBufferId;
+  ClientMetrics *metrics = nullptr;
+
+  Client()
+      : S(-1), type(ClientType::UNKNOWN), state(ClientState::HANDSHAKE),
+        sendInProgress(false), recvInProgress(false),
+        recvBufferId(BufferPool::INVALID) {}
+
+  Client(socket_t s)
+      : S(s), type(ClientType::UNKNOWN), state(ClientState::HANDSHAKE),
+        sendInProgress(false), recvInProgress(false),
+        recvBufferId(BufferPool::INVALID) {}
+};
+
+// Receives the events produced while draining a client's stream buffer
+template <typename T>
+concept ConnectionSink = requires(T &sink, Client &client,
+                                  const codec::Handshake &handshake,
+                                  const codec::Message &message,
+                                  const codec::Control &control,
+                                  const codec::Forward &forward,
+                                  const ChannelSet &interest,
+                                  const codec::TopicRecord &topic,
+                                  string_view line) {
+  sink.onHandshake(client, handshake);
+  sink.onMessage(client, message);
+  sink.onControl(client, control);
+  sink.onForward(client, forward);
+  sink.onPeerInterest(client, interest);
+  sink.onReplicaTopic(client, topic);
+  sink.onInvalid(client, line);
+  sink.onExit(client);
+};
+
+// One complete frame from a READY client, newline included
+template <ConnectionSink Sink>
+void processFrame(Client &client, string_view line, Sink &sink) {
+  if (line.starts_with(protocol::EXIT_MSG)) {
+    client.state = ClientState::CLOSING;
+    sink.onExit(client);
+    return;
+  }
+
+  if (client.type == ClientType::PUBLISHER) {
+    if (auto message = codec::parseMessage(line)) {
+      sink.onMessage(client, *message);
+    } else {
+      sink.onInvalid(client, line);
+    }
+  } else if (client.type == ClientType::PEER) {
+    if (auto forward = codec::parseForward(line)) {
+      sink.onForward(client, *forward);
+    } else if (auto interest = codec::parseInterest(line)) {
+      sink.onPeerInterest(client, *interest);
+    } else {
+      sink.onInvalid(client, line);
+    }
+  } else if (client.type == ClientType::REPLICA) {
+    if (auto message = codec::parseMessage(line)) {
+      sink.onMessage(client, *message);
+    } else if (auto topic = codec::parseTopicRecord(line)) {
+      sink.onReplicaTopic(client, *topic);
+    } else if (auto control = codec::parseControl(line);
+               control && control->session) {
+      sink.onControl(client, *control);
+    } else {
+      sink.onInvalid(client, line);
+    }
+  } else if (auto control = codec::parseControl(line);
+             control && control->session.has_value() ==
+                            (client.type == ClientType::MUX)) {
+    // Sessions exist only on MUX connections, and only as sessions
+    sink.onControl(client, *control);
+  } else {
+    sink.onInvalid(client, line);
+  }
+}
+
+// Runs the HANDSHAKE -> READY -> CLOSING state machine over every complete
+// frame in client.recvBuffer. Consumed bytes are erased once at the end.
+// Fatal errors move the client to CLOSING before onInvalid is called.
+template <ConnectionSink Sink>
+void processClientBuffer(Client &client, Sink &sink) {
+  size_t offset = 0;
+
+  while (client.state != ClientState::CLOSING) {
+    string_view pending(client.recvBuffer.data() + offset,
+                        client.recvBuffer.size() - offset);
+
+    if (client.state == ClientState::HANDSHAKE) {
+      codec::Handshake handshake;
+      auto status = codec::parseHandshake(pending, handshake);
+      if (status == codec::ParseStatus::INCOMPLETE &&
+          pending.size() <= protocol::MAX_HANDSHAKE_SIZE) {
+        break;
+      }
+      if (status != codec::ParseStatus::OK) {
+        client.state = ClientState::CLOSING;
+        sink.onInvalid(client, pending);
+        break;
+      }
+
+      client.type = handshake.type;
+      client.state = ClientState::READY;
+      offset += handshake.consumed;
+      sink.onHandshake(client, handshake);
+      continue;
+    }
+
+    size_t frameEnd = codec::findFrameEnd(pending);
+    if (frameEnd == string_view::npos) {
+      const size_t limit = client.type == ClientType::REPLICA
+                               ? protocol::MAX_REPLICA_FRAME
+                               : protocol::BUFFER_SIZE;
+      if (pending.size() > limit) {
+        client.state = ClientState::CLOSING;
+        sink.onInvalid(client, pending);
+      }
+      break;
+    }
+
+    offset += frameEnd;
+    processFrame(client, pending.substr(0, frameEnd), sink);
+  }
+
+  client.recvBuffer.erase(0, offset);
+}
+
+// The same state machine for a record-preserving transport: record is the
+// handshake or exactly one frame, so there is no newline scan and no copy.
+// A frame must still end in a newline, stream subscribers rely on it.
+// truncated: the record outgrew the receive buffer, record is its start.
+template <ConnectionSink Sink>
+void processClientRecord(Client &client, string_view record, bool truncated,
+                         Sink &sink) {
+  if (truncated) {
+    // Too large for a frame, fatal as on the stream path
+    client.state = ClientState::CLOSING;
+    sink.onInvalid(client, record);
+    return;
+  }
+  if (client.state == ClientState::HANDSHAKE) {
+    codec::Handshake handshake;
+    if (codec::parseHandshake(record, handshake) != codec::ParseStatus::OK) {
+      client.state = ClientState::CLOSING;
+      sink.onInvalid(client, record);
+      return;
+    }
+    client.type = handshake.type;
+    client.state = ClientState::READY;
+    sink.onHandshake(client, handshake);
+    return;
+  }
+
+  if (client.state == ClientState::CLOSING)
+    return;
+  if (!record.ends_with('\n')) {
+    sink.onInvalid(client, record);
+    return;
+  }
+  processFrame(client, record, sink);
+}
+
+} // namespace pubsub
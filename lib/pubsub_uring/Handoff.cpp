@@ -0,0 +1,231 @@
+module;
+
+#include <cerrno>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+module pubsub_uring;
+
+import std;
+
+using namespace std;
+
+namespace pubsub::handoff {
+
+namespace {
+struct Header {
+  Kind kind;
+  uint32_t length;
+};
+
+void putU32(string &out, uint32_t value) {
+  out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+void putString(string &out, string_view text) {
+  putU32(out, static_cast<uint32_t>(text.size()));
+  out.append(text);
+}
+
+// Reads what putU32 and putString wrote; ok is cleared by the first read
+// past the end and stays cleared
+struct Reader {
+  string_view in;
+  bool ok = true;
+
+  uint32_t u32() {
+    uint32_t value = 0;
+    if (in.size() < sizeof(value)) {
+      ok = false;
+      return 0;
+    }
+    memcpy(&value, in.data(), sizeof(value));
+    in.remove_prefix(sizeof(value));
+    return value;
+  }
+
+  string str() {
+    const uint32_t size = u32();
+    if (!ok || in.size() < size) {
+      ok = false;
+      return {};
+    }
+    string text(in.substr(0, size));
+    in.remove_prefix(size);
+    return text;
+  }
+};
+
+void sendAll(int sock, string_view data) {
+  while (!data.empty()) {
+    ssize_t n = ::send(sock, data.data(), data.size(), MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      throw runtime_error(format("Handoff send failed: {}", strerror(errno)));
+    }
+    data.remove_prefix(static_cast<size_t>(n));
+  }
+}
+
+// false when the socket closed before size bytes arrived
+bool receiveAll(int sock, char *data, size_t size) {
+  while (size > 0) {
+    ssize_t n = ::recv(sock, data, size, MSG_WAITALL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      throw runtime_error(format("Handoff recv failed: {}", strerror(errno)));
+    }
+    if (n == 0)
+      return false;
+    data += n;
+    size -= static_cast<size_t>(n);
+  }
+  return true;
+}
+} // namespace
+
+string encodeListener(bool records, string_view path) {
+  string out;
+  putU32(out, records);
+  putString(out, path);
+  return out;
+}
+
+optional<pair<bool, string>> decodeListener(string_view payload) {
+  Reader in{payload};
+  const bool records = in.u32() != 0;
+  string path = in.str();
+  if (!in.ok)
+    return nullopt;
+  return pair{records, std::move(path)};
+}
+
+string encodeClient(const ClientState &state) {
+  string out;
+  putU32(out, to_underlying(state.type));
+  putU32(out, state.ready);
+  putU32(out, state.records);
+  putString(out, state.channels);
+  putU32(out, static_cast<uint32_t>(state.topics.size()));
+  for (const auto &topic : state.topics) {
+    putString(out, topic);
+  }
+  putU32(out, static_cast<uint32_t>(state.sessions.size()));
+  for (const auto &[session, channels] : state.sessions) {
+    putU32(out, session);
+    putString(out, channels);
+  }
+  putString(out, state.recvBuffer);
+  putU32(out, static_cast<uint32_t>(state.sendQueue.size()));
+  for (const auto &frame : state.sendQueue) {
+    putString(out, frame);
+  }
+  return out;
+}
+
+optional<ClientState> decodeClient(string_view payload) {
+  Reader in{payload};
+  ClientState state;
+  const uint32_t type = in.u32();
+  if (type > static_cast<uint32_t>(to_underlying(ClientType::REPLICA)))
+    return nullopt;
+  state.type = static_cast<ClientType>(type);
+  state.ready = in.u32() != 0;
+  state.records = in.u32() != 0;
+  state.channels = in.str();
+  // A corrupt count stops at the first read past the end
+  for (uint32_t n = in.u32(); in.ok && n > 0; --n) {
+    state.topics.push_back(in.str());
+  }
+  for (uint32_t n = in.u32(); in.ok && n > 0; --n) {
+    const uint32_t session = in.u32();
+    state.sessions.emplace_back(session, in.str());
+  }
+  state.recvBuffer = in.str();
+  for (uint32_t n = in.u32(); in.ok && n > 0; --n) {
+    state.sendQueue.push_back(in.str());
+  }
+  if (!in.ok || !in.in.empty())
+    return nullopt;
+  return state;
+}
+
+void sendRecord(int sock, Kind kind, int fd, string_view payload) {
+  Header header{kind, static_cast<uint32_t>(payload.size())};
+  iovec iov{&header, sizeof(header)};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  // The fd rides on the header, so it arrives with the first byte of its
+  // record
+  alignas(cmsghdr) array<char, CMSG_SPACE(sizeof(int))> control{};
+  if (fd >= 0) {
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+
+  ssize_t n;
+  do {
+    n = ::sendmsg(sock, &msg, MSG_NOSIGNAL);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) {
+    throw runtime_error(format("Handoff send failed: {}", strerror(errno)));
+  }
+  // The kernel takes the fd with the first byte, the rest is plain data
+  sendAll(sock, string_view(reinterpret_cast<const char *>(&header),
+                            sizeof(header))
+                    .substr(static_cast<size_t>(n)));
+  sendAll(sock, payload);
+}
+
+optional<Record> receiveRecord(int sock) {
+  Header header{};
+  iovec iov{&header, sizeof(header)};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  alignas(cmsghdr) array<char, CMSG_SPACE(sizeof(int))> control{};
+  msg.msg_control = control.data();
+  msg.msg_controllen = control.size();
+
+  ssize_t n;
+  do {
+    n = ::recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) {
+    throw runtime_error(format("Handoff recv failed: {}", strerror(errno)));
+  }
+  if (n == 0)
+    return nullopt;
+
+  Record record{header.kind, -1, {}};
+  for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      memcpy(&record.fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+  }
+
+  auto *rest = reinterpret_cast<char *>(&header) + n;
+  if (!receiveAll(sock, rest, sizeof(header) - static_cast<size_t>(n))) {
+    throw runtime_error("Handoff ended inside a record");
+  }
+  record.kind = header.kind;
+  record.payload.resize(header.length);
+  if (!receiveAll(sock, record.payload.data(), header.length)) {
+    throw runtime_error("Handoff ended inside a record");
+  }
+  return record;
+}
+
+} // namespace pubsub::handoff
@@ -0,0 +1,59 @@
+export module pubsub_uring:Handoff;
+
+import std;
+import :Protocol;
+
+using namespace std;
+
+export namespace pubsub {
+
+// Hot restart. A broker hands its sockets to its successor over a Unix
+// stream socket, one record per listener or client and a DONE record last.
+// Each record is a fixed header, carrying the record's fd as SCM_RIGHTS,
+// followed by its payload. Both ends are the same binary on the same host,
+// so integers go in native byte order.
+namespace handoff {
+
+enum class Kind : uint32_t { LISTENER, CLIENT, DONE };
+
+// What the successor needs to carry a connection on unnoticed
+struct ClientState {
+  ClientType type = ClientType::UNKNOWN;
+  bool ready = false;
+  // SOCK_SEQPACKET
+  bool records = false;
+  // Publisher: its channel. Subscriber: channels and patterns, as in a
+  // handshake.
+  string channels;
+  // Topic publisher: its topic names, in handshake order
+  vector<string> topics;
+  // MUX: session id and its channel list
+  vector<pair<uint32_t, string>> sessions;
+  // An incomplete frame
+  string recvBuffer;
+  // Frames not sent yet; the first may have been sent in part
+  vector<string> sendQueue;
+};
+
+struct Record {
+  Kind kind;
+  // -1 when none came with the record
+  int fd;
+  string payload;
+};
+
+string encodeListener(bool records, string_view path);
+// The path is empty for TCP
+optional<pair<bool, string>> decodeListener(string_view payload);
+
+string encodeClient(const ClientState &state);
+optional<ClientState> decodeClient(string_view payload);
+
+// Blocking. Throws runtime_error when the socket fails.
+void sendRecord(int sock, Kind kind, int fd, string_view payload);
+// nullopt once the other end has closed the socket
+optional<Record> receiveRecord(int sock);
+
+} // namespace handoff
+
+} // namespace pubsub
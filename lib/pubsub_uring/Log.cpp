@@ -0,0 +1,113 @@
+module;
+
+#include <cerrno>
+#include <csignal>
+
+#include <pthread.h>
+#include <unistd.h>
+
+module pubsub_uring;
+
+import std;
+
+using namespace std;
+
+namespace pubsub {
+
+namespace {
+void writeAll(int fd, string_view data) {
+  while (!data.empty()) {
+    auto n = ::write(fd, data.data(), data.size());
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return;
+    data.remove_prefix(n);
+  }
+}
+} // namespace
+
+Logger::Logger(span<const LogFormat> formatTable, size_t capacity)
+    : formats(formatTable), records(bit_ceil(max<size_t>(capacity, 2))),
+      mask(records.size() - 1) {
+  // The writer thread must not take SIGINT away from the event loop. It
+  // inherits the mask it is started with.
+  sigset_t all, previous;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &previous);
+  worker = jthread([this](stop_token stop) { drain(stop); });
+  pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+}
+
+Logger::~Logger() {
+  worker.request_stop();
+  if (worker.joinable()) {
+    worker.join();
+  }
+  if (uint64_t n = dropped()) {
+    writeAll(STDERR_FILENO,
+             format("\033[31m[LOG] {} records dropped, ring was full\033[0m\n",
+                    n));
+  }
+}
+
+void Logger::render(const Record &record, const LogFormat &format,
+                    string &out) {
+  array<string, MAX_ARGS> parts;
+  for (size_t i = 0; i < record.argc; ++i) {
+    const auto arg = record.args[i];
+    if (record.stringMask & (1u << i)) {
+      const auto offset = static_cast<uint64_t>(arg) >> 32;
+      const auto length = static_cast<uint64_t>(arg) & 0xffffffff;
+      parts[i].assign(record.text.data() + offset, length);
+    } else {
+      parts[i] = to_string(arg);
+    }
+  }
+
+  try {
+    vformat_to(back_inserter(out), format.pattern,
+               make_format_args(parts[0], parts[1], parts[2], parts[3]));
+  } catch (const format_error &) {
+    out += format.pattern;
+  }
+  out += '\n';
+}
+
+void Logger::drain(stop_token stop) {
+  string out, err;
+
+  while (true) {
+    // Sampled before draining so records logged up to the stop request
+    // still make it out
+    const bool stopping = stop.stop_requested();
+
+    uint64_t tail = Tail.load(memory_order_relaxed);
+    const uint64_t head = Head.load(memory_order_acquire);
+    for (; tail != head; ++tail) {
+      const auto &record = records[tail & mask];
+      if (record.id < formats.size()) {
+        const auto &format = formats[record.id];
+        render(record, format, format.toStderr ? err : out);
+      }
+    }
+    Tail.store(tail, memory_order_release);
+
+    if (!out.empty()) {
+      writeAll(STDOUT_FILENO, out);
+      out.clear();
+    }
+    if (!err.empty()) {
+      writeAll(STDERR_FILENO, err);
+      err.clear();
+    }
+
+    if (stopping)
+      break;
+    if (Head.load(memory_order_acquire) == tail) {
+      this_thread::sleep_for(chrono::milliseconds(1));
+    }
+  }
+}
+
+} // namespace pubsub
@@ -0,0 +1,104 @@
+export module pubsub_uring:Log;
+
+import std;
+
+using namespace std;
+
+export namespace pubsub {
+
+// One entry of an application's format table. Arguments are rendered as if
+// by "{}", so patterns should not use format specs.
+struct LogFormat {
+  string_view pattern;
+  bool toStderr = false;
+};
+
+// Keeps formatting and terminal I/O off the event loop. log() copies a
+// format id and its arguments into a preallocated single-producer ring and
+// returns; a background thread formats the records and writes them out. A
+// full ring drops the record instead of blocking the caller.
+class Logger {
+public:
+  static constexpr size_t MAX_ARGS = 4;
+  // Inline bytes for string arguments; longer strings are truncated
+  static constexpr size_t TEXT_SIZE = 88;
+
+  explicit Logger(span<const LogFormat> formats, size_t capacity = 4096);
+  ~Logger();
+
+  Logger(const Logger &) = delete;
+  Logger &operator=(const Logger &) = delete;
+
+  // Integers and anything convertible to string_view. Only ever called from
+  // one thread.
+  template <typename Id, typename... Args>
+    requires is_enum_v<Id>
+  void log(Id id, const Args &...args) {
+    static_assert(sizeof...(Args) <= MAX_ARGS);
+
+    const uint64_t head = Head.load(memory_order_relaxed);
+    if (head - cachedTail >= records.size()) {
+      cachedTail = Tail.load(memory_order_acquire);
+      if (head - cachedTail >= records.size()) {
+        Dropped.store(Dropped.load(memory_order_relaxed) + 1,
+                      memory_order_relaxed);
+        return;
+      }
+    }
+
+    auto &record = records[head & mask];
+    record.id = static_cast<uint16_t>(id);
+    record.argc = 0;
+    record.stringMask = 0;
+    record.textLen = 0;
+    (record.push(args), ...);
+    Head.store(head + 1, memory_order_release);
+  }
+
+  uint64_t dropped() const { return Dropped.load(memory_order_relaxed); }
+
+private:
+  struct alignas(64) Record {
+    uint16_t id;
+    uint8_t argc;
+    uint8_t stringMask;
+    uint32_t textLen;
+    // Integer value, or (offset << 32 | length) into text for strings
+    array<int64_t, MAX_ARGS> args;
+    array<char, TEXT_SIZE> text;
+
+    template <typename T> void push(const T &value) {
+      if constexpr (is_integral_v<T> || is_enum_v<T>) {
+        args[argc++] = static_cast<int64_t>(value);
+      } else {
+        const string_view str = value;
+        const size_t n = min(str.size(), TEXT_SIZE - textLen);
+        memcpy(text.data() + textLen, str.data(), n);
+        args[argc] = static_cast<int64_t>(uint64_t{textLen} << 32 | n);
+        stringMask |= 1u << argc;
+        ++argc;
+        textLen += static_cast<uint32_t>(n);
+      }
+    }
+  };
+
+  void drain(stop_token stop);
+  static void render(const Record &record, const LogFormat &format,
+                     string &out);
+
+  span<const LogFormat> formats;
+  vector<Record> records;
+  size_t mask;
+
+  // Producer side
+  alignas(64) atomic<uint64_t> Head{0};
+  uint64_t cachedTail = 0;
+  atomic<uint64_t> Dropped{0};
+
+  // Consumer side
+  alignas(64) atomic<uint64_t> Tail{0};
+
+  jthread worker;
+};
+
+} // namespace pubsub
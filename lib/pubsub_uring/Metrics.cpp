@@ -0,0 +1,248 @@
+module;
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+module pubsub_uring;
+
+import std;
+
+using namespace std;
+
+namespace pubsub {
+
+namespace {
+struct CounterFamily {
+  string_view name;
+  string_view help;
+};
+
+constexpr array<CounterFamily, 5> CHANNEL_FAMILIES{{
+    {"pubsub_channel_messages_in_total", "Messages received from publishers"},
+    {"pubsub_channel_bytes_in_total", "Payload bytes from publishers"},
+    {"pubsub_channel_messages_out_total", "Messages queued to subscribers"},
+    {"pubsub_channel_bytes_out_total", "Bytes queued to subscribers"},
+    {"pubsub_channel_drops_total", "Messages dropped on a full send queue"},
+}};
+
+constexpr array<CounterFamily, 6> CLIENT_FAMILIES{{
+    {"pubsub_client_messages_in_total", "Messages received from the client"},
+    {"pubsub_client_bytes_in_total", "Payload bytes from the client"},
+    {"pubsub_client_messages_out_total", "Messages sent to the client"},
+    {"pubsub_client_bytes_out_total", "Bytes sent to the client"},
+    {"pubsub_client_drops_total", "Messages dropped on a full send queue"},
+    {"pubsub_client_send_queue_high_water", "Deepest send queue seen"},
+}};
+
+array<uint64_t, 5> loadChannel(const ChannelMetrics &m) {
+  return {m.messagesIn.load(), m.bytesIn.load(), m.messagesOut.load(),
+          m.bytesOut.load(), m.drops.load()};
+}
+
+array<uint64_t, 6> loadClient(const ClientMetrics &m) {
+  return {m.messagesIn.load(),  m.bytesIn.load(), m.messagesOut.load(),
+          m.bytesOut.load(),    m.drops.load(),   m.queueHighWater.load()};
+}
+
+void writeHeader(string &out, string_view name, string_view type,
+                 string_view help) {
+  format_to(back_inserter(out), "# HELP {} {}\n# TYPE {} {}\n", name, help,
+            name, type);
+}
+} // namespace
+
+BrokerMetrics::BrokerMetrics(LabelFn clientLabel)
+    : label(clientLabel), topicSlots(MAX_TOPIC_SLOTS) {
+  freeSlots.reserve(MAX_CLIENT_SLOTS);
+  for (uint32_t i = MAX_CLIENT_SLOTS; i-- > 0;) {
+    freeSlots.push_back(i);
+  }
+}
+
+ClientMetrics *BrokerMetrics::attach(uint64_t key) {
+  if (freeSlots.empty()) {
+    overflow.tag.store(1, memory_order_release);
+    return &overflow;
+  }
+  auto &slot = clientSlots[freeSlots.back()];
+  freeSlots.pop_back();
+  slot.reset();
+  slot.tag.store(key + 1, memory_order_release);
+  return &slot;
+}
+
+void BrokerMetrics::detach(ClientMetrics *slot) {
+  if (!slot || slot == &overflow)
+    return;
+  slot->tag.store(0, memory_order_release);
+  freeSlots.push_back(static_cast<uint32_t>(slot - clientSlots.data()));
+}
+
+void BrokerMetrics::nameTopic(channel_t id, string_view name) {
+  const size_t slot = id - protocol::CHANNEL_COUNT;
+  if (id < protocol::CHANNEL_COUNT || slot >= topicSlots.size())
+    return;
+  auto &row = topicSlots[slot];
+  const size_t n = min(name.size(), row.name.size());
+  memcpy(row.name.data(), name.data(), n);
+  row.nameLength.store(static_cast<uint32_t>(n), memory_order_release);
+}
+
+string BrokerMetrics::render(string_view transport) const {
+  string out;
+  auto emit = back_inserter(out);
+
+  // Only channels that saw traffic, 256 mostly-zero series help nobody.
+  // Topics are labelled with their name.
+  vector<pair<string, array<uint64_t, 5>>> activeChannels;
+  auto addActive = [&](string name, const ChannelMetrics &metrics) {
+    auto values = loadChannel(metrics);
+    if (ranges::any_of(values, [](uint64_t v) { return v != 0; })) {
+      activeChannels.emplace_back(std::move(name), values);
+    }
+  };
+  for (size_t ch = 0; ch < channels.size(); ++ch) {
+    addActive(to_string(ch), channels[ch]);
+  }
+  for (const auto &slot : topicSlots) {
+    const uint32_t length = slot.nameLength.load(memory_order_acquire);
+    if (length == 0)
+      break; // Topic ids are handed out in order
+    addActive(string(slot.name.data(), length), slot.counters);
+  }
+  addActive("other_topics", otherTopics);
+  for (size_t f = 0; f < CHANNEL_FAMILIES.size(); ++f) {
+    writeHeader(out, CHANNEL_FAMILIES[f].name, "counter",
+                CHANNEL_FAMILIES[f].help);
+    for (const auto &[ch, values] : activeChannels) {
+      format_to(emit, "{}{{transport=\"{}\",channel=\"{}\"}} {}\n",
+                CHANNEL_FAMILIES[f].name, transport, ch, values[f]);
+    }
+  }
+
+  // A slot can be recycled while it is read; the tag is checked on both
+  // sides and a row that changed owner is skipped for this snapshot
+  vector<pair<string, array<uint64_t, 6>>> activeClients;
+  for (const auto &slot : clientSlots) {
+    const uint64_t tag = slot.tag.load(memory_order_acquire);
+    if (tag == 0)
+      continue;
+    auto values = loadClient(slot);
+    if (slot.tag.load(memory_order_acquire) == tag) {
+      activeClients.emplace_back(label(tag - 1), values);
+    }
+  }
+  if (overflow.tag.load(memory_order_acquire) != 0) {
+    activeClients.emplace_back("overflow", loadClient(overflow));
+  }
+  for (size_t f = 0; f < CLIENT_FAMILIES.size(); ++f) {
+    const bool gauge = f + 1 == CLIENT_FAMILIES.size();
+    writeHeader(out, CLIENT_FAMILIES[f].name, gauge ? "gauge" : "counter",
+                CLIENT_FAMILIES[f].help);
+    for (const auto &[client, values] : activeClients) {
+      format_to(emit, "{}{{transport=\"{}\",client=\"{}\"}} {}\n",
+                CLIENT_FAMILIES[f].name, transport, client, values[f]);
+    }
+  }
+
+  writeHeader(out, "pubsub_cqes_total", "counter",
+              "io_uring completions by operation");
+  for (size_t op = 0; op < OP_NAMES.size(); ++op) {
+    format_to(emit, "pubsub_cqes_total{{transport=\"{}\",op=\"{}\"}} {}\n",
+              transport, OP_NAMES[op], ring.cqes[op].load());
+  }
+
+  writeHeader(out, "pubsub_sqe_exhausted_total", "counter",
+              "Times the submission queue was full");
+  format_to(emit, "pubsub_sqe_exhausted_total{{transport=\"{}\"}} {}\n",
+            transport, ring.sqeExhausted.load());
+
+  writeHeader(out, "pubsub_clients", "gauge", "Connected clients");
+  format_to(emit, "pubsub_clients{{transport=\"{}\"}} {}\n", transport,
+            clients.load());
+
+  writeHeader(out, "pubsub_send_queue_high_water", "gauge",
+              "Deepest send queue seen on any client");
+  format_to(emit, "pubsub_send_queue_high_water{{transport=\"{}\"}} {}\n",
+            transport, queueHighWater.load());
+  return out;
+}
+
+StatsServer::StatsServer(string socketPath, function<string()> makeSnapshot)
+    : path(std::move(socketPath)), snapshot(std::move(makeSnapshot)),
+      Listen(-1) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+    throw runtime_error(format("Invalid stats socket path: {}", path));
+  }
+  memcpy(addr.sun_path, path.data(), path.size());
+
+  Listen = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (Listen < 0) {
+    throw runtime_error(
+        format("Stats socket creation failed: {}", strerror(errno)));
+  }
+
+  // A stale socket file from a previous run would make bind fail
+  ::unlink(path.c_str());
+  if (::bind(Listen, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+      ::listen(Listen, 16) < 0) {
+    const int err = errno;
+    ::close(Listen);
+    throw runtime_error(
+        format("Stats socket bind failed on {}: {}", path, strerror(err)));
+  }
+
+  // Signals belong to the event loop: a SIGINT taken by this thread would
+  // not interrupt the loop's blocking wait. The new thread inherits the
+  // blocked mask.
+  sigset_t all, previous;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &previous);
+  worker = jthread([this](stop_token stop) { serve(stop); });
+  pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+}
+
+StatsServer::~StatsServer() {
+  worker.request_stop();
+  if (worker.joinable()) {
+    worker.join();
+  }
+  ::close(Listen);
+  ::unlink(path.c_str());
+}
+
+void StatsServer::serve(stop_token stop) {
+  while (!stop.stop_requested()) {
+    // Wake up regularly to notice the stop request
+    pollfd pfd{Listen, POLLIN, 0};
+    if (::poll(&pfd, 1, 200) <= 0)
+      continue;
+
+    socket_t conn = ::accept4(Listen, nullptr, nullptr, SOCK_CLOEXEC);
+    if (conn < 0)
+      continue;
+
+    const string text = snapshot();
+    for (size_t sent = 0; sent < text.size();) {
+      auto n = ::send(conn, text.data() + sent, text.size() - sent,
+                      MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      sent += n;
+    }
+    ::close(conn);
+  }
+}
+
+} // namespace pubsub
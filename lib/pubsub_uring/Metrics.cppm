@@ -0,0 +1,140 @@
+export module pubsub_uring:Metrics;
+
+import std;
+import :Protocol;
+
+using namespace std;
+
+export namespace pubsub {
+
+// Written by exactly one thread (the event loop that owns it) and read by
+// any. The writer's load + store compiles to a plain add, no locked RMW, and
+// a reader never sees a torn value.
+class Counter {
+public:
+  void add(uint64_t n = 1) {
+    value.store(value.load(memory_order_relaxed) + n, memory_order_relaxed);
+  }
+
+  // High-water mark
+  void raise(uint64_t n) {
+    if (n > value.load(memory_order_relaxed))
+      value.store(n, memory_order_relaxed);
+  }
+
+  void set(uint64_t n) { value.store(n, memory_order_relaxed); }
+
+  uint64_t load() const { return value.load(memory_order_relaxed); }
+
+private:
+  atomic<uint64_t> value{0};
+};
+
+struct alignas(64) ChannelMetrics {
+  Counter messagesIn;
+  Counter bytesIn;
+  Counter messagesOut;
+  Counter bytesOut;
+  Counter drops;
+};
+
+struct alignas(64) ClientMetrics {
+  // 0 while the slot is free, otherwise the owner's key + 1
+  atomic<uint64_t> tag{0};
+  Counter messagesIn;
+  Counter bytesIn;
+  Counter messagesOut;
+  Counter bytesOut;
+  Counter drops;
+  Counter queueHighWater;
+
+  void reset() {
+    for (auto *c : {&messagesIn, &bytesIn, &messagesOut, &bytesOut, &drops,
+                    &queueHighWater}) {
+      c->set(0);
+    }
+  }
+};
+
+// Indexed by OpType
+constexpr array<string_view, 5> OP_NAMES{"accept", "recv", "send", "timeout",
+                                         "poll"};
+
+struct alignas(64) RingMetrics {
+  array<Counter, OP_NAMES.size()> cqes;
+  // Times getSqe() found the submission queue full and had to flush it
+  Counter sqeExhausted;
+};
+
+// Counters for one event-loop thread. Only that thread writes them; a stats
+// thread reads them through render() without any locking.
+class BrokerMetrics {
+public:
+  static constexpr size_t MAX_CLIENT_SLOTS = 1024;
+  static constexpr size_t MAX_TOPIC_SLOTS = 4096;
+
+  // Formats a client key for the client="..." label
+  using LabelFn = string (*)(uint64_t key);
+
+  explicit BrokerMetrics(LabelFn clientLabel);
+
+  array<ChannelMetrics, protocol::CHANNEL_COUNT> channels;
+  RingMetrics ring;
+  Counter clients;
+  Counter queueHighWater;
+
+  // Clients past MAX_CLIENT_SLOTS share one overflow slot. Owner thread only.
+  ClientMetrics *attach(uint64_t key);
+  void detach(ClientMetrics *slot);
+
+  // Numeric channel or topic id. Topics past MAX_TOPIC_SLOTS share one row.
+  ChannelMetrics &channel(channel_t id) {
+    if (id < protocol::CHANNEL_COUNT)
+      return channels[id];
+    const size_t slot = id - protocol::CHANNEL_COUNT;
+    return slot < topicSlots.size() ? topicSlots[slot].counters : otherTopics;
+  }
+
+  // Labels a newly interned topic's row. Owner thread only.
+  void nameTopic(channel_t id, string_view name);
+
+  // Prometheus text exposition format. Safe from any thread.
+  string render(string_view transport) const;
+
+private:
+  // The name is written once, before nameLength is published
+  struct TopicSlot {
+    ChannelMetrics counters;
+    atomic<uint32_t> nameLength{0};
+    array<char, protocol::MAX_TOPIC_SIZE> name;
+  };
+
+  LabelFn label;
+  vector<TopicSlot> topicSlots;
+  ChannelMetrics otherTopics;
+  array<ClientMetrics, MAX_CLIENT_SLOTS> clientSlots;
+  ClientMetrics overflow;
+  vector<uint32_t> freeSlots;
+};
+
+// Serves BrokerMetrics::render() snapshots on a Unix-domain stream socket
+// from a background thread: every connection gets one snapshot and is
+// closed, e.g. `socat - UNIX-CONNECT:/tmp/broker.stats`.
+class StatsServer {
+public:
+  StatsServer(string path, function<string()> snapshot);
+  ~StatsServer();
+
+  StatsServer(const StatsServer &) = delete;
+  StatsServer &operator=(const StatsServer &) = delete;
+
+private:
+  void serve(stop_token stop);
+
+  string path;
+  function<string()> snapshot;
+  socket_t Listen;
+  jthread worker;
+};
+
+} // namespace pubsub
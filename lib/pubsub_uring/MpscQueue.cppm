@@ -0,0 +1,76 @@
+export module pubsub_uring:MpscQueue;
+
+import std;
+
+using namespace std;
+
+export namespace pubsub {
+
+// Unbounded multi-producer single-consumer queue (Vyukov's intrusive
+// design). push() is one exchange and one store, wait-free and safe from any
+// thread; pop() only ever runs on the consumer. A producer preempted between
+// its exchange and its store hides the items after it until it resumes, so
+// pop() can return nullopt while the queue is not empty; the consumer just
+// tries again on its next wakeup.
+template <typename T> class MpscQueue {
+public:
+  MpscQueue() : head(&stub), tail(&stub) {}
+
+  ~MpscQueue() {
+    while (pop()) {
+    }
+  }
+
+  MpscQueue(const MpscQueue &) = delete;
+  MpscQueue &operator=(const MpscQueue &) = delete;
+
+  void push(T value) {
+    auto *node = new Node{{}, std::move(value)};
+    Node *prev = head.exchange(node, memory_order_acq_rel);
+    prev->next.store(node, memory_order_release);
+  }
+
+  optional<T> pop() {
+    Node *first = tail;
+    Node *next = first->next.load(memory_order_acquire);
+    if (first == &stub) {
+      if (!next)
+        return nullopt;
+      // Step over the stub
+      tail = next;
+      first = next;
+      next = next->next.load(memory_order_acquire);
+    }
+
+    if (!next) {
+      if (first != head.load(memory_order_acquire))
+        return nullopt; // A push is half done
+      // Put the stub back behind the last node so it can be taken
+      stub.next.store(nullptr, memory_order_relaxed);
+      Node *prev = head.exchange(&stub, memory_order_acq_rel);
+      prev->next.store(&stub, memory_order_release);
+      next = first->next.load(memory_order_acquire);
+      if (!next)
+        return nullopt;
+    }
+
+    tail = next;
+    optional<T> value(std::move(*first->value));
+    delete first;
+    return value;
+  }
+
+private:
+  struct Node {
+    atomic<Node *> next;
+    optional<T> value;
+  };
+
+  // Producers append here
+  alignas(64) atomic<Node *> head;
+  // Consumer only
+  alignas(64) Node *tail;
+  Node stub{};
+};
+
+} // namespace pubsub
@@ -0,0 +1,79 @@
+module;
+
+#include <cerrno>
+
+#include <liburing.h>
+
+module pubsub_uring;
+
+import std;
+
+using namespace std;
+
+namespace pubsub {
+
+namespace {
+struct TimerCompletion : Completion {
+  bool fired = false;
+
+  TimerCompletion() {
+    onComplete = [](Completion *self, int, uint32_t) {
+      static_cast<TimerCompletion *>(self)->fired = true;
+    };
+  }
+};
+} // namespace
+
+Pacer::Pacer(Uring &ring, double ticksPerSecond, PacerMode mode)
+    : ring(ring),
+      period(max<chrono::nanoseconds::rep>(
+          1, static_cast<chrono::nanoseconds::rep>(1e9 / ticksPerSecond))),
+      mode(mode), start(chrono::steady_clock::now()) {}
+
+uint64_t Pacer::wait() {
+  const auto deadline = start + period * ticks;
+  if (chrono::steady_clock::now() < deadline && !sleepUntil(deadline)) {
+    return 0;
+  }
+
+  // Every tick whose deadline has passed is due now
+  const auto elapsed = chrono::steady_clock::now() - start;
+  const auto reached = static_cast<uint64_t>(elapsed / period) + 1;
+  const uint64_t due = max<uint64_t>(reached - ticks, 1);
+  ticks += due;
+  return due;
+}
+
+bool Pacer::sleepUntil(chrono::steady_clock::time_point deadline) {
+  if (mode == PacerMode::SPIN) {
+    while (chrono::steady_clock::now() < deadline) {
+      if (int ret = ring.pollAndComplete(); ret < 0 && ret != -EINTR)
+        return false;
+    }
+    return true;
+  }
+
+  // steady_clock is CLOCK_MONOTONIC, the clock absolute timeouts use
+  const auto ns = chrono::duration_cast<chrono::nanoseconds>(
+                      deadline.time_since_epoch())
+                      .count();
+  __kernel_timespec ts{};
+  ts.tv_sec = ns / 1'000'000'000;
+  ts.tv_nsec = ns % 1'000'000'000;
+
+  TimerCompletion timer;
+  if (!ring.prepTimeout(&ts, &timer, true))
+    return false;
+
+  while (!timer.fired) {
+    if (int ret = ring.waitAndComplete(); ret < 0) {
+      if (ret != -EINTR)
+        return false;
+      // Interrupted by a signal: the timeout is still armed and points at
+      // this frame, so keep reaping until it fires
+    }
+  }
+  return true;
+}
+
+} // namespace pubsub
@@ -0,0 +1,49 @@
+export module pubsub_uring:Pacer;
+
+import std;
+import :Uring;
+
+using namespace std;
+
+export namespace pubsub {
+
+enum class PacerMode {
+  // Busy-polls the ring until the deadline: lowest jitter, burns a core
+  SPIN,
+  // Sleeps in the ring on an absolute timeout: cheap, ~50us jitter
+  TIMER,
+};
+
+// Open-loop schedule: tick k is due at start + k * interval no matter how
+// late earlier ticks ran, so falling behind shows up as extra due ticks
+// instead of silently stretching the period. Completions keep being
+// dispatched while waiting.
+class Pacer {
+public:
+  Pacer(Uring &ring, double ticksPerSecond, PacerMode mode);
+
+  // Blocks until the next tick is due and returns how many ticks are due
+  // (more than one when behind), or 0 if the ring reported an error.
+  uint64_t wait();
+
+  chrono::nanoseconds interval() const { return period; }
+
+  // Ticks handed out by wait() so far, counting from 0
+  uint64_t ticked() const { return ticks; }
+
+  // When tick was meant to happen
+  chrono::steady_clock::time_point deadline(uint64_t tick) const {
+    return start + period * tick;
+  }
+
+private:
+  bool sleepUntil(chrono::steady_clock::time_point deadline);
+
+  Uring &ring;
+  chrono::nanoseconds period;
+  PacerMode mode;
+  chrono::steady_clock::time_point start;
+  uint64_t ticks = 0;
+};
+
+} // namespace pubsub
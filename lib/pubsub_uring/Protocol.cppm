@@ -0,0 +1,80 @@
+export module pubsub_uring:Protocol;
+
+import std;
+
+using namespace std;
+
+export namespace pubsub {
+
+using socket_t = int;
+
+// Numeric channels 0-255 keep their ids; interned topics follow them
+using channel_t = uint32_t;
+
+namespace protocol {
+constexpr uint8_t MAX_CHANNELS = 255;
+constexpr uint8_t CHANNEL_BROADCAST = 0;
+constexpr size_t CHANNEL_COUNT = MAX_CHANNELS + 1;
+
+constexpr string_view HANDSHAKE_PUB = "[[PUB:";
+constexpr string_view HANDSHAKE_SUB = "[[SUB:";
+constexpr string_view HANDSHAKE_END = "]]";
+// A gateway connection carrying many logical subscribers ("sessions")
+constexpr string_view HANDSHAKE_MUX = "[[MUX]]";
+// Subscription changes on a live subscriber connection, same list syntax
+constexpr string_view CONTROL_SUB = "[[+SUB:";
+constexpr string_view CONTROL_UNSUB = "[[-SUB:";
+// [[+SES:id:list]] and [[-SES:id:list]] change one session of a MUX
+// connection, [[-SES:id]] closes it
+constexpr string_view CONTROL_SESSION_SUB = "[[+SES:";
+constexpr string_view CONTROL_SESSION_UNSUB = "[[-SES:";
+// Messages to a MUX connection start with the target sessions:
+// [S:1,5,9]message
+constexpr string_view SESSION_PREFIX = "[S:";
+// Federation. [[PEER:id]] links two brokers, either may send it first and
+// both do. Over the link each advertises the numeric channels it wants with
+// [[INT:hex]] and sends the other [F:origin:seq:channel]message for them.
+constexpr string_view HANDSHAKE_PEER = "[[PEER:";
+constexpr string_view INTEREST_PREFIX = "[[INT:";
+constexpr string_view FORWARD_PREFIX = "[F:";
+// Hot standby. A primary opens its link to the standby with [[REPL]], then
+// streams [[TOPIC:id:name]] for the topics it interns, session controls
+// keyed by its own subscriber ids and [CH:id]message for what it routes.
+constexpr string_view HANDSHAKE_REPLICA = "[[REPL]]";
+constexpr string_view TOPIC_RECORD = "[[TOPIC:";
+constexpr string_view SUB_ALL = "ALL";
+constexpr string_view MSG_PREFIX = "[CH:";
+constexpr string_view EXIT_MSG = "[[EXIT]]";
+
+// Topics are dot-separated names like "prices.eu.FX.EURUSD". In
+// subscriptions a "*" segment matches exactly one segment and a final ">"
+// matches one or more.
+constexpr char TOPIC_SEPARATOR = '.';
+constexpr string_view TOPIC_ANY = "*";
+constexpr string_view TOPIC_REST = ">";
+constexpr size_t MAX_TOPIC_SIZE = 128;
+
+constexpr size_t BUFFER_SIZE = 4096;
+constexpr size_t MAX_SEND_QUEUE = 256;
+constexpr size_t MAX_HANDSHAKE_SIZE = 1024;
+// Per MUX connection
+constexpr size_t MAX_SESSIONS = 4096;
+// The primary's channel ids can be longer than its publishers' were
+constexpr size_t MAX_REPLICA_FRAME = 2 * BUFFER_SIZE;
+constexpr size_t MAX_UDP_PAYLOAD = 2048;
+} // namespace protocol
+
+enum class ClientType { UNKNOWN, PUBLISHER, SUBSCRIBER, MUX, PEER, REPLICA };
+
+using ChannelSet = bitset<protocol::CHANNEL_COUNT>;
+
+// Lowest channel in the set, broadcast when empty
+inline uint8_t firstChannel(const ChannelSet &channels) {
+  for (size_t ch = 0; ch < protocol::CHANNEL_COUNT; ++ch) {
+    if (channels.test(ch))
+      return static_cast<uint8_t>(ch);
+  }
+  return protocol::CHANNEL_BROADCAST;
+}
+
+} // namespace pubsub
@@ -0,0 +1,224 @@
+export module pubsub_uring:Router;
+
+import std;
+import :Protocol;
+import :Topics;
+
+using namespace std;
+
+export namespace pubsub {
+
+// A subscriber's side of the Router: where it sits in each channel's member
+// list, so unsubscribing is a swap-remove instead of a search. Lives in the
+// client and must not move while it has subscriptions.
+struct Subscriptions {
+  // Channel id -> index in that channel's member list
+  unordered_map<channel_t, uint32_t> slots;
+  // Pattern ids, see Router::subscribePattern
+  vector<uint32_t> patterns;
+  // Subscribed to the broadcast channel, i.e. to everything
+  bool broadcast = false;
+
+  bool contains(channel_t channel) const { return slots.contains(channel); }
+  bool hasPattern(uint32_t pattern) const {
+    return ranges::find(patterns, pattern) != patterns.end();
+  }
+};
+
+// Channel -> subscriber lists. Sub is whatever identifies a subscriber on the
+// transport (an fd for TCP, an address for UDP). Publishers never subscribe,
+// so a message is never delivered back to its sender.
+//
+// Topics get channel ids past the numeric channels. A pattern subscription
+// is resolved against the known topics when it is made, and every topic a
+// publisher registers later is resolved against the known patterns, so
+// route() never sees a wildcard.
+template <typename Sub> class Router {
+public:
+  Router() : channels(protocol::CHANNEL_COUNT) {}
+
+  bool subscribe(const Sub &sub, Subscriptions &owner, channel_t channel) {
+    auto [slot, added] = owner.slots.try_emplace(
+        channel, static_cast<uint32_t>(channels[channel].members.size()));
+    if (!added)
+      return false;
+
+    auto &ch = channels[channel];
+    ch.members.push_back(sub);
+    ch.owners.push_back(&owner);
+    changed(channel, owner, true);
+    return true;
+  }
+
+  bool unsubscribe(Subscriptions &owner, channel_t channel) {
+    auto slot = owner.slots.find(channel);
+    if (slot == owner.slots.end())
+      return false;
+
+    // Swap-remove, the moved member's back-index follows it
+    auto &ch = channels[channel];
+    const uint32_t index = slot->second;
+    ch.members[index] = ch.members.back();
+    ch.owners[index] = ch.owners.back();
+    ch.owners[index]->slots[channel] = index;
+    ch.members.pop_back();
+    ch.owners.pop_back();
+    owner.slots.erase(slot);
+    changed(channel, owner, false);
+    return true;
+  }
+
+  void unsubscribeAll(Subscriptions &owner) {
+    while (!owner.slots.empty()) {
+      unsubscribe(owner, owner.slots.begin()->first);
+    }
+    for (uint32_t pattern : owner.patterns) {
+      dropPatternSub(owner, pattern);
+    }
+    owner.patterns.clear();
+  }
+
+  // Interns a publisher's topic. When it is new, the subscribers of every
+  // matching pattern are subscribed to it and onSubscribe(sub, id) is called
+  // for each of them.
+  template <typename OnSubscribe>
+  channel_t registerTopic(string_view name, OnSubscribe &&onSubscribe) {
+    auto [id, added] = topics.intern(name);
+    if (!added)
+      return id;
+
+    channels.resize(topics.channelCount());
+    matched.clear();
+    topics.matchPatterns(id, matched);
+    for (uint32_t pattern : matched) {
+      for (const auto &[sub, owner] : patternSubs[pattern]) {
+        if (subscribe(sub, *owner, id)) {
+          onSubscribe(sub, id);
+        }
+      }
+    }
+    return id;
+  }
+
+  // Subscribes sub to every current and future topic matching pattern and
+  // calls onSubscribe(sub, id) for the current ones
+  template <typename OnSubscribe>
+  void subscribePattern(const Sub &sub, Subscriptions &owner,
+                        string_view pattern, OnSubscribe &&onSubscribe) {
+    const uint32_t id = topics.addPattern(pattern);
+    if (id >= patternSubs.size()) {
+      patternSubs.resize(id + 1);
+    }
+    if (owner.hasPattern(id))
+      return;
+    owner.patterns.push_back(id);
+    patternSubs[id].emplace_back(sub, &owner);
+
+    vector<channel_t> current;
+    topics.matchTopics(id, current);
+    for (channel_t channel : current) {
+      if (subscribe(sub, owner, channel)) {
+        onSubscribe(sub, channel);
+      }
+    }
+  }
+
+  // Drops a pattern and unsubscribes the topics that no other pattern of
+  // the owner still matches, calling onUnsubscribe(id) for each of them.
+  // Returns false when the owner had no such pattern.
+  template <typename OnUnsubscribe>
+  bool unsubscribePattern(Subscriptions &owner, string_view pattern,
+                          OnUnsubscribe &&onUnsubscribe) {
+    const auto id = topics.findPattern(pattern);
+    if (!id || !owner.hasPattern(*id))
+      return false;
+    erase(owner.patterns, *id);
+    dropPatternSub(owner, *id);
+
+    vector<channel_t> covered;
+    topics.matchTopics(*id, covered);
+    for (channel_t topic : covered) {
+      matched.clear();
+      topics.matchPatterns(topic, matched);
+      const bool stillMatched = ranges::any_of(
+          matched, [&](uint32_t other) { return owner.hasPattern(other); });
+      if (!stillMatched && unsubscribe(owner, topic)) {
+        onUnsubscribe(topic);
+      }
+    }
+    return true;
+  }
+
+  const TopicTable &topicTable() const { return topics; }
+
+  const vector<Sub> &subscribers(channel_t channel) const {
+    return channels[channel].members;
+  }
+
+  // Calls deliver(sub) once for every subscriber of channel or of the
+  // broadcast channel. Returns the number of deliveries.
+  template <typename Deliver>
+  size_t route(channel_t channel, Deliver &&deliver) {
+    const auto &subs = channel == protocol::CHANNEL_BROADCAST
+                           ? channels[channel].members
+                           : deliveryList(channel);
+    for (const auto &sub : subs) {
+      deliver(sub);
+    }
+    return subs.size();
+  }
+
+private:
+  using PatternSub = pair<Sub, Subscriptions *>;
+
+  struct Channel {
+    // Dense, in no particular order; owners[i] is the owner of members[i]
+    vector<Sub> members;
+    vector<Subscriptions *> owners;
+    // members plus the broadcast members, without duplicates. Rebuilt on
+    // the first message after either list changed.
+    vector<Sub> delivery;
+    uint64_t builtAt = 0;
+    bool dirty = true;
+  };
+
+  void dropPatternSub(const Subscriptions &owner, uint32_t pattern) {
+    erase_if(patternSubs[pattern],
+             [&](const PatternSub &entry) { return entry.second == &owner; });
+  }
+
+  void changed(channel_t channel, Subscriptions &owner, bool subscribed) {
+    channels[channel].dirty = true;
+    if (channel == protocol::CHANNEL_BROADCAST) {
+      owner.broadcast = subscribed;
+      ++broadcastVersion;
+    }
+  }
+
+  const vector<Sub> &deliveryList(channel_t channel) {
+    auto &ch = channels[channel];
+    if (!ch.dirty && ch.builtAt == broadcastVersion) [[likely]]
+      return ch.delivery;
+
+    const auto &broadcast = channels[protocol::CHANNEL_BROADCAST].members;
+    ch.delivery.assign(broadcast.begin(), broadcast.end());
+    for (size_t i = 0; i < ch.members.size(); ++i) {
+      if (!ch.owners[i]->broadcast) {
+        ch.delivery.push_back(ch.members[i]);
+      }
+    }
+    ch.builtAt = broadcastVersion;
+    ch.dirty = false;
+    return ch.delivery;
+  }
+
+  // Indexed by channel id, grows as topics are registered
+  vector<Channel> channels;
+  vector<vector<PatternSub>> patternSubs;
+  uint64_t broadcastVersion = 0;
+  TopicTable topics;
+  // Scratch for registerTopic and unsubscribePattern
+  vector<uint32_t> matched;
+};
+
+} // namespace pubsub
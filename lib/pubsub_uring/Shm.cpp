@@ -0,0 +1,370 @@
+module;
+
+#include <cerrno>
+#include <csignal>
+#include <climits>
+#include <cstring>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+module pubsub_uring;
+
+import std;
+
+using namespace std;
+
+namespace pubsub {
+
+namespace {
+using shm::Header;
+using shm::RecordHeader;
+using shm::RingHeader;
+
+constexpr uint32_t PAD = numeric_limits<uint32_t>::max();
+
+size_t segmentSize(uint32_t ringBytes) {
+  return sizeof(Header) + protocol::CHANNEL_COUNT * sizeof(RingHeader) +
+         protocol::CHANNEL_COUNT * size_t{ringBytes};
+}
+
+RingHeader &ringHeader(Header *header, channel_t channel) {
+  return reinterpret_cast<RingHeader *>(header + 1)[channel];
+}
+
+char *ringData(Header *header, channel_t channel) {
+  auto *rings = reinterpret_cast<char *>(&ringHeader(header, 0));
+  return rings + protocol::CHANNEL_COUNT * sizeof(RingHeader) +
+         channel * size_t{header->ringBytes};
+}
+
+uint64_t recordSize(size_t length) {
+  return (sizeof(RecordHeader) + length + 7) & ~uint64_t{7};
+}
+
+void *mapSegment(int fd, size_t bytes, int prot) {
+  void *addr = ::mmap(nullptr, bytes, prot, MAP_SHARED, fd, 0);
+  return addr == MAP_FAILED ? nullptr : addr;
+}
+
+bool processGone(int32_t pid) {
+  return pid > 0 && ::kill(pid, 0) < 0 && errno == ESRCH;
+}
+
+// A broker segment whose writer has died. Anything else under the name,
+// a half-created segment included, is left alone.
+bool staleSegment(const string &name) {
+  int fd = ::shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0)
+    return false;
+  struct stat st{};
+  const Header *header = nullptr;
+  if (::fstat(fd, &st) == 0 && st.st_size >= off_t{sizeof(Header)}) {
+    header = static_cast<const Header *>(
+        mapSegment(fd, sizeof(Header), PROT_READ));
+  }
+  ::close(fd);
+  if (!header)
+    return false;
+  const bool stale =
+      header->magic == shm::MAGIC && processGone(header->writerPid);
+  ::munmap(const_cast<Header *>(header), sizeof(Header));
+  return stale;
+}
+
+// Creates name, failing rather than truncating a segment in use
+int createSegment(const string &name) {
+  constexpr int flags = O_CREAT | O_EXCL | O_RDWR;
+  int fd = ::shm_open(name.c_str(), flags, 0600);
+  if (fd < 0 && errno == EEXIST && staleSegment(name)) {
+    println("\033[33mReplacing stale shared memory {}\033[0m", name);
+    ::shm_unlink(name.c_str());
+    fd = ::shm_open(name.c_str(), flags, 0600);
+  }
+  if (fd < 0 && errno == EEXIST) {
+    throw runtime_error(format("Shared memory {} already exists and belongs "
+                               "to a running broker or another program",
+                               name));
+  }
+  if (fd < 0) {
+    throw runtime_error(
+        format("shm_open {} failed: {}", name, strerror(errno)));
+  }
+  return fd;
+}
+} // namespace
+
+ShmWriter::ShmWriter(string segmentName, uint32_t ringBytes)
+    : name(std::move(segmentName)) {
+  if (!has_single_bit(ringBytes) || ringBytes < 4096) {
+    throw runtime_error("Shared memory ring size must be a power of two of "
+                        "at least 4096 bytes");
+  }
+
+  int fd = createSegment(name);
+  mappedBytes = segmentSize(ringBytes);
+  void *addr = nullptr;
+  if (::ftruncate(fd, static_cast<off_t>(mappedBytes)) == 0) {
+    addr = mapSegment(fd, mappedBytes, PROT_READ | PROT_WRITE);
+  }
+  const int err = errno;
+  ::close(fd);
+  if (!addr) {
+    ::shm_unlink(name.c_str());
+    throw runtime_error(
+        format("Failed to map shared memory {}: {}", name, strerror(err)));
+  }
+
+  // A fresh tmpfs file is zeroed, only the pages holding the headers are
+  // touched until someone reads a channel
+  header = new (addr) Header{};
+  header->ringBytes = ringBytes;
+  header->ringCount = protocol::CHANNEL_COUNT;
+  header->writerPid = ::getpid();
+  for (channel_t ch = 0; ch < protocol::CHANNEL_COUNT; ++ch) {
+    new (&ringHeader(header, ch)) RingHeader{};
+  }
+  atomic_thread_fence(memory_order_release);
+  header->magic = shm::MAGIC;
+}
+
+ShmWriter::~ShmWriter() {
+  header->closed.store(1);
+  written = true;
+  wake();
+  ::munmap(header, mappedBytes);
+  ::shm_unlink(name.c_str());
+}
+
+bool ShmWriter::write(channel_t channel, string_view message) {
+  if (channel >= header->ringCount)
+    return false;
+  if (!hasReaders(channel))
+    return false;
+  auto &ring = ringHeader(header, channel);
+
+  const uint32_t capacity = header->ringBytes;
+  const uint64_t size = recordSize(message.size());
+  if (size > capacity / 4)
+    return false;
+
+  char *data = ringData(header, channel);
+  uint64_t pos = ring.head.load(memory_order_relaxed);
+  const uint64_t offset = pos & (capacity - 1);
+  const uint64_t skip = offset + size > capacity ? capacity - offset : 0;
+
+  // Seqlock-style: readers check reserved after copying a record
+  ring.reserved.store(pos + skip + size, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  if (skip != 0) {
+    const RecordHeader pad{PAD, 0};
+    memcpy(data + offset, &pad, sizeof(pad));
+    pos += skip;
+  }
+  const RecordHeader record{static_cast<uint32_t>(message.size()), 0};
+  char *out = data + (pos & (capacity - 1));
+  memcpy(out, &record, sizeof(record));
+  memcpy(out + sizeof(record), message.data(), message.size());
+
+  ring.head.store(pos + size, memory_order_release);
+  written = true;
+  return true;
+}
+
+bool ShmWriter::hasReaders(channel_t channel) const {
+  refresh();
+  return channel < header->ringCount && watched.test(channel);
+}
+
+void ShmWriter::refresh() const {
+  // Read first: a slot changing during the scan bumps it again
+  const uint32_t epoch = header->readerEpoch.load(memory_order_acquire);
+  if (epoch == seenEpoch)
+    return;
+  seenEpoch = epoch;
+
+  watched.reset();
+  for (const auto &slot : header->readers) {
+    if (slot.pid.load(memory_order_acquire) == 0)
+      continue;
+    for (size_t word = 0; word < size(slot.channels); ++word) {
+      for (uint64_t bits = slot.channels[word].load(memory_order_relaxed);
+           bits != 0; bits &= bits - 1) {
+        watched.set(word * 64 + countr_zero(bits));
+      }
+    }
+  }
+}
+
+void ShmWriter::reap() {
+  for (auto &slot : header->readers) {
+    int32_t pid = slot.pid.load(memory_order_relaxed);
+    if (pid == 0 || !processGone(pid))
+      continue;
+    for (auto &word : slot.channels) {
+      word.store(0, memory_order_relaxed);
+    }
+    if (slot.pid.compare_exchange_strong(pid, 0)) {
+      header->readerEpoch.fetch_add(1);
+    }
+  }
+}
+
+void ShmWriter::wake() {
+  if (!written)
+    return;
+  written = false;
+
+  header->doorbell.fetch_add(1);
+  if (header->sleepers.load() != 0) {
+    ::syscall(SYS_futex, &header->doorbell, FUTEX_WAKE, INT_MAX, nullptr,
+              nullptr, 0);
+  }
+}
+
+ShmReader::ShmReader(const string &name, const ChannelSet &channels) {
+  int fd = ::shm_open(name.c_str(), O_RDWR, 0);
+  if (fd < 0) {
+    throw runtime_error(
+        format("shm_open {} failed: {}", name, strerror(errno)));
+  }
+
+  // The ring size is only known once the header is mapped
+  auto *probe = static_cast<Header *>(
+      mapSegment(fd, sizeof(Header), PROT_READ));
+  if (!probe || probe->magic != shm::MAGIC) {
+    if (probe) {
+      ::munmap(probe, sizeof(Header));
+    }
+    ::close(fd);
+    throw runtime_error(format("{} is not a broker segment", name));
+  }
+  mappedBytes = segmentSize(probe->ringBytes);
+  ::munmap(probe, sizeof(Header));
+
+  // Read-write only for the futex word and the reader slots
+  header = static_cast<Header *>(
+      mapSegment(fd, mappedBytes, PROT_READ | PROT_WRITE));
+  ::close(fd);
+  if (!header) {
+    throw runtime_error(
+        format("Failed to map shared memory {}: {}", name, strerror(errno)));
+  }
+
+  for (auto &candidate : header->readers) {
+    int32_t free = 0;
+    if (candidate.pid.compare_exchange_strong(free, ::getpid())) {
+      slot = &candidate;
+      break;
+    }
+  }
+  if (!slot) {
+    ::munmap(header, mappedBytes);
+    throw runtime_error(format("{} has no free reader slot", name));
+  }
+
+  const bool all = channels.test(protocol::CHANNEL_BROADCAST);
+  for (channel_t ch = 0; ch < header->ringCount; ++ch) {
+    if (all || channels.test(ch)) {
+      slot->channels[ch / 64].fetch_or(uint64_t{1} << (ch % 64),
+                                       memory_order_relaxed);
+    }
+  }
+  header->readerEpoch.fetch_add(1);
+
+  for (channel_t ch = 0; ch < header->ringCount; ++ch) {
+    if (all || channels.test(ch)) {
+      // Only messages written from now on
+      cursors.push_back(
+          {ch, ringHeader(header, ch).head.load(memory_order_acquire)});
+    }
+  }
+}
+
+ShmReader::~ShmReader() {
+  for (auto &word : slot->channels) {
+    word.store(0, memory_order_relaxed);
+  }
+  slot->pid.store(0, memory_order_release);
+  header->readerEpoch.fetch_add(1);
+  ::munmap(header, mappedBytes);
+}
+
+optional<string_view> ShmReader::next() {
+  const uint32_t capacity = header->ringBytes;
+
+  for (size_t visited = 0; visited < cursors.size();) {
+    auto &cursor = cursors[current];
+    auto &ring = ringHeader(header, cursor.channel);
+    const uint64_t head = ring.head.load(memory_order_acquire);
+    if (cursor.position == head) {
+      current = (current + 1) % cursors.size();
+      ++visited;
+      continue;
+    }
+
+    const char *data = ringData(header, cursor.channel);
+    const uint64_t offset = cursor.position & (capacity - 1);
+    RecordHeader record;
+    memcpy(&record, data + offset, sizeof(record));
+    const bool padding = record.length == PAD;
+    const bool fits =
+        !padding && offset + recordSize(record.length) <= capacity;
+    if (fits) {
+      scratch.assign(data + offset + sizeof(record), record.length);
+    }
+
+    // Anything read above is garbage if the writer has reached it since
+    atomic_thread_fence(memory_order_acquire);
+    if (ring.reserved.load(memory_order_relaxed) - cursor.position >
+        capacity) {
+      ++lapped;
+      cursor.position = ring.head.load(memory_order_acquire);
+      continue;
+    }
+
+    if (padding) {
+      cursor.position += capacity - offset;
+      continue;
+    }
+    if (!fits) {
+      // Only a lapped reader can see this, and that was ruled out above
+      ++lapped;
+      cursor.position = head;
+      continue;
+    }
+    cursor.position += recordSize(record.length);
+    return string_view(scratch);
+  }
+  return nullopt;
+}
+
+bool ShmReader::closed() const { return header->closed.load() != 0; }
+
+bool ShmReader::pending() const {
+  return ranges::any_of(cursors, [this](const Cursor &cursor) {
+    return ringHeader(header, cursor.channel)
+               .head.load(memory_order_acquire) != cursor.position;
+  });
+}
+
+void ShmReader::wait(chrono::milliseconds timeout) {
+  // Dekker with the writer: either it sees a sleeper and wakes us, or we
+  // see its doorbell change and do not sleep
+  header->sleepers.fetch_add(1);
+  const uint32_t seen = header->doorbell.load();
+  if (!pending() && !closed()) {
+    const auto secs = chrono::duration_cast<chrono::seconds>(timeout);
+    const timespec ts{secs.count(), (timeout - secs).count() * 1'000'000};
+    ::syscall(SYS_futex, &header->doorbell, FUTEX_WAIT, seen, &ts, nullptr,
+              0);
+  }
+  header->sleepers.fetch_sub(1);
+}
+
+} // namespace pubsub
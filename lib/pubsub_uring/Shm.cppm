@@ -0,0 +1,150 @@
+export module pubsub_uring:Shm;
+
+import std;
+import :Protocol;
+
+using namespace std;
+
+export namespace pubsub {
+
+// Same-host transport. The broker writes every message on a numeric channel
+// once into that channel's ring in a shared mapping, and local subscribers
+// read the rings in place: fan-out to N readers costs one copy, not N sends.
+// Readers never write to a ring; each keeps its own cursor and notices when
+// the writer has lapped it.
+namespace shm {
+
+constexpr uint64_t MAGIC = 0x7075627375627368; // "pubsubsh"
+constexpr uint32_t DEFAULT_RING_BYTES = 1 << 20;
+// Readers attached to one segment at a time
+constexpr uint32_t MAX_READERS = 256;
+
+// Records are 8-byte aligned and never wrap; the tail of the ring is skipped
+// with a PAD record instead
+struct RecordHeader {
+  uint32_t length;
+  uint32_t pad;
+};
+
+// An attached reader: its pid, 0 while the slot is free, and the channels it
+// reads, one bit each. The broker frees the slot of a reader that died
+// without detaching, so readers must share its pid namespace.
+struct ReaderSlot {
+  atomic<int32_t> pid;
+  atomic<uint64_t> channels[protocol::CHANNEL_COUNT / 64];
+};
+
+struct alignas(64) Header {
+  uint64_t magic;
+  uint32_t ringBytes;
+  uint32_t ringCount;
+  // The broker that created the segment, so a successor can tell a stale
+  // one from a live one
+  int32_t writerPid;
+  // Futex word, bumped once per batch of writes
+  alignas(64) atomic<uint32_t> doorbell;
+  atomic<uint32_t> sleepers;
+  // Set when the broker shuts down
+  atomic<uint32_t> closed;
+  // Bumped whenever a reader slot changes
+  atomic<uint32_t> readerEpoch;
+  alignas(64) ReaderSlot readers[MAX_READERS];
+};
+
+struct alignas(64) RingHeader {
+  // End of the last complete record
+  atomic<uint64_t> head;
+  // End of the record being written; data before reserved - ringBytes is
+  // being overwritten
+  atomic<uint64_t> reserved;
+};
+
+static_assert(atomic<uint64_t>::is_always_lock_free);
+static_assert(atomic<uint32_t>::is_always_lock_free);
+static_assert(atomic<int32_t>::is_always_lock_free);
+
+} // namespace shm
+
+// The broker's side. One writer per segment, not thread-safe.
+class ShmWriter {
+public:
+  // name as for shm_open, e.g. "/pubsub". ringBytes must be a power of two.
+  // Throws if a running broker already owns name; a segment left behind by
+  // one that died is replaced.
+  ShmWriter(string segmentName,
+            uint32_t ringBytes = shm::DEFAULT_RING_BYTES);
+  ~ShmWriter();
+
+  ShmWriter(const ShmWriter &) = delete;
+  ShmWriter &operator=(const ShmWriter &) = delete;
+
+  // false when nobody reads the channel or the message does not fit.
+  // Records are only written while someone reads the channel.
+  bool write(channel_t channel, string_view message);
+
+  // Some reader is attached to the channel's ring
+  bool hasReaders(channel_t channel) const;
+
+  // Frees the slots of readers that died without detaching; until then
+  // their channels are still written. Call now and then.
+  void reap();
+
+  // Wakes sleeping readers if anything was written since the last call
+  void wake();
+
+private:
+  // Rebuilds watched if a reader slot changed since the last look
+  void refresh() const;
+
+  string name;
+  shm::Header *header = nullptr;
+  size_t mappedBytes = 0;
+  bool written = false;
+  // Channels some reader slot holds, as of seenEpoch
+  mutable ChannelSet watched;
+  mutable uint32_t seenEpoch = 0;
+};
+
+// A local subscriber's side
+class ShmReader {
+public:
+  // Attaches to the rings of channels, or to every ring when the set holds
+  // the broadcast channel
+  ShmReader(const string &name, const ChannelSet &channels);
+  ~ShmReader();
+
+  ShmReader(const ShmReader &) = delete;
+  ShmReader &operator=(const ShmReader &) = delete;
+
+  // The next message on any attached ring, valid until the following call,
+  // or nullopt once they are all drained
+  optional<string_view> next();
+
+  // Sleeps until the broker writes or timeout passes. Returns at once if
+  // there is something to read.
+  void wait(chrono::milliseconds timeout);
+
+  // Times the writer lapped this reader; the lapped records are lost
+  uint64_t overruns() const { return lapped; }
+
+  // The broker has gone away
+  bool closed() const;
+
+private:
+  struct Cursor {
+    channel_t channel;
+    uint64_t position;
+  };
+
+  bool pending() const;
+
+  shm::Header *header = nullptr;
+  size_t mappedBytes = 0;
+  shm::ReaderSlot *slot = nullptr;
+  vector<Cursor> cursors;
+  size_t current = 0;
+  string scratch;
+  uint64_t lapped = 0;
+};
+
+} // namespace pubsub
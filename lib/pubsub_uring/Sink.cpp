@@ -0,0 +1,89 @@
+module pubsub_uring;
+
+import std;
+import Histogram;
+
+using namespace std;
+
+namespace pubsub {
+
+void MessageSink::onFrame(string_view frame, uint64_t recvNs,
+                          uint32_t stream) {
+  ++interval.messages;
+  interval.bytes += frame.size();
+
+  string_view payload = frame;
+  if (payload.starts_with(protocol::SESSION_PREFIX)) {
+    const size_t end = payload.find(']');
+    if (end == string_view::npos)
+      return;
+    payload.remove_prefix(end + 1);
+  }
+  if (payload.ends_with('\n')) {
+    payload.remove_suffix(1);
+  }
+  auto stamp = codec::parseStamp(payload);
+  if (!stamp)
+    return;
+
+  ++interval.stamped;
+  const uint64_t latency =
+      recvNs > stamp->intendedNs ? recvNs - stamp->intendedNs : 0;
+  intervalLatency.record(latency);
+
+  auto [it, inserted] = nextSeq.try_emplace(
+      uint64_t{stream} << 32 | stamp->publisher, stamp->seq);
+  if (stamp->seq > it->second) {
+    interval.gaps += stamp->seq - it->second;
+  } else if (stamp->seq < it->second) {
+    ++interval.reordered;
+    return;
+  }
+  it->second = stamp->seq + 1;
+}
+
+void MessageSink::report() {
+  const auto now = chrono::steady_clock::now();
+  const double secs = chrono::duration<double>(now - intervalStart).count();
+
+  if (interval.stamped > 0) {
+    println("\033[34m[STATS] {:.0f} msg/s, {:.2f} MB/s, gaps {}, reordered "
+            "{}, latency us p50 {:.1f} p99 {:.1f} max {:.1f}\033[0m",
+            interval.messages / secs, interval.bytes / secs / 1e6,
+            interval.gaps, interval.reordered,
+            intervalLatency.percentile(50) / 1e3,
+            intervalLatency.percentile(99) / 1e3, intervalLatency.max() / 1e3);
+  } else {
+    println("\033[34m[STATS] {:.0f} msg/s, {:.2f} MB/s\033[0m",
+            interval.messages / secs, interval.bytes / secs / 1e6);
+  }
+
+  total.messages += interval.messages;
+  total.bytes += interval.bytes;
+  total.stamped += interval.stamped;
+  total.gaps += interval.gaps;
+  total.reordered += interval.reordered;
+  totalLatency.merge(intervalLatency);
+
+  interval = {};
+  intervalLatency.reset();
+  intervalStart = now;
+}
+
+void MessageSink::printTotals() const {
+  const uint64_t messages = total.messages + interval.messages;
+  const uint64_t bytes = total.bytes + interval.bytes;
+  println("\nReceived {} messages ({} bytes), gaps {}, reordered {}", messages,
+          bytes, total.gaps + interval.gaps,
+          total.reordered + interval.reordered);
+
+  misc::Histogram latency = totalLatency;
+  latency.merge(intervalLatency);
+  if (latency.count() > 0) {
+    println("Latency us: p50 {:.1f} p99 {:.1f} p99.9 {:.1f} max {:.1f}",
+            latency.percentile(50) / 1e3, latency.percentile(99) / 1e3,
+            latency.percentile(99.9) / 1e3, latency.max() / 1e3);
+  }
+}
+
+} // namespace pubsub
@@ -0,0 +1,44 @@
+export module pubsub_uring:Sink;
+
+import std;
+import Histogram;
+import :Codec;
+
+using namespace std;
+
+export namespace pubsub {
+
+// Consumes received frames without printing them. Counts messages and bytes;
+// for stamped payloads it also tracks one-way latency and per-publisher
+// sequence gaps.
+class MessageSink {
+public:
+  // frame is one delivered payload: the broker has already stripped its
+  // [CH:N] prefix. A trailing newline and a MUX [S:...] header are skipped.
+  // Sequence gaps are tracked per (stream, publisher) so several connections
+  // receiving the same publisher can share one sink.
+  void onFrame(string_view frame, uint64_t recvNs, uint32_t stream = 0);
+
+  // Prints the rates since the previous report and starts a new interval
+  void report();
+
+  void printTotals() const;
+
+private:
+  struct Counters {
+    uint64_t messages = 0;
+    uint64_t bytes = 0;
+    uint64_t stamped = 0;
+    uint64_t gaps = 0;
+    uint64_t reordered = 0;
+  };
+
+  Counters total;
+  Counters interval;
+  misc::Histogram intervalLatency;
+  misc::Histogram totalLatency;
+  unordered_map<uint64_t, uint64_t> nextSeq;
+  chrono::steady_clock::time_point intervalStart = chrono::steady_clock::now();
+};
+
+} // namespace pubsub
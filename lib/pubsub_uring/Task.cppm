@@ -0,0 +1,34 @@
+export module pubsub_uring:Task;
+
+import std;
+
+using namespace std;
+
+export namespace pubsub {
+
+// Detached coroutine: starts running immediately and frees its own frame
+// when it returns. Whatever it co_awaits must keep the objects it touches
+// alive, the caller gets no handle back.
+class Task {
+public:
+  struct promise_type {
+    Task get_return_object() noexcept { return {}; }
+    suspend_never initial_suspend() noexcept { return {}; }
+    suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+
+    void unhandled_exception() noexcept {
+      try {
+        rethrow_exception(current_exception());
+      } catch (const exception &e) {
+        println(stderr, "\033[31mUnhandled exception in task: {}\033[0m",
+                e.what());
+      } catch (...) {
+        println(stderr, "\033[31mUnhandled exception in task\033[0m");
+      }
+      terminate();
+    }
+  };
+};
+
+} // namespace pubsub
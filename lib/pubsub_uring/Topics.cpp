@@ -0,0 +1,152 @@
+module pubsub_uring;
+
+import std;
+
+using namespace std;
+
+namespace pubsub {
+
+namespace {
+vector<string_view> splitSegments(string_view path) {
+  vector<string_view> segments;
+  for (auto segment : views::split(path, protocol::TOPIC_SEPARATOR)) {
+    segments.emplace_back(segment.begin(), segment.end());
+  }
+  return segments;
+}
+} // namespace
+
+TopicTable::TopicTable() : nodes(1) {}
+
+uint32_t TopicTable::insert(string_view path) {
+  uint32_t node = 0;
+  for (auto segment : splitSegments(path)) {
+    auto &children = nodes[node].children;
+    auto it = children.find(segment);
+    if (it == children.end()) {
+      const auto child = static_cast<uint32_t>(nodes.size());
+      // May reallocate nodes, children is not used past this point
+      children.emplace(string(segment), child);
+      nodes.emplace_back();
+      node = child;
+    } else {
+      node = it->second;
+    }
+  }
+  return node;
+}
+
+TopicTable::Interned TopicTable::intern(string_view name) {
+  const uint32_t node = insert(name);
+  if (nodes[node].topic != NONE)
+    return {nodes[node].topic, false};
+
+  const channel_t id = channelCount();
+  nodes[node].topic = id;
+  names.emplace_back(name);
+  return {id, true};
+}
+
+uint32_t TopicTable::lookup(string_view path) const {
+  uint32_t node = 0;
+  for (auto segment : splitSegments(path)) {
+    const auto &children = nodes[node].children;
+    auto it = children.find(segment);
+    if (it == children.end())
+      return NONE;
+    node = it->second;
+  }
+  return node;
+}
+
+optional<channel_t> TopicTable::find(string_view name) const {
+  const uint32_t node = lookup(name);
+  if (node == NONE || nodes[node].topic == NONE)
+    return nullopt;
+  return nodes[node].topic;
+}
+
+uint32_t TopicTable::addPattern(string_view pattern) {
+  const uint32_t node = insert(pattern);
+  if (nodes[node].pattern == NONE) {
+    nodes[node].pattern = static_cast<uint32_t>(patterns.size());
+    patterns.emplace_back(pattern);
+  }
+  return nodes[node].pattern;
+}
+
+optional<uint32_t> TopicTable::findPattern(string_view pattern) const {
+  const uint32_t node = lookup(pattern);
+  if (node == NONE || nodes[node].pattern == NONE)
+    return nullopt;
+  return nodes[node].pattern;
+}
+
+void TopicTable::matchTopics(uint32_t pattern, vector<channel_t> &out) const {
+  const auto segments = splitSegments(patterns[pattern]);
+  walkTopics(0, segments, out);
+}
+
+void TopicTable::matchPatterns(channel_t topic,
+                               vector<uint32_t> &out) const {
+  const auto segments = splitSegments(name(topic));
+  walkPatterns(0, segments, out);
+}
+
+void TopicTable::collectTopics(uint32_t node, vector<channel_t> &out) const {
+  if (nodes[node].topic != NONE) {
+    out.push_back(nodes[node].topic);
+  }
+  for (const auto &[segment, child] : nodes[node].children) {
+    collectTopics(child, out);
+  }
+}
+
+void TopicTable::walkTopics(uint32_t node, span<const string_view> segments,
+                            vector<channel_t> &out) const {
+  if (segments.empty()) {
+    if (nodes[node].topic != NONE) {
+      out.push_back(nodes[node].topic);
+    }
+    return;
+  }
+
+  const auto segment = segments.front();
+  const auto &children = nodes[node].children;
+  if (segment == protocol::TOPIC_REST) {
+    for (const auto &[_, child] : children) {
+      collectTopics(child, out);
+    }
+  } else if (segment == protocol::TOPIC_ANY) {
+    for (const auto &[_, child] : children) {
+      walkTopics(child, segments.subspan(1), out);
+    }
+  } else if (auto it = children.find(segment); it != children.end()) {
+    walkTopics(it->second, segments.subspan(1), out);
+  }
+}
+
+void TopicTable::walkPatterns(uint32_t node, span<const string_view> segments,
+                              vector<uint32_t> &out) const {
+  if (segments.empty()) {
+    if (nodes[node].pattern != NONE) {
+      out.push_back(nodes[node].pattern);
+    }
+    return;
+  }
+
+  const auto &children = nodes[node].children;
+  if (auto it = children.find(protocol::TOPIC_REST); it != children.end()) {
+    if (nodes[it->second].pattern != NONE) {
+      out.push_back(nodes[it->second].pattern);
+    }
+  }
+  if (auto it = children.find(protocol::TOPIC_ANY); it != children.end()) {
+    walkPatterns(it->second, segments.subspan(1), out);
+  }
+  if (auto it = children.find(segments.front()); it != children.end()) {
+    walkPatterns(it->second, segments.subspan(1), out);
+  }
+}
+
+} // namespace pubsub
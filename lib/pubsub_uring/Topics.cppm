@@ -0,0 +1,66 @@
+export module pubsub_uring:Topics;
+
+import std;
+import :Protocol;
+
+using namespace std;
+
+export namespace pubsub {
+
+// Interns topic names to dense channel ids and matches them against
+// subscription patterns. Names and patterns share one trie keyed by
+// segment, so interning is a walk down the trie and wildcard matching only
+// ever happens when a topic or a pattern is first seen, never per message.
+class TopicTable {
+public:
+  // Topic ids start after the numeric channels
+  static constexpr channel_t FIRST_TOPIC = protocol::CHANNEL_COUNT;
+  static constexpr uint32_t NONE = numeric_limits<uint32_t>::max();
+
+  struct Interned {
+    channel_t id;
+    bool added;
+  };
+
+  TopicTable();
+
+  // Name must be valid per codec::isValidTopic without wildcards
+  Interned intern(string_view name);
+  optional<channel_t> find(string_view name) const;
+  string_view name(channel_t id) const { return names[id - FIRST_TOPIC]; }
+
+  // One past the highest channel id in use
+  channel_t channelCount() const { return FIRST_TOPIC + names.size(); }
+
+  // Pattern ids are dense from 0, the same text always gets the same id
+  uint32_t addPattern(string_view pattern);
+  optional<uint32_t> findPattern(string_view pattern) const;
+  string_view pattern(uint32_t id) const { return patterns[id]; }
+
+  // Appends every known topic the pattern matches
+  void matchTopics(uint32_t pattern, vector<channel_t> &out) const;
+  // Appends every known pattern the topic matches
+  void matchPatterns(channel_t topic, vector<uint32_t> &out) const;
+
+private:
+  struct Node {
+    map<string, uint32_t, less<>> children;
+    channel_t topic = NONE;
+    uint32_t pattern = NONE;
+  };
+
+  uint32_t insert(string_view path);
+  // The node of path, NONE when it is not in the trie
+  uint32_t lookup(string_view path) const;
+  void collectTopics(uint32_t node, vector<channel_t> &out) const;
+  void walkTopics(uint32_t node, span<const string_view> segments,
+                  vector<channel_t> &out) const;
+  void walkPatterns(uint32_t node, span<const string_view> segments,
+                    vector<uint32_t> &out) const;
+
+  vector<Node> nodes;
+  vector<string> names;
+  vector<string> patterns;
+};
+
+} // namespace pubsub
@@ -0,0 +1,195 @@
+module pubsub_uring;
+
+import std;
+import Histogram;
+
+using namespace std;
+
+namespace pubsub {
+
+namespace {
+// Every ring ever created, for the dumper. Only touched when a thread
+// records its first event and at dump time.
+struct Registry {
+  mutex lock;
+  vector<const TraceRing *> rings;
+  uint64_t startTsc = 0;
+  chrono::steady_clock::time_point startTime;
+};
+
+Registry &registry() {
+  static Registry instance;
+  return instance;
+}
+
+struct Span {
+  Stage stage;
+  uint64_t begin;
+  uint64_t end;
+  int32_t fd;
+  uint32_t seq;
+};
+
+// Pairs each event with the previous stage of the same message. Messages are
+// followed by seq up to ENQUEUE, then by their position in the subscriber's
+// send queue, which is FIFO.
+vector<Span> matchStages(const vector<TraceEvent> &events) {
+  vector<Span> spans;
+  unordered_map<int32_t, uint64_t> lastRecv;
+  unordered_map<uint32_t, uint64_t> parsed;
+  unordered_map<uint64_t, uint64_t> routed;
+  unordered_map<int32_t, deque<pair<uint32_t, uint64_t>>> queued;
+  unordered_map<int32_t, pair<uint32_t, uint64_t>> inflight;
+
+  for (const auto &e : events) {
+    const uint64_t routeKey = uint64_t{e.seq} << 32 | uint32_t(e.fd);
+    switch (e.stage) {
+    case Stage::RECV_CQE:
+      lastRecv[e.fd] = e.tsc;
+      break;
+    case Stage::PARSE:
+      if (auto it = lastRecv.find(e.fd); it != lastRecv.end()) {
+        spans.push_back({e.stage, it->second, e.tsc, e.fd, e.seq});
+      }
+      parsed[e.seq] = e.tsc;
+      break;
+    case Stage::ROUTE:
+      if (auto it = parsed.find(e.seq); it != parsed.end()) {
+        spans.push_back({e.stage, it->second, e.tsc, e.fd, e.seq});
+      }
+      routed[routeKey] = e.tsc;
+      break;
+    case Stage::ENQUEUE:
+      if (auto it = routed.find(routeKey); it != routed.end()) {
+        spans.push_back({e.stage, it->second, e.tsc, e.fd, e.seq});
+        routed.erase(it);
+      }
+      queued[e.fd].emplace_back(e.seq, e.tsc);
+      break;
+    case Stage::SEND_SQE:
+      if (auto &q = queued[e.fd]; !q.empty()) {
+        auto [seq, tsc] = q.front();
+        q.pop_front();
+        spans.push_back({e.stage, tsc, e.tsc, e.fd, seq});
+        inflight[e.fd] = {seq, e.tsc};
+      }
+      break;
+    case Stage::SEND_CQE:
+      if (auto it = inflight.find(e.fd); it != inflight.end()) {
+        spans.push_back(
+            {e.stage, it->second.second, e.tsc, e.fd, it->second.first});
+        inflight.erase(it);
+      }
+      break;
+    case Stage::CLOSE:
+      lastRecv.erase(e.fd);
+      queued.erase(e.fd);
+      inflight.erase(e.fd);
+      break;
+    }
+  }
+  return spans;
+}
+} // namespace
+
+TraceRing::TraceRing() : events(CAPACITY) {
+  auto &reg = registry();
+  lock_guard guard(reg.lock);
+  if (reg.rings.empty()) {
+    reg.startTsc = readTsc();
+    reg.startTime = chrono::steady_clock::now();
+  }
+  reg.rings.push_back(this);
+}
+
+TraceRing::~TraceRing() {
+  auto &reg = registry();
+  lock_guard guard(reg.lock);
+  erase(reg.rings, this);
+}
+
+vector<TraceEvent> TraceRing::snapshot() const {
+  vector<TraceEvent> out;
+  const uint64_t count = min<uint64_t>(next, CAPACITY);
+  out.reserve(count);
+  for (uint64_t i = next - count; i < next; ++i) {
+    out.push_back(events[i & (CAPACITY - 1)]);
+  }
+  return out;
+}
+
+void dumpTrace(const string &jsonPath) {
+  if constexpr (!TRACING) {
+    println(stderr, "\033[33m[TRACE] Tracepoints are not compiled in, "
+                    "configure with -DPUBSUB_TRACE=ON\033[0m");
+    return;
+  }
+
+  auto &reg = registry();
+  lock_guard guard(reg.lock);
+  if (reg.rings.empty()) {
+    println("\033[33m[TRACE] No events recorded\033[0m");
+    return;
+  }
+
+  // Calibrate the TSC against the steady clock over the whole run
+  const double nsPerTick =
+      chrono::duration<double, nano>(chrono::steady_clock::now() -
+                                     reg.startTime)
+          .count() /
+      max<uint64_t>(1, readTsc() - reg.startTsc);
+  auto toNs = [&](uint64_t ticks) {
+    return static_cast<uint64_t>(ticks * nsPerTick);
+  };
+
+  vector<misc::Histogram> histograms(STAGE_NAMES.size());
+  ofstream json;
+  if (!jsonPath.empty()) {
+    json.open(jsonPath);
+    if (!json) {
+      println(stderr, "\033[31m[TRACE] Cannot write {}\033[0m", jsonPath);
+    }
+    json << "{\"traceEvents\":[";
+  }
+
+  size_t total = 0;
+  const char *sep = "\n";
+  for (size_t thread = 0; thread < reg.rings.size(); ++thread) {
+    const auto events = reg.rings[thread]->snapshot();
+    total += events.size();
+    for (const auto &span : matchStages(events)) {
+      const auto stage = to_underlying(span.stage);
+      histograms[stage].record(toNs(span.end - span.begin));
+      if (json) {
+        json << format("{}{{\"name\":\"{}\",\"ph\":\"X\",\"pid\":{},"
+                       "\"tid\":{},\"ts\":{:.3f},\"dur\":{:.3f},"
+                       "\"args\":{{\"seq\":{}}}}}",
+                       sep, STAGE_NAMES[stage], thread, span.fd,
+                       toNs(span.begin - reg.startTsc) / 1e3,
+                       toNs(span.end - span.begin) / 1e3, span.seq);
+        sep = ",\n";
+      }
+    }
+  }
+  if (json) {
+    json << "\n]}\n";
+  }
+
+  println("\033[34m[TRACE] {} events from {} thread(s), {:.3f} ns per "
+          "tick\033[0m",
+          total, reg.rings.size(), nsPerTick);
+  println("{:<22} {:>10} {:>10} {:>10} {:>10} {:>10}", "stage (us)", "count",
+          "p50", "p99", "p99.9", "max");
+  for (size_t stage = 1; stage < STAGE_NAMES.size(); ++stage) {
+    const auto &h = histograms[stage];
+    println("{:<22} {:>10} {:>10.2f} {:>10.2f} {:>10.2f} {:>10.2f}",
+            format("{} -> {}", STAGE_NAMES[stage - 1], STAGE_NAMES[stage]),
+            h.count(), h.percentile(50) / 1e3, h.percentile(99) / 1e3,
+            h.percentile(99.9) / 1e3, h.max() / 1e3);
+  }
+  if (json) {
+    println("\033[32m[TRACE] Chrome trace written to {}\033[0m", jsonPath);
+  }
+}
+
+} // namespace pubsub
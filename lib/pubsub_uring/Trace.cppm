@@ -0,0 +1,89 @@
+export module pubsub_uring:Trace;
+
+import std;
+
+using namespace std;
+
+export namespace pubsub {
+
+// Configure with -DPUBSUB_TRACE=ON to compile tracepoints in. Otherwise
+// tracepoint() is an empty inline function and no ring is ever allocated.
+#ifdef PUBSUB_TRACE
+constexpr bool TRACING = true;
+#else
+constexpr bool TRACING = false;
+#endif
+
+// A message's path through the broker, in order. CLOSE is a marker that
+// resets per-fd bookkeeping in the dumper, not a stage.
+enum class Stage : uint8_t {
+  RECV_CQE,
+  PARSE,
+  ROUTE,
+  ENQUEUE,
+  SEND_SQE,
+  SEND_CQE,
+  CLOSE,
+};
+
+constexpr array<string_view, 6> STAGE_NAMES{
+    "recv_cqe", "parse", "route", "enqueue", "send_sqe", "send_cqe"};
+
+inline uint64_t readTsc() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  return chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+struct TraceEvent {
+  uint64_t tsc;
+  int32_t fd;
+  uint32_t seq;
+  Stage stage;
+};
+
+// Events of one thread. Keeps the most recent CAPACITY events and
+// overwrites older ones.
+class TraceRing {
+public:
+  static constexpr size_t CAPACITY = size_t{1} << 20;
+
+  TraceRing();
+  ~TraceRing();
+
+  TraceRing(const TraceRing &) = delete;
+  TraceRing &operator=(const TraceRing &) = delete;
+
+  void record(Stage stage, int32_t fd, uint32_t seq) {
+    events[next++ & (CAPACITY - 1)] = {readTsc(), fd, seq, stage};
+  }
+
+  // Oldest first
+  vector<TraceEvent> snapshot() const;
+
+private:
+  vector<TraceEvent> events;
+  uint64_t next = 0;
+};
+
+inline thread_local TraceRing *localTrace = nullptr;
+
+// fd is the client the stage acts on and seq the broker's message number
+// (0 where the dumper recovers it from per-fd order)
+inline void tracepoint(Stage stage, int32_t fd, uint32_t seq = 0) {
+  if constexpr (TRACING) {
+    if (!localTrace) [[unlikely]] {
+      localTrace = new TraceRing;
+    }
+    localTrace->record(stage, fd, seq);
+  }
+}
+
+// Prints a latency histogram per stage, measured from the previous stage of
+// the same message, over the events of every thread. Also writes them as
+// Chrome trace JSON (chrome://tracing, Perfetto) when jsonPath is set.
+void dumpTrace(const string &jsonPath);
+
+} // namespace pubsub
@@ -0,0 +1,338 @@
+module;
+
+#include <cerrno>
+#include <cstring>
+
+#include <liburing.h>
+#include <sys/socket.h>
+
+module pubsub_uring;
+
+import std;
+
+using namespace std;
+
+namespace pubsub {
+
+Uring::Uring(unsigned entries, unsigned flags) {
+  if (int ret = io_uring_queue_init(entries, &ring, flags); ret < 0) {
+    throw runtime_error(
+        format("Failed to initialize io_uring: {}", strerror(-ret)));
+  }
+}
+
+Uring::~Uring() { io_uring_queue_exit(&ring); }
+
+io_uring_sqe *Uring::getSqe() {
+  io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+  if (!sqe) {
+    if (metrics) {
+      metrics->sqeExhausted.add();
+    }
+    io_uring_submit(&ring);
+    sqe = io_uring_get_sqe(&ring);
+  }
+  return sqe;
+}
+
+bool Uring::prepAccept(socket_t listen, Completion *completion) {
+  io_uring_sqe *sqe = getSqe();
+  if (!sqe)
+    return false;
+  io_uring_prep_accept(sqe, listen, nullptr, nullptr, 0);
+  io_uring_sqe_set_data(sqe, completion);
+  return true;
+}
+
+bool Uring::prepRecv(socket_t fd, span<char> buffer, Completion *completion,
+                     int flags) {
+  io_uring_sqe *sqe = getSqe();
+  if (!sqe)
+    return false;
+  io_uring_prep_recv(sqe, fd, buffer.data(), buffer.size(), flags);
+  io_uring_sqe_set_data(sqe, completion);
+  return true;
+}
+
+bool Uring::prepSend(socket_t fd, span<const char> data,
+                     Completion *completion) {
+  io_uring_sqe *sqe = getSqe();
+  if (!sqe)
+    return false;
+  io_uring_prep_send(sqe, fd, data.data(), data.size(), MSG_NOSIGNAL);
+  io_uring_sqe_set_data(sqe, completion);
+  return true;
+}
+
+bool Uring::prepTimeout(__kernel_timespec *ts, Completion *completion,
+                        bool absolute) {
+  io_uring_sqe *sqe = getSqe();
+  if (!sqe)
+    return false;
+  io_uring_prep_timeout(sqe, ts, 0, absolute ? IORING_TIMEOUT_ABS : 0);
+  io_uring_sqe_set_data(sqe, completion);
+  return true;
+}
+
+bool Uring::prepRecv(socket_t fd, span<char> buffer, Completion *completion,
+                     __kernel_timespec *timeout) {
+  // Both SQEs must go out in the same submission or the link is lost
+  if (io_uring_sq_space_left(&ring) < 2) {
+    io_uring_submit(&ring);
+  }
+  io_uring_sqe *sqe = getSqe();
+  if (!sqe)
+    return false;
+  io_uring_prep_recv(sqe, fd, buffer.data(), buffer.size(), 0);
+  io_uring_sqe_set_data(sqe, completion);
+  io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+
+  io_uring_sqe *link = getSqe();
+  if (!link) {
+    // Leave the recv unbounded rather than unsubmitted
+    sqe->flags &= ~IOSQE_IO_LINK;
+    return true;
+  }
+  io_uring_prep_link_timeout(link, timeout, 0);
+  io_uring_sqe_set_data(link, nullptr);
+  return true;
+}
+
+bool Uring::prepRecvMultishot(socket_t fd, uint16_t group,
+                              Completion *completion) {
+  io_uring_sqe *sqe = getSqe();
+  if (!sqe)
+    return false;
+  io_uring_prep_recv_multishot(sqe, fd, nullptr, 0, 0);
+  io_uring_sqe_set_flags(sqe, IOSQE_BUFFER_SELECT);
+  sqe->buf_group = group;
+  io_uring_sqe_set_data(sqe, completion);
+  return true;
+}
+
+bool Uring::prepPoll(int fd, uint32_t events, Completion *completion) {
+  io_uring_sqe *sqe = getSqe();
+  if (!sqe)
+    return false;
+  io_uring_prep_poll_add(sqe, fd, events);
+  io_uring_sqe_set_data(sqe, completion);
+  return true;
+}
+
+bool Uring::prepCancel(Completion *target) {
+  io_uring_sqe *sqe = getSqe();
+  if (!sqe)
+    return false;
+  io_uring_prep_cancel64(sqe, reinterpret_cast<uint64_t>(target), 0);
+  io_uring_sqe_set_data(sqe, nullptr);
+  return true;
+}
+
+bool Uring::prepCancelFd(int fd) {
+  io_uring_sqe *sqe = getSqe();
+  if (!sqe)
+    return false;
+  io_uring_prep_cancel_fd(sqe, fd, IORING_ASYNC_CANCEL_ALL);
+  io_uring_sqe_set_data(sqe, nullptr);
+  return true;
+}
+
+IoAwaitable Uring::accept(socket_t listen) {
+  return IoAwaitable(*this, OpType::ACCEPT, listen, {});
+}
+
+IoAwaitable Uring::recv(socket_t fd, span<char> buffer) {
+  return IoAwaitable(*this, OpType::RECV, fd, buffer);
+}
+
+IoAwaitable Uring::recv(socket_t fd, span<char> buffer,
+                        chrono::nanoseconds timeout) {
+  return IoAwaitable(*this, fd, buffer, timeout);
+}
+
+IoAwaitable Uring::recvRecord(socket_t fd, span<char> buffer) {
+  return IoAwaitable(*this, OpType::RECV, fd, buffer, MSG_TRUNC);
+}
+
+IoAwaitable Uring::send(socket_t fd, span<const char> data) {
+  // Never written through, the span just shares storage with recv
+  return IoAwaitable(*this, OpType::SEND, fd,
+                     {const_cast<char *>(data.data()), data.size()});
+}
+
+IoAwaitable Uring::timeout(chrono::nanoseconds duration) {
+  return IoAwaitable(*this, duration);
+}
+
+IoAwaitable Uring::poll(int fd, uint32_t events) {
+  return IoAwaitable(*this, fd, events);
+}
+
+int Uring::submit() { return io_uring_submit(&ring); }
+
+int Uring::submitAndWait(unsigned waitNr) {
+  return io_uring_submit_and_wait(&ring, waitNr);
+}
+
+int Uring::pollAndComplete() {
+  if (int ret = submit(); ret < 0)
+    return ret;
+
+  array<io_uring_cqe *, CQE_BATCH> cqes;
+  unsigned count = peekBatch(cqes);
+  for (unsigned i = 0; i < count; ++i) {
+    Completion::dispatch(*cqes[i]);
+  }
+  advance(count);
+  resumeYielded();
+  return static_cast<int>(count);
+}
+
+void Uring::resumeYielded() {
+  if (yielded.empty())
+    return;
+  // One that yields again waits for the next pass
+  auto ready = std::move(yielded);
+  yielded.clear();
+  for (auto handle : ready) {
+    handle.resume();
+  }
+}
+
+unsigned Uring::peekBatch(span<io_uring_cqe *> cqes) {
+  return io_uring_peek_batch_cqe(&ring, cqes.data(),
+                                 static_cast<unsigned>(cqes.size()));
+}
+
+void Uring::advance(unsigned count) { io_uring_cq_advance(&ring, count); }
+
+bool IoAwaitable::await_suspend(coroutine_handle<> handle) {
+  waiter = handle;
+  onComplete = &IoAwaitable::resume;
+
+  bool queued = false;
+  switch (op) {
+  case OpType::ACCEPT:
+    queued = ring.prepAccept(fd, this);
+    break;
+  case OpType::RECV:
+    queued = linked ? ring.prepRecv(fd, buffer, this, &ts)
+                    : ring.prepRecv(fd, buffer, this,
+                                    static_cast<int>(events));
+    break;
+  case OpType::SEND:
+    queued = ring.prepSend(fd, buffer, this);
+    break;
+  case OpType::TIMEOUT:
+    queued = ring.prepTimeout(&ts, this);
+    break;
+  case OpType::POLL:
+    queued = ring.prepPoll(fd, events, this);
+    break;
+  }
+
+  if (!queued) {
+    result = -EBUSY;
+  }
+  return queued;
+}
+
+void IoAwaitable::resume(Completion *self, int res, uint32_t flags) {
+  auto *awaitable = static_cast<IoAwaitable *>(self);
+  if (auto *metrics = awaitable->ring.attachedMetrics()) {
+    metrics->cqes[to_underlying(awaitable->op)].add();
+  }
+  awaitable->result = res;
+  awaitable->cqeFlags = flags;
+  awaitable->waiter.resume();
+}
+
+BufferRing::BufferRing(Uring &ring, uint16_t group, uint32_t count,
+                       uint32_t size)
+    : ring(ring), storage(size_t{count} * size), count(count),
+      bufferSize(size), groupId(group) {
+  // The ring is indexed through a mask, any other count would leave some
+  // buffers unreachable
+  if (!has_single_bit(count)) {
+    throw runtime_error("Buffer ring count must be a power of two");
+  }
+  int ret = 0;
+  buffers = io_uring_setup_buf_ring(ring.native(), count, group, 0, &ret);
+  if (!buffers) {
+    throw runtime_error(
+        format("Failed to register buffer ring: {}", strerror(-ret)));
+  }
+  for (uint32_t id = 0; id < count; ++id) {
+    io_uring_buf_ring_add(buffers, storage.data() + size_t{id} * size, size,
+                          static_cast<unsigned short>(id),
+                          io_uring_buf_ring_mask(count), static_cast<int>(id));
+  }
+  io_uring_buf_ring_advance(buffers, static_cast<int>(count));
+}
+
+BufferRing::~BufferRing() {
+  io_uring_free_buf_ring(ring.native(), buffers, count, groupId);
+}
+
+void BufferRing::recycle(uint16_t id) {
+  io_uring_buf_ring_add(buffers, storage.data() + size_t{id} * bufferSize,
+                        bufferSize, id, io_uring_buf_ring_mask(count), 0);
+  io_uring_buf_ring_advance(buffers, 1);
+}
+
+RecvStream::RecvStream(Uring &ring, socket_t fd, BufferRing &buffers)
+    : ring(ring), buffers(buffers), fd(fd) {
+  onComplete = &RecvStream::resume;
+}
+
+void RecvStream::release() {
+  if (held >= 0) {
+    buffers.recycle(static_cast<uint16_t>(held));
+    held = -1;
+  }
+  current = {};
+}
+
+void RecvStream::stop() {
+  if (isArmed && !stopping) {
+    ring.prepCancel(this);
+  }
+  stopping = true;
+}
+
+bool RecvStream::Next::await_suspend(coroutine_handle<> handle) {
+  stream.release();
+  if (!stream.isArmed) {
+    if (stream.stopping) {
+      stream.result = -ECANCELED;
+      return false;
+    }
+    if (!stream.ring.prepRecvMultishot(stream.fd, stream.buffers.group(),
+                                       &stream)) {
+      stream.result = -EBUSY;
+      return false;
+    }
+    stream.isArmed = true;
+  }
+  stream.waiter = handle;
+  return true;
+}
+
+void RecvStream::resume(Completion *self, int res, uint32_t flags) {
+  auto *stream = static_cast<RecvStream *>(self);
+  if (auto *metrics = stream->ring.attachedMetrics()) {
+    metrics->cqes[to_underlying(OpType::RECV)].add();
+  }
+  if (flags & IORING_CQE_F_BUFFER) {
+    const uint16_t id = BufferRing::bufferId(flags);
+    stream->held = id;
+    stream->current = stream->buffers.data(id, res > 0 ? res : 0);
+  }
+  if (!(flags & IORING_CQE_F_MORE)) {
+    stream->isArmed = false;
+  }
+  stream->result = res;
+  stream->waiter.resume();
+}
+
+} // namespace pubsub
@@ -0,0 +1,289 @@
+module;
+
+#include <liburing.h>
+
+export module pubsub_uring:Uring;
+
+import std;
+import :Protocol;
+import :Metrics;
+
+using namespace std;
+
+export namespace pubsub {
+
+enum class OpType : uint8_t {
+  ACCEPT,
+  RECV,
+  SEND,
+  TIMEOUT,
+  POLL,
+};
+
+static_assert(OP_NAMES.size() == to_underlying(OpType::POLL) + 1);
+
+// Anything whose address is stored in an SQE's user_data. The CQE is routed
+// straight back to it, no lookup by fd.
+struct Completion {
+  void (*onComplete)(Completion *self, int res, uint32_t flags) = nullptr;
+
+  static void dispatch(const io_uring_cqe &cqe) {
+    if (auto *completion = reinterpret_cast<Completion *>(cqe.user_data)) {
+      completion->onComplete(completion, cqe.res, cqe.flags);
+    }
+  }
+};
+
+class IoAwaitable;
+
+// Owns an io_uring instance. Prep helpers flush the submission queue when it
+// is full instead of failing, and completions are reaped in batches.
+class Uring {
+public:
+  static constexpr unsigned CQE_BATCH = 64;
+
+  explicit Uring(unsigned entries, unsigned flags = 0);
+  ~Uring();
+
+  Uring(const Uring &) = delete;
+  Uring &operator=(const Uring &) = delete;
+
+  io_uring *native() { return &ring; }
+
+  // Optional; counts CQEs of awaited operations and full-SQ events
+  void attachMetrics(RingMetrics *counters) { metrics = counters; }
+  RingMetrics *attachedMetrics() const { return metrics; }
+
+  // nullptr only if the queue is still full after flushing it
+  io_uring_sqe *getSqe();
+
+  bool prepAccept(socket_t listen, Completion *completion);
+  // flags as for recv(2)
+  bool prepRecv(socket_t fd, span<char> buffer, Completion *completion,
+                int flags = 0);
+  bool prepSend(socket_t fd, span<const char> data, Completion *completion);
+  // absolute: ts is a CLOCK_MONOTONIC deadline rather than a duration
+  bool prepTimeout(__kernel_timespec *ts, Completion *completion,
+                   bool absolute = false);
+  // recv with a linked timeout: fails with -ECANCELED if nothing arrives
+  // within *timeout. The timeout's own CQE carries no completion.
+  bool prepRecv(socket_t fd, span<char> buffer, Completion *completion,
+                __kernel_timespec *timeout);
+  // One SQE, then a CQE per received chunk into a buffer of group until a
+  // CQE arrives without IORING_CQE_F_MORE
+  bool prepRecvMultishot(socket_t fd, uint16_t group, Completion *completion);
+  bool prepPoll(int fd, uint32_t events, Completion *completion);
+  // Cancels the operation(s) whose user_data is target
+  bool prepCancel(Completion *target);
+  // Cancels every operation on fd, the fd itself stays open
+  bool prepCancelFd(int fd);
+
+  // Awaitables for coroutines: co_await ring.recv(fd, buf) yields cqe->res
+  IoAwaitable accept(socket_t listen);
+  IoAwaitable recv(socket_t fd, span<char> buffer);
+  IoAwaitable recv(socket_t fd, span<char> buffer, chrono::nanoseconds timeout);
+  // recv of one record from a SOCK_SEQPACKET socket, with MSG_TRUNC: yields
+  // the record's full length, more than buffer.size() if the kernel cut it
+  IoAwaitable recvRecord(socket_t fd, span<char> buffer);
+  IoAwaitable send(socket_t fd, span<const char> data);
+  IoAwaitable timeout(chrono::nanoseconds duration);
+  IoAwaitable poll(int fd, uint32_t events);
+
+  // Suspends until the next waitAndDispatch() or pollAndComplete() has
+  // handled its CQEs. An op that got -EBUSY retries after this: at once it
+  // would find the queue still full, nothing reaps the CQ in between.
+  struct Yield {
+    Uring &ring;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(coroutine_handle<> handle) {
+      ring.yielded.push_back(handle);
+    }
+    void await_resume() const noexcept {}
+  };
+
+  Yield yield() { return {*this}; }
+
+  int submit();
+  int submitAndWait(unsigned waitNr);
+
+  unsigned peekBatch(span<io_uring_cqe *> cqes);
+  void advance(unsigned count);
+
+  // Submits pending SQEs, blocks for at least one completion and hands every
+  // ready CQE to handler. Returns the number handled or a negative errno.
+  template <typename Handler> int waitAndDispatch(Handler &&handler) {
+    // Yielded coroutines go on even if nothing completes
+    int ret = submitAndWait(yielded.empty() ? 1 : 0);
+    if (ret < 0)
+      return ret;
+
+    array<io_uring_cqe *, CQE_BATCH> cqes;
+    unsigned count = peekBatch(cqes);
+    for (unsigned i = 0; i < count; ++i) {
+      handler(*cqes[i]);
+    }
+    advance(count);
+    resumeYielded();
+    return static_cast<int>(count);
+  }
+
+  // waitAndDispatch routing every CQE to its Completion
+  int waitAndComplete() { return waitAndDispatch(Completion::dispatch); }
+
+  // Submits and completes whatever is already in the CQ without blocking
+  int pollAndComplete();
+
+private:
+  void resumeYielded();
+
+  io_uring ring;
+  RingMetrics *metrics = nullptr;
+  // Suspended in yield()
+  vector<coroutine_handle<>> yielded;
+};
+
+// One io_uring operation suspended on by a coroutine. Lives in the coroutine
+// frame for the duration of the co_await, which keeps buffers and the
+// timespec valid until the CQE arrives.
+class IoAwaitable : private Completion {
+public:
+  IoAwaitable(Uring &ring, OpType op, socket_t fd, span<char> buffer,
+              uint32_t flags = 0)
+      : ring(ring), op(op), fd(fd), buffer(buffer), events(flags) {}
+
+  IoAwaitable(Uring &ring, chrono::nanoseconds duration)
+      : ring(ring), op(OpType::TIMEOUT), fd(-1) {
+    setTimespec(duration);
+  }
+
+  // A recv bounded by a linked timeout
+  IoAwaitable(Uring &ring, socket_t fd, span<char> buffer,
+              chrono::nanoseconds timeout)
+      : ring(ring), op(OpType::RECV), fd(fd), buffer(buffer), linked(true) {
+    setTimespec(timeout);
+  }
+
+  IoAwaitable(Uring &ring, int fd, uint32_t events)
+      : ring(ring), op(OpType::POLL), fd(fd), events(events) {}
+
+  bool await_ready() const noexcept { return false; }
+
+  // Returns false (resume immediately with -EBUSY) if no SQE is available
+  bool await_suspend(coroutine_handle<> handle);
+
+  int await_resume() const noexcept { return result; }
+
+  uint32_t flags() const noexcept { return cqeFlags; }
+
+private:
+  static void resume(Completion *self, int res, uint32_t flags);
+
+  void setTimespec(chrono::nanoseconds duration) {
+    auto secs = chrono::duration_cast<chrono::seconds>(duration);
+    ts.tv_sec = secs.count();
+    ts.tv_nsec = (duration - secs).count();
+  }
+
+  Uring &ring;
+  OpType op;
+  socket_t fd;
+  span<char> buffer;
+  // Poll events, or recv flags
+  uint32_t events = 0;
+  // ts is a timeout linked to the recv rather than a TIMEOUT op's own
+  bool linked = false;
+  __kernel_timespec ts{};
+  coroutine_handle<> waiter;
+  int result = 0;
+  uint32_t cqeFlags = 0;
+};
+
+// Buffers the kernel picks from for receives prepped with a group id instead
+// of a buffer. One ring serves any number of sockets, so receive memory
+// follows what is in flight rather than the number of connections.
+class BufferRing {
+public:
+  // count must be a power of two, group unique per Uring. Throws
+  // runtime_error when the count is not or registration fails.
+  BufferRing(Uring &ring, uint16_t group, uint32_t count, uint32_t size);
+  ~BufferRing();
+
+  BufferRing(const BufferRing &) = delete;
+  BufferRing &operator=(const BufferRing &) = delete;
+
+  uint16_t group() const { return groupId; }
+
+  // The buffer id of a CQE with IORING_CQE_F_BUFFER set
+  static uint16_t bufferId(uint32_t cqeFlags) {
+    return static_cast<uint16_t>(cqeFlags >> IORING_CQE_BUFFER_SHIFT);
+  }
+
+  span<const char> data(uint16_t id, size_t len) const {
+    return {storage.data() + size_t{id} * bufferSize, len};
+  }
+
+  // Hands a buffer back to the kernel once its data has been consumed
+  void recycle(uint16_t id);
+
+private:
+  Uring &ring;
+  io_uring_buf_ring *buffers = nullptr;
+  vector<char> storage;
+  uint32_t count;
+  uint32_t bufferSize;
+  uint16_t groupId;
+};
+
+// A multishot recv into a BufferRing, for coroutines. co_await next() yields
+// the result of each CQE and data() the bytes it delivered, valid until the
+// following next(). Re-arms itself when the kernel ends the multishot, e.g.
+// on -ENOBUFS.
+//
+// A CQE that arrives while the coroutine is not suspended in next() is lost,
+// so it must not co_await anything else while armed(). To let go of the
+// socket early, stop() and then await next() until armed() is false.
+class RecvStream : private Completion {
+public:
+  RecvStream(Uring &ring, socket_t fd, BufferRing &buffers);
+  ~RecvStream() { release(); }
+
+  RecvStream(const RecvStream &) = delete;
+  RecvStream &operator=(const RecvStream &) = delete;
+
+  struct Next {
+    RecvStream &stream;
+
+    bool await_ready() const noexcept { return false; }
+    // Returns false (resume immediately) if the stream could not be armed,
+    // with -EBUSY, or was stopped, with -ECANCELED
+    bool await_suspend(coroutine_handle<> handle);
+    int await_resume() const noexcept { return stream.result; }
+  };
+
+  Next next() { return {*this}; }
+
+  span<const char> data() const { return current; }
+
+  bool armed() const { return isArmed; }
+
+  void stop();
+
+private:
+  static void resume(Completion *self, int res, uint32_t flags);
+
+  void release();
+
+  Uring &ring;
+  BufferRing &buffers;
+  socket_t fd;
+  coroutine_handle<> waiter;
+  span<const char> current;
+  int result = 0;
+  // Buffer held by current, -1 for none
+  int32_t held = -1;
+  bool isArmed = false;
+  bool stopping = false;
+};
+
+} // namespace pubsub
@@ -1,18 +1,19 @@
-module;
-
-#include <liburing.h>
-
 export module pubsub_uring;
 
-import std;
-
-using namespace std;
-
-export void hello_world() { println("Hello world"); }
-
-export void test_pubsub_uring() {
-  io_uring ring;
-  io_uring_queue_init(2, &ring, 0);
-
-  io_uring_queue_exit(&ring);
-}
\ No newline at end of file
+export import :Protocol;
+export import :Metrics;
+export import :Log;
+export import :Trace;
+export import :Codec;
+export import :BufferPool;
+export import :Uring;
+export import :Task;
+export import :Pacer;
+export import :Connection;
+export import :Topics;
+export import :Router;
+export import :Sink;
+export import :Shm;
+export import :MpscQueue;
+export import :Handoff;
+export import :Broker;
@@ -1,6 +1,7 @@
 #include <boost/program_options.hpp>
 
 import std;
+import pubsub_uring;
 
 #include <cerrno>
 #include <csignal>
@@ -15,21 +16,7 @@ import std;
 using namespace std;
 namespace po = boost::program_options;
 
-using socket_t = int;
-
-namespace protocol {
-constexpr uint8_t MAX_CHANNELS = 255;
-constexpr uint8_t CHANNEL_BROADCAST = 0;
-
-constexpr string_view HANDSHAKE_PUB = "[[PUB:";
-constexpr string_view HANDSHAKE_SUB = "[[SUB:";
-constexpr string_view MSG_PREFIX = "[CH:";
-constexpr string_view EXIT_MSG = "[[EXIT]]";
-
-constexpr size_t MAX_UDP_PAYLOAD = 2048;
-} // namespace protocol
-
-enum class ClientType { UNKNOWN, PUBLISHER, SUBSCRIBER };
+using namespace pubsub;
 
 struct ClientAddr {
   sockaddr_in addr;
@@ -50,16 +37,33 @@ struct ClientAddr {
     ::inet_ntop(AF_INET, &addr.sin_addr, ip, INET_ADDRSTRLEN);
     return format("{}:{}", ip, ntohs(addr.sin_port));
   }
+
+  // Address and port packed into one integer, for metrics labels
+  uint64_t key() const {
+    return uint64_t{addr.sin_addr.s_addr} << 16 | addr.sin_port;
+  }
+
+  static ClientAddr fromKey(uint64_t key) {
+    ClientAddr caddr{};
+    caddr.addr.sin_family = AF_INET;
+    caddr.addr.sin_addr.s_addr = static_cast<uint32_t>(key >> 16);
+    caddr.addr.sin_port = static_cast<uint16_t>(key);
+    return caddr;
+  }
 };
 
-struct Client {
+struct UdpClient {
   ClientAddr addr;
   ClientType type;
-  bitset<256> channels;
+  ChannelSet channels;
+  // Same meaning as the Client fields of the same names
+  vector<channel_t> topics;
+  Subscriptions subscriptions;
+  ClientMetrics *metrics = nullptr;
 
-  Client() : type(ClientType::UNKNOWN) {}
+  UdpClient() : type(ClientType::UNKNOWN) {}
 
-  Client(const sockaddr_in &address)
+  UdpClient(const sockaddr_in &address)
       : type(ClientType::UNKNOWN) {
     addr.addr = address;
   }
@@ -68,12 +72,19 @@ struct Client {
 class BrokerUDP {
 private:
   socket_t sock;
-  map<ClientAddr, Client> clients;
-  array<vector<ClientAddr>, 256> channelSubs;
+  map<ClientAddr, UdpClient> clients;
+  Router<ClientAddr> Routes;
+  BrokerMetrics Metrics;
   bool verbose;
 
 public:
-  explicit BrokerUDP(bool verbose = false) : sock(-1), verbose(verbose) {}
+  explicit BrokerUDP(bool verbose = false)
+      : sock(-1), Metrics([](uint64_t key) {
+          return ClientAddr::fromKey(key).toString();
+        }),
+        verbose(verbose) {}
+
+  const BrokerMetrics &metrics() const { return Metrics; }
 
   ~BrokerUDP() {
     if (sock >= 0) {
@@ -110,7 +121,7 @@ public:
     println("\033[32mUDP Broker listening on {}:{}\033[0m", host, port);
   }
 
-  Client *getClient(const ClientAddr &addr) {
+  UdpClient *getClient(const ClientAddr &addr) {
     auto it = clients.find(addr);
     return it != clients.end() ? &it->second : nullptr;
   }
@@ -119,7 +130,9 @@ public:
     ClientAddr caddr;
     caddr.addr = address;
     if (clients.find(caddr) == clients.end()) {
-      clients.emplace(caddr, Client(address));
+      auto [it, _] = clients.emplace(caddr, UdpClient(address));
+      it->second.metrics = Metrics.attach(caddr.key());
+      Metrics.clients.set(clients.size());
       if (verbose) {
         println("\033[36m[+] Client {} added\033[0m", caddr.toString());
       }
@@ -131,160 +144,209 @@ public:
     if (it == clients.end())
       return;
 
-    const auto &client = it->second;
+    auto &client = it->second;
 
-    // Remove from channel subscribers
-    if (client.type == ClientType::SUBSCRIBER) {
-      for (size_t ch = 0; ch < 256; ++ch) {
-        if (client.channels.test(ch)) {
-          auto &subs = channelSubs[ch];
-          subs.erase(remove(subs.begin(), subs.end(), addr), subs.end());
-        }
-      }
-    }
+    // Remove from channel subscribers, one swap-remove per subscription
+    Routes.unsubscribeAll(client.subscriptions);
 
     if (verbose) {
       println("\033[36m[-] Client {} removed\033[0m", addr.toString());
     }
 
+    Metrics.detach(client.metrics);
     clients.erase(it);
+    Metrics.clients.set(clients.size());
   }
 
-  void subscribeToChannel(const ClientAddr &addr, uint8_t channel) {
-    auto *client = getClient(addr);
-    if (!client)
-      return;
-
-    client->channels.set(channel);
-    auto &subs = channelSubs[channel];
-    if (find(subs.begin(), subs.end(), addr) == subs.end()) {
-      subs.push_back(addr);
-    }
+  void subscribeToChannel(UdpClient &client, uint8_t channel) {
+    client.channels.set(channel);
+    Routes.subscribe(client.addr, client.subscriptions, channel);
 
     if (verbose) {
       println("\033[33m[SUB] {} subscribed to channel {}\033[0m",
-              addr.toString(), channel);
+              client.addr.toString(), channel);
     }
   }
 
-  bool parseHandshake(Client &client, string_view data) {
-    // Look for PUB handshake: [[PUB:123]]
-    if (data.starts_with(protocol::HANDSHAKE_PUB)) {
-      size_t end = data.find("]]");
-      if (end == string::npos)
-        return false; // Incomplete
-
-      string_view handshake = data.substr(0, end + 2);
-      string channelStr(handshake.substr(protocol::HANDSHAKE_PUB.size(),
-                                         end - protocol::HANDSHAKE_PUB.size()));
-
-      uint8_t channel =
-          channelStr.empty() ? protocol::CHANNEL_BROADCAST : stoi(channelStr);
-
-      client.type = ClientType::PUBLISHER;
-      client.channels.set(channel);
-
-      println("\033[32m[HANDSHAKE] {} registered as PUBLISHER on channel "
-              "{}\033[0m",
+  void unsubscribeFromChannel(UdpClient &client, uint8_t channel) {
+    client.channels.reset(channel);
+    if (Routes.unsubscribe(client.subscriptions, channel) && verbose) {
+      println("\033[33m[UNSUB] {} unsubscribed from channel {}\033[0m",
               client.addr.toString(), channel);
-
-      return true;
     }
+  }
 
-    // Look for SUB handshake: [[SUB:1,2,3]] or [[SUB:ALL]]
-    if (data.starts_with(protocol::HANDSHAKE_SUB)) {
-      size_t end = data.find("]]");
-      if (end == string::npos)
-        return false; // Incomplete
-
-      string_view handshake = data.substr(0, end + 2);
-      string channelsStr(
-          handshake.substr(protocol::HANDSHAKE_SUB.size(),
-                           end - protocol::HANDSHAKE_SUB.size()));
-
-      client.type = ClientType::SUBSCRIBER;
-
-      if (channelsStr == "ALL") {
-        // Subscribe to all channels
-        for (size_t ch = 0; ch < 256; ++ch) {
-          subscribeToChannel(client.addr, ch);
-        }
-        println("\033[32m[HANDSHAKE] {} registered as SUBSCRIBER on ALL "
-                "channels\033[0m",
-                client.addr.toString());
-      } else {
-        // Parse comma-separated list or single channel
-        string channelsString{channelsStr};
-        istringstream ss{channelsString};
-        string token;
-        vector<uint8_t> channels;
-        while (std::getline(ss, token, ',')) {
-          if (!token.empty()) {
-            uint8_t ch = stoi(token);
-            subscribeToChannel(client.addr, ch);
-            channels.push_back(ch);
-          }
+  // Shared by the handshake and [[+SUB:...]]
+  void subscribe(UdpClient &client, const ChannelSet &channels,
+                 span<const string_view> patterns) {
+    if (channels.test(protocol::CHANNEL_BROADCAST)) {
+      // Broadcast subscribers get every channel, one entry covers them all
+      subscribeToChannel(client, protocol::CHANNEL_BROADCAST);
+    } else {
+      for (size_t ch = 0; ch < protocol::CHANNEL_COUNT; ++ch) {
+        if (channels.test(ch)) {
+          subscribeToChannel(client, static_cast<uint8_t>(ch));
         }
+      }
+    }
+    for (auto pattern : patterns) {
+      Routes.subscribePattern(client.addr, client.subscriptions, pattern,
+                              [this](const ClientAddr &addr, channel_t topic) {
+                                onTopicSubscribed(addr, topic);
+                              });
+    }
+  }
 
-        print("\033[32m[HANDSHAKE] {} registered as SUBSCRIBER on channels: ",
-              client.addr.toString());
-        for (size_t i = 0; i < channels.size(); ++i) {
-          print("{}{}", channels[i], i + 1 < channels.size() ? "," : "");
+  // [[-SUB:...]]
+  void unsubscribe(UdpClient &client, const ChannelSet &channels,
+                   span<const string_view> patterns) {
+    if (client.subscriptions.broadcast &&
+        !channels.test(protocol::CHANNEL_BROADCAST) && channels.any()) {
+      // Leaving part of a broadcast subscription: it becomes one
+      // subscription per remaining numeric channel
+      unsubscribeFromChannel(client, protocol::CHANNEL_BROADCAST);
+      for (size_t ch = 1; ch < protocol::CHANNEL_COUNT; ++ch) {
+        if (!channels.test(ch)) {
+          subscribeToChannel(client, static_cast<uint8_t>(ch));
+        }
+      }
+    } else {
+      for (size_t ch = 0; ch < protocol::CHANNEL_COUNT; ++ch) {
+        if (channels.test(ch)) {
+          unsubscribeFromChannel(client, static_cast<uint8_t>(ch));
         }
-        println("\033[0m");
       }
+    }
+    for (auto pattern : patterns) {
+      Routes.unsubscribePattern(
+          client.subscriptions, pattern, [&](channel_t topic) {
+            if (verbose) {
+              println("\033[33m[UNSUB] {} unsubscribed from topic {}\033[0m",
+                      client.addr.toString(),
+                      Routes.topicTable().name(topic));
+            }
+          });
+    }
+  }
 
-      return true;
+  // Called by the Router for every topic a pattern subscription picks up,
+  // at subscribe time or when a publisher registers the topic later
+  void onTopicSubscribed(const ClientAddr &addr, channel_t topic) {
+    if (verbose) {
+      println("\033[33m[SUB] {} subscribed to topic {}\033[0m",
+              addr.toString(), Routes.topicTable().name(topic));
     }
+  }
 
-    return false; // Unknown handshake
+  channel_t registerTopic(string_view name) {
+    const channel_t known = Routes.topicTable().channelCount();
+    const channel_t id = Routes.registerTopic(
+        name, [this](const ClientAddr &addr, channel_t topic) {
+          onTopicSubscribed(addr, topic);
+        });
+    if (id >= known) {
+      Metrics.nameTopic(id, name);
+    }
+    return id;
   }
 
-  optional<pair<uint8_t, string_view>> parseMessage(string_view data) {
-    // Format: [CH:123]message content
-    if (!data.starts_with(protocol::MSG_PREFIX)) {
-      return nullopt;
+  bool parseHandshake(UdpClient &client, string_view data) {
+    codec::Handshake handshake;
+    if (codec::parseHandshake(data, handshake) != codec::ParseStatus::OK) {
+      return false; // Datagrams carry the whole handshake
+    }
+    if (handshake.type == ClientType::MUX ||
+        handshake.type == ClientType::PEER ||
+        handshake.type == ClientType::REPLICA) {
+      return false; // Sessions and broker links need the TCP broker's stream
     }
 
-    size_t chEnd = data.find(']');
-    if (chEnd == string::npos)
-      return nullopt;
+    client.type = handshake.type;
 
-    string_view channelStr = data.substr(protocol::MSG_PREFIX.size(),
-                                         chEnd - protocol::MSG_PREFIX.size());
-    uint8_t channel = stoi(string(channelStr));
+    if (handshake.type == ClientType::PUBLISHER) {
+      if (handshake.topics.empty()) {
+        client.channels = handshake.channels;
+        println("\033[32m[HANDSHAKE] {} registered as PUBLISHER on channel "
+                "{}\033[0m",
+                client.addr.toString(), firstChannel(handshake.channels));
+        return true;
+      }
 
-    string_view content = data.substr(chEnd + 1);
-    return make_pair(channel, content);
+      // Interned once here, messages then index client.topics
+      for (auto name : handshake.topics) {
+        client.topics.push_back(registerTopic(name));
+      }
+      println("\033[32m[HANDSHAKE] {} registered as PUBLISHER on {} "
+              "topic(s): {}\033[0m",
+              client.addr.toString(), handshake.topics.size(),
+              handshake.topics.front());
+      return true;
+    }
+
+    subscribe(client, handshake.channels, handshake.topics);
+
+    if (handshake.channels.all()) {
+      println("\033[32m[HANDSHAKE] {} registered as SUBSCRIBER on ALL "
+              "channels\033[0m",
+              client.addr.toString());
+      return true;
+    }
+
+    print("\033[32m[HANDSHAKE] {} registered as SUBSCRIBER on channels: ",
+          client.addr.toString());
+    const char *sep = "";
+    for (size_t ch = 0; ch < protocol::CHANNEL_COUNT; ++ch) {
+      if (handshake.channels.test(ch)) {
+        print("{}{}", sep, ch);
+        sep = ",";
+      }
+    }
+    for (auto pattern : handshake.topics) {
+      print("{}{}", sep, pattern);
+      sep = ",";
+    }
+    println("\033[0m");
+    return true;
   }
 
-  void routeMessage(uint8_t channel, string_view message,
+  void routeMessage(channel_t channel, string_view message,
                     const ClientAddr &senderAddr) {
     if (verbose) {
       println("\033[35m[ROUTE] Channel {} from {}: {}\033[0m", channel,
               senderAddr.toString(), message);
     }
 
-    const auto &subscribers = channelSubs[channel];
-    for (const auto &subAddr : subscribers) {
-      if (subAddr == senderAddr)
-        continue; // Don't echo back
-
-      sendMessage(subAddr, message);
-    }
-
-    // Also broadcast to channel 0 subscribers if not already channel 0
-    if (channel != protocol::CHANNEL_BROADCAST) {
-      const auto &broadcastSubs = channelSubs[protocol::CHANNEL_BROADCAST];
-      for (const auto &subAddr : broadcastSubs) {
-        if (subAddr == senderAddr)
-          continue;
-        sendMessage(subAddr, message);
+    auto &stats = Metrics.channel(channel);
+    Routes.route(channel, [&](const ClientAddr &subAddr) {
+      auto *sub = getClient(subAddr);
+      if (sendMessage(subAddr, message)) {
+        stats.messagesOut.add();
+        stats.bytesOut.add(message.size());
+        if (sub) {
+          sub->metrics->messagesOut.add();
+          sub->metrics->bytesOut.add(message.size());
+        }
+      } else {
+        stats.drops.add();
+        if (sub) {
+          sub->metrics->drops.add();
+        }
       }
-    }
+    });
   }
 
-  void sendMessage(const ClientAddr &addr, string_view message) {
+  // Maps a publisher's message channel to a channel id in place. Topic
+  // publishers index their handshake topics.
+  static bool resolveChannel(const UdpClient &client, channel_t &channel) {
+    if (client.topics.empty())
+      return channel <= protocol::MAX_CHANNELS;
+    if (channel >= client.topics.size())
+      return false;
+    channel = client.topics[channel];
+    return true;
+  }
+
+  bool sendMessage(const ClientAddr &addr, string_view message) {
     ssize_t sent = ::sendto(sock, message.data(), message.size(), 0,
                             (const sockaddr *)&addr.addr, sizeof(addr.addr));
     if (sent < 0) {
@@ -292,10 +354,13 @@ public:
         println(stderr, "\033[31m[ERROR] Failed to send to {}: {}\033[0m",
                 addr.toString(), strerror(errno));
       }
-    } else if (verbose) {
+      return false;
+    }
+    if (verbose) {
       println("\033[34m[SEND] Sent {} bytes to {}\033[0m", sent,
               addr.toString());
     }
+    return true;
   }
 
   void run() {
@@ -357,9 +422,14 @@ public:
 
       // If it's a publisher, parse and route the message
       if (client->type == ClientType::PUBLISHER) {
-        if (auto msg = parseMessage(data)) {
-          auto [channel, content] = *msg;
-          routeMessage(channel, content, caddr);
+        auto msg = codec::parseMessage(data);
+        if (msg && resolveChannel(*client, msg->channel)) {
+          auto &channel = Metrics.channel(msg->channel);
+          channel.messagesIn.add();
+          channel.bytesIn.add(msg->content.size());
+          client->metrics->messagesIn.add();
+          client->metrics->bytesIn.add(msg->content.size());
+          routeMessage(msg->channel, msg->content, caddr);
         } else {
           if (verbose) {
             println(stderr,
@@ -368,8 +438,19 @@ public:
                     caddr.toString(), data);
           }
         }
+      } else if (auto control = codec::parseControl(data);
+                 control && !control->session) {
+        // Subscribers only send subscription changes
+        if (control->subscribe) {
+          subscribe(*client, control->channels, control->topics);
+        } else {
+          unsubscribe(*client, control->channels, control->topics);
+        }
+      } else if (verbose) {
+        println(stderr,
+                "\033[31m[ERROR] Invalid control message from {}: {}\033[0m",
+                caddr.toString(), data);
       }
-      // Subscribers just listen, they don't send regular messages
     }
 
     println("\n\033[33mShutting down broker...\033[0m");
@@ -387,6 +468,7 @@ void handleSignal(int signum) {
 int main(int argc, char *argv[]) {
   string host;
   uint16_t port;
+  string statsPath;
   bool verbose;
   bool help;
 
@@ -395,7 +477,9 @@ int main(int argc, char *argv[]) {
       "host", po::value<string>(&host)->default_value("127.0.0.1"),
       "Listen host address")(
       "port,p", po::value<uint16_t>(&port)->default_value(5000), "Listen port")(
-      "verbose,v", po::bool_switch(&verbose), "Enable verbose logging");
+      "verbose,v", po::bool_switch(&verbose), "Enable verbose logging")(
+      "stats-socket", po::value<string>(&statsPath),
+      "Serve Prometheus-format counters on this Unix socket path");
 
   po::variables_map vm;
   try {
@@ -426,6 +510,14 @@ int main(int argc, char *argv[]) {
   try {
     BrokerUDP broker(verbose);
     broker.setupSocket(host, port);
+
+    optional<StatsServer> stats;
+    if (!statsPath.empty()) {
+      stats.emplace(statsPath,
+                    [&broker] { return broker.metrics().render("udp"); });
+      println("\033[32mStats available on unix:{}\033[0m", statsPath);
+    }
+
     broker.run();
   } catch (const exception &e) {
     println(stderr, "\033[31mFatal error: {}\033[0m", e.what());
@@ -3,23 +3,22 @@
 
 import std;
 import MessageGenerator;
+import pubsub_uring;
+import pubsub_client;
 
 #include <cerrno>
 #include <csignal>
 #include <cstdio>
 #include <cstdlib>
 
-#include <arpa/inet.h>
-#include <sys/socket.h>
-#include <unistd.h>
-
 using namespace std;
 namespace po = boost::program_options;
 
-using socket_t = int;
+using namespace pubsub;
 
 namespace {
-constexpr string_view EXIT_MESSAGE = "[[EXIT]]\n";
+// Per-connection backlog before the rate mode starts dropping messages
+constexpr size_t MAX_PENDING_BYTES = 1 << 20;
 
 volatile sig_atomic_t STOP_REQUESTED = 0;
 
@@ -35,6 +34,152 @@ void handleSignal(int signum) {
     break;
   }
 }
+
+struct RateOptions {
+  uint32_t rate;
+  uint32_t burst;
+  uint32_t connections;
+  PacerMode pacer;
+  bool quiet;
+  bool stamp;
+  uint32_t stampId;
+};
+
+// Prints every message. Sends go through the ring as in rate mode, so with
+// no delay the frames generated while a send is in flight leave together in
+// the next one.
+int publishInteractive(Uring &ring, StreamPublisher &pub, uint8_t channel,
+                       uint32_t delayMs, bool quiet,
+                       misc::MessageGenerator &genMsg) {
+  array<char, 128> buffer;
+  bool woke = true;
+
+  while (!STOP_REQUESTED && !pub.failed()) {
+    const auto n = genMsg.generateMessage(buffer.data(), buffer.size());
+    if (!quiet) {
+      println("Generated [{} bytes]: {}", n, buffer.data());
+    }
+
+    // Queued with its channel prefix: [CH:N]message\n
+    pub.publish(channel, string_view(buffer.data(), n));
+    if (!pub.sending()) {
+      if (!quiet) {
+        println("Sending {} bytes", pub.pendingBytes());
+      }
+      pub.flush();
+    }
+
+    int ret = 0;
+    if (delayMs == 0) {
+      // Block only once the backlog is full
+      ret = pub.pendingBytes() >= MAX_PENDING_BYTES ? ring.waitAndComplete()
+                                                    : ring.pollAndComplete();
+    } else {
+      woke = false;
+      sleepFor(ring, chrono::milliseconds(delayMs), woke);
+      while (!woke && !STOP_REQUESTED && (ret >= 0 || ret == -EINTR)) {
+        ret = ring.waitAndComplete();
+      }
+    }
+    if (ret < 0 && ret != -EINTR) {
+      println(stderr, "\033[31mio_uring wait failed: {}\033[0m",
+              strerror(-ret));
+      return 1;
+    }
+  }
+
+  // Let queued frames reach the broker before saying goodbye
+  pub.drain(chrono::steady_clock::now() + chrono::seconds(2));
+
+  if (pub.failed()) {
+    println("\033[31mMessage sending failed - exiting...\033[0m");
+    return 1;
+  }
+  return 0;
+}
+
+// Open-loop load generator: every tick publishes `burst` frames round-robin
+// over the connections and the ring writes each connection's backlog with
+// a single send. Nothing is printed per message unless asked for.
+int publishAtRate(Uring &ring, deque<StreamPublisher> &pubs, uint8_t channel,
+                  const RateOptions &opts, PayloadSource &source) {
+  Pacer pacer(ring, static_cast<double>(opts.rate) / opts.burst, opts.pacer);
+
+  size_t next = 0;
+  uint64_t sent = 0, bytes = 0, dropped = 0;
+  uint64_t lastSent = 0, lastBytes = 0, lastDropped = 0;
+  auto lastReport = chrono::steady_clock::now();
+  size_t alive = pubs.size();
+
+  while (!STOP_REQUESTED && alive > 0) {
+    const uint64_t due = pacer.wait();
+    if (due == 0) {
+      println(stderr, "\033[31mPacer failed, exiting...\033[0m");
+      break;
+    }
+
+    // The ticks just handed out are ticked() - due onwards
+    const uint64_t firstTick = pacer.ticked() - due;
+    for (uint64_t i = 0; i < due * opts.burst; ++i) {
+      const size_t index = next;
+      auto &pub = pubs[next];
+      next = (next + 1) % pubs.size();
+      if (pub.failed())
+        continue;
+
+      if (pub.pendingBytes() >= MAX_PENDING_BYTES) {
+        ++dropped;
+        continue;
+      }
+
+      const auto payload =
+          source.next(index, pacer.deadline(firstTick + i / opts.burst));
+      if (!opts.quiet) {
+        println("Generated [{} bytes] on fd={}: {}", payload.size(), pub.fd(),
+                payload);
+      }
+
+      const size_t before = pub.pendingBytes();
+      if (!pub.publish(channel, payload)) {
+        ++dropped;
+        continue;
+      }
+      ++sent;
+      bytes += pub.pendingBytes() - before;
+    }
+
+    const auto now = chrono::steady_clock::now();
+    alive = 0;
+    for (auto &pub : pubs) {
+      pub.flushIfDue(now);
+      alive += pub.failed() ? 0 : 1;
+    }
+
+    if (now - lastReport >= chrono::seconds(1)) {
+      const double secs = chrono::duration<double>(now - lastReport).count();
+      println("\033[34m[STATS] {:.0f} msg/s, {:.2f} MB/s, dropped {:.0f} "
+              "msg/s, total sent {}\033[0m",
+              (sent - lastSent) / secs, (bytes - lastBytes) / secs / 1e6,
+              (dropped - lastDropped) / secs, sent);
+      lastSent = sent;
+      lastBytes = bytes;
+      lastDropped = dropped;
+      lastReport = now;
+    }
+  }
+
+  // Let queued frames reach the broker before saying goodbye
+  const auto deadline = chrono::steady_clock::now() + chrono::seconds(2);
+  for (auto &pub : pubs) {
+    pub.flush();
+  }
+  for (auto &pub : pubs) {
+    pub.drain(deadline);
+  }
+
+  println("\nSent {} messages ({} bytes), dropped {}", sent, bytes, dropped);
+  return alive == pubs.size() ? 0 : 1;
+}
 } // namespace
 
 int main(int argc, char *argv[]) {
@@ -42,7 +187,16 @@ int main(int argc, char *argv[]) {
   uint16_t port;
   uint32_t seed;
   uint32_t delayMs;
-  uint8_t channel;
+  uint32_t channelArg;
+  string topic;
+  string pacerName;
+  RateOptions rateOpts;
+  PublisherOptions pubOpts;
+  uint32_t batchUs;
+  string corpusPath;
+  string unixPath;
+  string seqpacketPath;
+  string brokerList;
   bool help;
 
   po::options_description desc("Publisher options");
@@ -54,9 +208,52 @@ int main(int argc, char *argv[]) {
                      "Message generator seed (0 = random)")(
       "delay,d", po::value<uint32_t>(&delayMs)->default_value(500),
       "Delay between messages in milliseconds")(
-      "channel,c", po::value<uint8_t>(&channel)->default_value(0),
-      "Channel to publish on (0-255, default=0 broadcast)");
+      "channel,c", po::value<uint32_t>(&channelArg)->default_value(0),
+      "Channel to publish on (0-255, default=0 broadcast)")(
+      "topic,t", po::value<string>(&topic),
+      "Publish on a topic such as prices.eu.FX.EURUSD instead of a channel")(
+      "rate,r", po::value<uint32_t>(&rateOpts.rate)->default_value(0),
+      "Total messages per second over all connections (0 = use --delay)")(
+      "burst,b", po::value<uint32_t>(&rateOpts.burst)->default_value(1),
+      "Messages generated per pacer tick")(
+      "connections,n",
+      po::value<uint32_t>(&rateOpts.connections)->default_value(1),
+      "Publisher connections multiplexed on one io_uring")(
+      "pacer", po::value<string>(&pacerName)->default_value("spin"),
+      "Rate pacer: spin (precise, uses a core) or timer")(
+      "quiet,q", po::bool_switch(&rateOpts.quiet),
+      "Don't print every generated message")(
+      "corpus", po::value<string>(&corpusPath),
+      "Replay messages from a gen_corpus file instead of generating them "
+      "(needs --rate)")(
+      "stamp", po::bool_switch(&rateOpts.stamp),
+      "Start every payload with a latency stamp: publisher id, sequence and "
+      "the pacer's intended send time (needs --rate)")(
+      "stamp-id", po::value<uint32_t>(&rateOpts.stampId)->default_value(0),
+      "Publisher id of the first connection's stamps, the others count up "
+      "from it")(
+      "batch-bytes",
+      po::value<uint32_t>(&pubOpts.batchBytes)->default_value(0),
+      "Buffer frames per connection until this many bytes are queued (0 = "
+      "write every pacer tick)")(
+      "batch-us", po::value<uint32_t>(&batchUs)->default_value(200),
+      "Longest a buffered frame waits for --batch-bytes, in microseconds")(
+      "nodelay", po::bool_switch(&pubOpts.noDelay),
+      "Set TCP_NODELAY, each write leaves immediately")(
+      "cork", po::bool_switch(&pubOpts.cork),
+      "Set TCP_CORK and uncork after every write, so segments go out full "
+      "(rate mode)")(
+      "unix", po::value<string>(&unixPath),
+      "Connect to broker_tcp --unix at this path instead of over TCP")(
+      "seqpacket", po::value<string>(&seqpacketPath),
+      "Connect to broker_tcp --seqpacket at this path, one frame per "
+      "record")(
+      "brokers", po::value<string>(&brokerList),
+      "Partition channels over this pool of brokers (HOST:PORT or "
+      "unix:PATH, comma-separated) and publish to the one that owns the "
+      "channel or topic");
 
+  vector<Endpoint> pool;
   po::variables_map vm;
   try {
     po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -65,12 +262,67 @@ int main(int argc, char *argv[]) {
       cout << desc << '\n';
       return 0;
     }
+    if (channelArg > protocol::MAX_CHANNELS) {
+      throw po::validation_error(po::validation_error::invalid_option_value,
+                                 "channel");
+    }
+    if (!topic.empty() && !codec::isValidTopic(topic)) {
+      throw po::validation_error(po::validation_error::invalid_option_value,
+                                 "topic");
+    }
+    if (pacerName != "spin" && pacerName != "timer") {
+      throw po::validation_error(po::validation_error::invalid_option_value,
+                                 "pacer");
+    }
+    if (rateOpts.burst == 0 || rateOpts.connections == 0) {
+      throw po::error("--burst and --connections must be at least 1");
+    }
+    if (!corpusPath.empty() && rateOpts.rate == 0) {
+      throw po::error("--corpus needs --rate");
+    }
+    if (rateOpts.stamp && rateOpts.rate == 0) {
+      throw po::error("--stamp needs --rate");
+    }
+    if (pubOpts.noDelay && pubOpts.cork) {
+      throw po::error("--nodelay and --cork are mutually exclusive");
+    }
+    if (!unixPath.empty() && !seqpacketPath.empty()) {
+      throw po::error("--unix and --seqpacket are mutually exclusive");
+    }
+    if ((pubOpts.noDelay || pubOpts.cork) &&
+        !(unixPath.empty() && seqpacketPath.empty())) {
+      throw po::error("--nodelay and --cork only apply to TCP");
+    }
+    if (!brokerList.empty()) {
+      if (!unixPath.empty() || !seqpacketPath.empty()) {
+        throw po::error("--brokers excludes --unix and --seqpacket");
+      }
+      try {
+        pool = parseEndpoints(brokerList);
+      } catch (const runtime_error &e) {
+        throw po::error(e.what());
+      }
+    }
   } catch (const po::error &e) {
     println(stderr, "\033[31mError parsing arguments: {}\033[0m", e.what());
     cout << desc << '\n';
     return 1;
   }
 
+  // A topic publisher's messages carry the topic's index in its handshake
+  const auto channel =
+      topic.empty() ? static_cast<uint8_t>(channelArg) : uint8_t{0};
+  rateOpts.pacer = pacerName == "timer" ? PacerMode::TIMER : PacerMode::SPIN;
+
+  // More than one connection only makes sense paced by the ring
+  if (rateOpts.rate == 0 && rateOpts.connections > 1) {
+    if (delayMs == 0) {
+      println(stderr, "\033[31m--connections needs --rate or --delay\033[0m");
+      return 1;
+    }
+    rateOpts.rate = max<uint32_t>(1, rateOpts.connections * 1000 / delayMs);
+  }
+
   print(R"(▄▄▄▄  █  ▐▌▗▖       █  ▐▌ ▄▄▄ ▄ ▄▄▄▄
 █   █ ▀▄▄▞▘▐▌       ▀▄▄▞▘█    ▄ █   █
 █▄▄▄▀      ▐▛▀▚▖         █    █ █   █
@@ -80,102 +332,94 @@ int main(int argc, char *argv[]) {
                                    ▐▙▄▞▘)");
 
   println("\n\n--    Press ctrl+c to exit...    --");
-  println("Connecting to {}:{}", host, port);
-  println("Publishing on channel: {}", channel);
+  Endpoint broker{host, port, unixPath.empty() ? seqpacketPath : unixPath,
+                  !seqpacketPath.empty()};
+  if (!pool.empty()) {
+    const size_t owner = topic.empty() ? ownerOf(channel_t{channel}, pool)
+                                       : ownerOf(topic, pool);
+    broker = pool[owner];
+    println("Owned by broker {} of {} in the pool", owner + 1, pool.size());
+  }
+  const auto endpoint = broker.describe();
+  println("Connecting to {}", endpoint);
+  if (topic.empty()) {
+    println("Publishing on channel: {}", channel);
+  } else {
+    println("Publishing on topic: {}", topic);
+  }
   if (seed != 0) {
     println("Using seed: {}", seed);
   }
-  println("Message delay: {}ms\n", delayMs);
+  if (rateOpts.rate != 0) {
+    println("Rate: {} msg/s in bursts of {} over {} connection(s), {} pacer",
+            rateOpts.rate, rateOpts.burst, rateOpts.connections, pacerName);
+    if (pubOpts.batchBytes != 0) {
+      println("Batching: {} bytes or {}us", pubOpts.batchBytes, batchUs);
+    }
+    println("");
+  } else {
+    println("Message delay: {}ms\n", delayMs);
+  }
 
   signal(SIGINT, handleSignal);
   signal(SIGPIPE, handleSignal);
 
-  auto genMsg = misc::makeMessageGenerator(
-      seed == 0 ? nullopt : optional<uint32_t>{seed});
-  array<char, 128> buffer;
+  const auto seedOpt = seed == 0 ? nullopt : optional<uint32_t>{seed};
+  auto genMsg = misc::makeMessageGenerator(seedOpt);
+  // Rate mode uses the table-driven generator so it is not the bottleneck
+  misc::FastMessageGenerator fastGen(seedOpt);
 
-  socket_t sock = ::socket(AF_INET, SOCK_STREAM, 0);
-  if (sock < 0) {
-    println(stderr, "\033[31mSocket creation failed: {}\033[0m",
-            strerror(errno));
-    return EXIT_FAILURE;
+  optional<misc::MessageCorpus> corpus;
+  if (!corpusPath.empty()) {
+    try {
+      corpus.emplace(corpusPath);
+    } catch (const exception &e) {
+      println(stderr, "\033[31m{}\033[0m", e.what());
+      return 1;
+    }
+    println("Replaying corpus {} ({} messages, seed {})\n", corpusPath,
+            corpus->size(), corpus->seed());
   }
-
-  sockaddr_in serverAddr{};
-  serverAddr.sin_family = AF_INET;
-  serverAddr.sin_port = ::htons(port);
-  if (::inet_pton(AF_INET, host.c_str(), &serverAddr.sin_addr) <= 0) {
-    println(stderr, "\033[31mInvalid address: {}\033[0m", strerror(errno));
-    ::close(sock);
-    return 1;
+  PayloadSource source(fastGen, corpus ? &*corpus : nullptr);
+  if (rateOpts.stamp) {
+    source.stampAs(rateOpts.stampId);
   }
 
-  if (::connect(sock, (sockaddr *)&serverAddr, sizeof(serverAddr)) < 0) {
-    println(stderr, "\033[31mConnection failed: {}\033[0m", strerror(errno));
-    ::close(sock);
-    return 1;
-  }
+  pubOpts.batchDelay = chrono::microseconds(batchUs);
+  pubOpts.maxPendingBytes = MAX_PENDING_BYTES;
+  const auto handshake = topic.empty() ? codec::makePubHandshake(channel)
+                                       : codec::makePubHandshake(topic);
+  int status = 0;
+  try {
+    Uring ring(rateOpts.rate == 0
+                   ? 64
+                   : max<unsigned>(256, bit_ceil(rateOpts.connections * 2)));
+    deque<StreamPublisher> pubs;
+    for (uint32_t i = 0; i < rateOpts.connections; ++i) {
+      pubs.emplace_back(ring, broker, handshake, pubOpts);
+    }
 
-  println("\033[32mConnected to broker at {}:{}\033[0m", host, port);
+    println("\033[32mConnected to broker at {}\033[0m", endpoint);
+    println("\033[32mHandshake sent: {}\033[0m", handshake);
 
-  // Send handshake to register as publisher
-  const auto handshake = format("[[PUB:{}]]", channel);
-  const auto handshakeSent =
-      ::send(sock, handshake.data(), handshake.size(), 0);
-  if (handshakeSent < 0) {
-    println(stderr, "\033[31mFailed to send handshake: {}\033[0m",
-            strerror(errno));
-    ::close(sock);
-    return 1;
-  }
-  println("\033[32mHandshake sent: {}\033[0m", handshake);
+    status = rateOpts.rate == 0
+                 ? publishInteractive(ring, pubs.front(), channel, delayMs,
+                                      rateOpts.quiet, genMsg)
+                 : publishAtRate(ring, pubs, channel, rateOpts, source);
 
-  while (!STOP_REQUESTED) {
-    const auto n = genMsg.generateMessage(buffer.data(), buffer.size());
-    println("Generated [{} bytes]: {}", n, buffer.data());
-
-    // Format message with channel prefix: [CH:N]message\n
-    string formattedMsg =
-        format("[CH:{}]{}\n", channel, string_view(buffer.data(), n));
-
-    uint32_t totalSent = 0;
-    bool sendError = false;
-
-    while (totalSent < formattedMsg.size() && !sendError) {
-      auto sent = ::send(sock, formattedMsg.data() + totalSent,
-                         formattedMsg.size() - totalSent, 0);
-      if (sent < 0) {
-        println(stderr, "\033[31mSend failed: {}\033[0m", strerror(errno));
-        sendError = true;
-      } else if (sent == 0) {
-        println(stderr, "\033[31mConnection closed by peer during send\033[0m");
-        sendError = true;
-      } else {
-        totalSent += sent;
-        println("Sent {} bytes ({}/{} total)", sent, totalSent,
-                formattedMsg.size());
+    println("\n\033[33mSending EXIT message...\033[0m");
+    for (auto &pub : pubs) {
+      if (!pub.sendExit()) {
+        println(stderr, "\033[31mFailed to send EXIT message: {}\033[0m",
+                strerror(errno));
       }
     }
-    if (sendError) {
-      println("\033[31mMessage sending failed - exiting...\033[0m");
-      break;
-    }
-
-    if (delayMs != 0)
-      this_thread::sleep_for(chrono::milliseconds(delayMs));
-  }
-
-  println("\n\033[33mSending EXIT message...\033[0m");
-  const auto exitSent =
-      ::send(sock, EXIT_MESSAGE.data(), EXIT_MESSAGE.size(), 0);
-  if (exitSent < 0) {
-    println(stderr, "\033[31mFailed to send EXIT message: {}\033[0m",
-            strerror(errno));
-  } else {
     println("\033[32mEXIT message sent\033[0m");
+  } catch (const exception &e) {
+    println(stderr, "\033[31mFatal error: {}\033[0m", e.what());
+    status = 1;
   }
 
-  ::close(sock);
   println("\nExiting program...");
-  return 0;
+  return status;
 }
@@ -3,25 +3,20 @@
 
 import std;
 import MessageGenerator;
+import pubsub_uring;
+import pubsub_client;
 
 #include <cerrno>
 #include <csignal>
 #include <cstdio>
 #include <cstdlib>
 
-#include <arpa/inet.h>
-#include <sys/socket.h>
-#include <unistd.h>
-
 using namespace std;
 namespace po = boost::program_options;
 
-using socket_t = int;
+using namespace pubsub;
 
 namespace {
-constexpr string_view EXIT_MESSAGE = "[[EXIT]]";
-constexpr size_t MAX_UDP_PAYLOAD = 1400;
-
 volatile sig_atomic_t STOP_REQUESTED = 0;
 
 void handleSignal(int signum) {
@@ -29,6 +24,152 @@ void handleSignal(int signum) {
     STOP_REQUESTED = 1;
   }
 }
+
+struct RateOptions {
+  uint32_t rate;
+  uint32_t burst;
+  uint32_t connections;
+  PacerMode pacer;
+  bool quiet;
+  bool stamp;
+  uint32_t stampId;
+};
+
+// Prints every message. Each datagram is its own send SQE, so with no delay
+// up to MAX_INFLIGHT of them leave in one submission.
+int publishInteractive(Uring &ring, DatagramPublisher &pub, uint8_t channel,
+                       uint32_t delayMs, bool quiet,
+                       misc::MessageGenerator &genMsg) {
+  array<char, 128> buffer;
+  bool woke = true;
+
+  while (!STOP_REQUESTED && pub.errors() == 0) {
+    int ret = 0;
+    if (!pub.ready()) {
+      // Every datagram is still in flight
+      ret = ring.waitAndComplete();
+    } else {
+      const auto n = genMsg.generateMessage(buffer.data(), buffer.size());
+      if (!quiet) {
+        println("Generated [{} bytes]: {}", n, buffer.data());
+      }
+
+      // Sent with its channel prefix: [CH:N]message
+      const uint64_t before = pub.bytesQueued();
+      const auto result = pub.publish(channel, string_view(buffer.data(), n));
+      if (result == DatagramPublisher::Result::TOO_LARGE) {
+        println(stderr, "\033[31mMessage too large for UDP (> {} bytes), "
+                        "skipping\033[0m",
+                MAX_DATAGRAM);
+        continue;
+      }
+      if (result != DatagramPublisher::Result::QUEUED) {
+        println(stderr, "\033[31mSubmission queue full\033[0m");
+        return 1;
+      }
+      if (!quiet) {
+        println("Sending {} bytes via UDP datagram",
+                pub.bytesQueued() - before);
+      }
+
+      if (delayMs == 0) {
+        ret = ring.pollAndComplete();
+      } else {
+        woke = false;
+        sleepFor(ring, chrono::milliseconds(delayMs), woke);
+        while (!woke && !STOP_REQUESTED && (ret >= 0 || ret == -EINTR)) {
+          ret = ring.waitAndComplete();
+        }
+      }
+    }
+
+    if (ret < 0 && ret != -EINTR) {
+      println(stderr, "\033[31mio_uring wait failed: {}\033[0m",
+              strerror(-ret));
+      return 1;
+    }
+  }
+
+  if (pub.errors() != 0) {
+    println(stderr, "\033[31m{} send(s) failed - exiting...\033[0m",
+            pub.errors());
+    return 1;
+  }
+  return 0;
+}
+
+// Open-loop load generator: every tick sends `burst` datagrams round-robin
+// over the sockets, each as its own SQE on one ring.
+int publishAtRate(Uring &ring, deque<DatagramPublisher> &pubs,
+                  uint8_t channel, const RateOptions &opts,
+                  PayloadSource &source) {
+  Pacer pacer(ring, static_cast<double>(opts.rate) / opts.burst, opts.pacer);
+
+  size_t next = 0;
+  uint64_t sent = 0, bytes = 0, dropped = 0;
+  uint64_t lastSent = 0, lastBytes = 0, lastDropped = 0;
+  auto lastReport = chrono::steady_clock::now();
+  auto errors = [&] {
+    uint64_t total = 0;
+    for (const auto &pub : pubs) {
+      total += pub.errors();
+    }
+    return total;
+  };
+
+  while (!STOP_REQUESTED) {
+    const uint64_t due = pacer.wait();
+    if (due == 0) {
+      println(stderr, "\033[31mPacer failed, exiting...\033[0m");
+      break;
+    }
+
+    // The ticks just handed out are ticked() - due onwards
+    const uint64_t firstTick = pacer.ticked() - due;
+    for (uint64_t i = 0; i < due * opts.burst; ++i) {
+      const size_t index = next;
+      auto &pub = pubs[next];
+      next = (next + 1) % pubs.size();
+
+      if (!pub.ready()) {
+        ++dropped;
+        continue;
+      }
+
+      const auto payload =
+          source.next(index, pacer.deadline(firstTick + i / opts.burst));
+      if (!opts.quiet) {
+        println("Generated [{} bytes] on fd={}: {}", payload.size(), pub.fd(),
+                payload);
+      }
+
+      const uint64_t before = pub.bytesQueued();
+      if (pub.publish(channel, payload) != DatagramPublisher::Result::QUEUED) {
+        ++dropped;
+        continue;
+      }
+      ++sent;
+      bytes += pub.bytesQueued() - before;
+    }
+
+    const auto now = chrono::steady_clock::now();
+    if (now - lastReport >= chrono::seconds(1)) {
+      const double secs = chrono::duration<double>(now - lastReport).count();
+      println("\033[34m[STATS] {:.0f} msg/s, {:.2f} MB/s, dropped {:.0f} "
+              "msg/s, send errors {}\033[0m",
+              (sent - lastSent) / secs, (bytes - lastBytes) / secs / 1e6,
+              (dropped - lastDropped) / secs, errors());
+      lastSent = sent;
+      lastBytes = bytes;
+      lastDropped = dropped;
+      lastReport = now;
+    }
+  }
+
+  println("\nSent {} datagrams ({} bytes), dropped {}, send errors {}", sent,
+          bytes, dropped, errors());
+  return 0;
+}
 } // namespace
 
 int main(int argc, char *argv[]) {
@@ -36,7 +177,11 @@ int main(int argc, char *argv[]) {
   uint16_t port;
   uint32_t seed;
   uint32_t delayMs;
-  uint8_t channel;
+  uint32_t channelArg;
+  string topic;
+  string pacerName;
+  RateOptions rateOpts;
+  string corpusPath;
   bool help;
 
   po::options_description desc("UDP Publisher options");
@@ -48,8 +193,30 @@ int main(int argc, char *argv[]) {
                      "Message generator seed (0 = random)")(
       "delay,d", po::value<uint32_t>(&delayMs)->default_value(500),
       "Delay between messages in milliseconds")(
-      "channel,c", po::value<uint8_t>(&channel)->default_value(0),
-      "Channel to publish on (0-255, default=0 broadcast)");
+      "channel,c", po::value<uint32_t>(&channelArg)->default_value(0),
+      "Channel to publish on (0-255, default=0 broadcast)")(
+      "topic,t", po::value<string>(&topic),
+      "Publish on a topic such as prices.eu.FX.EURUSD instead of a channel")(
+      "rate,r", po::value<uint32_t>(&rateOpts.rate)->default_value(0),
+      "Total datagrams per second over all connections (0 = use --delay)")(
+      "burst,b", po::value<uint32_t>(&rateOpts.burst)->default_value(1),
+      "Datagrams generated per pacer tick")(
+      "connections,n",
+      po::value<uint32_t>(&rateOpts.connections)->default_value(1),
+      "Publisher sockets multiplexed on one io_uring")(
+      "pacer", po::value<string>(&pacerName)->default_value("spin"),
+      "Rate pacer: spin (precise, uses a core) or timer")(
+      "quiet,q", po::bool_switch(&rateOpts.quiet),
+      "Don't print every generated message")(
+      "corpus", po::value<string>(&corpusPath),
+      "Replay messages from a gen_corpus file instead of generating them "
+      "(needs --rate)")(
+      "stamp", po::bool_switch(&rateOpts.stamp),
+      "Start every payload with a latency stamp: publisher id, sequence and "
+      "the pacer's intended send time (needs --rate)")(
+      "stamp-id", po::value<uint32_t>(&rateOpts.stampId)->default_value(0),
+      "Publisher id of the first connection's stamps, the others count up "
+      "from it");
 
   po::variables_map vm;
   try {
@@ -59,12 +226,47 @@ int main(int argc, char *argv[]) {
       cout << desc << '\n';
       return 0;
     }
+    if (channelArg > protocol::MAX_CHANNELS) {
+      throw po::validation_error(po::validation_error::invalid_option_value,
+                                 "channel");
+    }
+    if (!topic.empty() && !codec::isValidTopic(topic)) {
+      throw po::validation_error(po::validation_error::invalid_option_value,
+                                 "topic");
+    }
+    if (pacerName != "spin" && pacerName != "timer") {
+      throw po::validation_error(po::validation_error::invalid_option_value,
+                                 "pacer");
+    }
+    if (rateOpts.burst == 0 || rateOpts.connections == 0) {
+      throw po::error("--burst and --connections must be at least 1");
+    }
+    if (!corpusPath.empty() && rateOpts.rate == 0) {
+      throw po::error("--corpus needs --rate");
+    }
+    if (rateOpts.stamp && rateOpts.rate == 0) {
+      throw po::error("--stamp needs --rate");
+    }
   } catch (const po::error &e) {
     println(stderr, "\033[31mError parsing arguments: {}\033[0m", e.what());
     cout << desc << '\n';
     return 1;
   }
 
+  // A topic publisher's messages carry the topic's index in its handshake
+  const auto channel =
+      topic.empty() ? static_cast<uint8_t>(channelArg) : uint8_t{0};
+  rateOpts.pacer = pacerName == "timer" ? PacerMode::TIMER : PacerMode::SPIN;
+
+  // More than one socket only makes sense paced by the ring
+  if (rateOpts.rate == 0 && rateOpts.connections > 1) {
+    if (delayMs == 0) {
+      println(stderr, "\033[31m--connections needs --rate or --delay\033[0m");
+      return 1;
+    }
+    rateOpts.rate = max<uint32_t>(1, rateOpts.connections * 1000 / delayMs);
+  }
+
   print(R"(▄▄▄▄  █  ▐▌▗▖       █  ▐▌ ▄▄▄ ▄ ▄▄▄▄   █  ▐▌▗▖   ▄▄▄
 █   █ ▀▄▄▞▘▐▌       ▀▄▄▞▘█    ▄ █   █  ▀▄▄▞▘▐▌  █   █
 █▄▄▄▀      ▐▛▀▚▖         █    █ █   █       ▐▛▀▚▖█   █
@@ -75,87 +277,82 @@ int main(int argc, char *argv[]) {
 
   println("\n\n--    Press ctrl+c to exit...    --");
   println("Target broker: {}:{}", host, port);
-  println("Publishing on channel: {}", channel);
+  if (topic.empty()) {
+    println("Publishing on channel: {}", channel);
+  } else {
+    println("Publishing on topic: {}", topic);
+  }
   if (seed != 0) {
     println("Using seed: {}", seed);
   }
-  println("Message delay: {}ms", delayMs);
+  if (rateOpts.rate != 0) {
+    println("Rate: {} msg/s in bursts of {} over {} socket(s), {} pacer",
+            rateOpts.rate, rateOpts.burst, rateOpts.connections, pacerName);
+  } else {
+    println("Message delay: {}ms", delayMs);
+  }
   println("Protocol: UDP (datagram-based)\n");
 
   signal(SIGINT, handleSignal);
 
-  auto genMsg = misc::makeMessageGenerator(
-      seed == 0 ? nullopt : optional<uint32_t>{seed});
-  array<char, 128> buffer;
-
-  socket_t sock = ::socket(AF_INET, SOCK_DGRAM, 0);
-  if (sock < 0) {
-    println(stderr, "\033[31mSocket creation failed: {}\033[0m",
-            strerror(errno));
-    return EXIT_FAILURE;
-  }
+  const auto seedOpt = seed == 0 ? nullopt : optional<uint32_t>{seed};
+  auto genMsg = misc::makeMessageGenerator(seedOpt);
+  // Rate mode uses the table-driven generator so it is not the bottleneck
+  misc::FastMessageGenerator fastGen(seedOpt);
 
-  sockaddr_in brokerAddr{};
-  brokerAddr.sin_family = AF_INET;
-  brokerAddr.sin_port = ::htons(port);
-  if (::inet_pton(AF_INET, host.c_str(), &brokerAddr.sin_addr) <= 0) {
-    println(stderr, "\033[31mInvalid address: {}\033[0m", strerror(errno));
-    ::close(sock);
-    return 1;
+  optional<misc::MessageCorpus> corpus;
+  if (!corpusPath.empty()) {
+    try {
+      corpus.emplace(corpusPath);
+    } catch (const exception &e) {
+      println(stderr, "\033[31m{}\033[0m", e.what());
+      return 1;
+    }
+    println("Replaying corpus {} ({} messages, seed {})\n", corpusPath,
+            corpus->size(), corpus->seed());
   }
-
-  // Send handshake datagram to register as publisher
-  const auto handshake = format("[[PUB:{}]]", channel);
-  const auto handshakeSent =
-      ::sendto(sock, handshake.data(), handshake.size(), 0,
-               (sockaddr *)&brokerAddr, sizeof(brokerAddr));
-  if (handshakeSent < 0) {
-    println(stderr, "\033[31mFailed to send handshake: {}\033[0m",
-            strerror(errno));
-    ::close(sock);
-    return 1;
+  PayloadSource source(fastGen, corpus ? &*corpus : nullptr);
+  if (rateOpts.stamp) {
+    source.stampAs(rateOpts.stampId);
   }
-  println("\033[32mHandshake sent: {}\033[0m", handshake);
 
-  while (!STOP_REQUESTED) {
-    const auto n = genMsg.generateMessage(buffer.data(), buffer.size());
-    println("Generated [{} bytes]: {}", n, buffer.data());
-
-    // Format message with channel prefix: [CH:N]message
-    string formattedMsg =
-        format("[CH:{}]{}", channel, string_view(buffer.data(), n));
-
-    if (formattedMsg.size() > MAX_UDP_PAYLOAD) {
-      println(stderr, "\033[31mMessage too large for UDP ({} > {} bytes), "
-                      "truncating\033[0m",
-              formattedMsg.size(), MAX_UDP_PAYLOAD);
-      formattedMsg.resize(MAX_UDP_PAYLOAD);
-    }
-
-    auto sent = ::sendto(sock, formattedMsg.data(), formattedMsg.size(), 0,
-                         (sockaddr *)&brokerAddr, sizeof(brokerAddr));
-    if (sent < 0) {
-      println(stderr, "\033[31mSend failed: {}\033[0m", strerror(errno));
-      break;
-    } else {
-      println("Sent {} bytes via UDP datagram", sent);
+  // Send handshake datagram to register each socket as a publisher
+  Endpoint broker;
+  broker.host = host;
+  broker.port = port;
+  const auto handshake = topic.empty() ? codec::makePubHandshake(channel)
+                                       : codec::makePubHandshake(topic);
+  int status = 0;
+  try {
+    const size_t inflight =
+        rateOpts.connections * DatagramPublisher::MAX_INFLIGHT;
+    Uring ring(rateOpts.rate == 0 ? 64
+                                  : max<unsigned>(256, bit_ceil(inflight)));
+    // Destroyed before the ring, each waits for its sends in flight
+    deque<DatagramPublisher> pubs;
+    for (uint32_t i = 0; i < rateOpts.connections; ++i) {
+      pubs.emplace_back(ring, broker, handshake);
     }
+    println("\033[32mHandshake sent: {}\033[0m", handshake);
 
-    if (delayMs != 0)
-      this_thread::sleep_for(chrono::milliseconds(delayMs));
-  }
+    status = rateOpts.rate == 0
+                 ? publishInteractive(ring, pubs.front(), channel, delayMs,
+                                      rateOpts.quiet, genMsg)
+                 : publishAtRate(ring, pubs, channel, rateOpts, source);
 
-  println("\n\033[33mSending EXIT message...\033[0m");
-  const auto exitSent = ::sendto(sock, EXIT_MESSAGE.data(), EXIT_MESSAGE.size(),
-                                  0, (sockaddr *)&brokerAddr, sizeof(brokerAddr));
-  if (exitSent < 0) {
-    println(stderr, "\033[31mFailed to send EXIT message: {}\033[0m",
-            strerror(errno));
-  } else {
+    println("\n\033[33mSending EXIT message...\033[0m");
+    for (auto &pub : pubs) {
+      if (!pub.sendExit()) {
+        println(stderr, "\033[31mFailed to send EXIT message: {}\033[0m",
+                strerror(errno));
+      }
+    }
     println("\033[32mEXIT message sent\033[0m");
+  } catch (const exception &e) {
+    println(stderr, "\033[31mFatal error: {}\033[0m", e.what());
+    status = 1;
   }
 
-  ::close(sock);
   println("\nExiting program...");
-  return 0;
+  return status;
 }
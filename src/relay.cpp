@@ -0,0 +1,277 @@
+#include <boost/program_options.hpp>
+
+import std;
+import pubsub_uring;
+import pubsub_client;
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <poll.h>
+#include <unistd.h>
+
+using namespace std;
+namespace po = boost::program_options;
+
+using namespace pubsub;
+
+namespace {
+// Provided buffers for the upstream connection, on the broker's ring
+constexpr uint16_t RECV_GROUP = 0;
+constexpr uint32_t RECV_BUFFER_COUNT = 256;
+constexpr uint32_t RECV_BUFFER_SIZE = 16 * 1024;
+
+// How often a lost upstream connection is checked for
+constexpr chrono::seconds WATCH_INTERVAL{1};
+
+// The broker run() is driving, for the signal handler
+atomic<Broker *> activeBroker{nullptr};
+
+void handleSignal(int signum) {
+  if (Broker *broker = activeBroker.load(); signum == SIGINT && broker) {
+    broker->stop();
+  }
+}
+
+// The relay's side of the remote broker: one [[MUX]] connection, with a
+// session per channel some local subscriber wants and the channel number as
+// its id. The [S:..] header of a delivery then names its channel. Everything
+// runs on the local broker's ring, the connect included, so upstream
+// messages are routed the moment they arrive.
+class Upstream {
+public:
+  Upstream(Broker &broker, Endpoint endpoint)
+      : broker(broker), endpoint(std::move(endpoint)),
+        buffers(broker.ring(), RECV_GROUP, RECV_BUFFER_COUNT,
+                RECV_BUFFER_SIZE) {}
+
+  Upstream(const Upstream &) = delete;
+  Upstream &operator=(const Upstream &) = delete;
+
+  // The broker's interest callback. Changes wait for the connection if it
+  // is not up yet.
+  void update(const ChannelSet &interest) {
+    wanted = interest;
+    if (link) {
+      sync();
+    } else if (!connecting && wanted.any()) {
+      connect();
+    }
+  }
+
+  // Stops the relay if the upstream connection goes away; its local
+  // subscribers would wait forever. Retries a connect that failed.
+  Task watch() {
+    while (true) {
+      if (co_await broker.ring().timeout(WATCH_INTERVAL) == -EBUSY) {
+        co_await broker.ring().yield();
+        continue;
+      }
+      if (link && link->closed()) {
+        println(stderr, "\033[31mLost the upstream connection\033[0m");
+        broker.stop();
+        co_return;
+      }
+      if (!link && !connecting && wanted.any()) {
+        connect();
+      }
+    }
+  }
+
+  void close() {
+    if (link) {
+      link->sendExit();
+    }
+  }
+
+private:
+  Task connect() {
+    connecting = true;
+    string error;
+    try {
+      socket_t fd = startConnect(endpoint);
+      int res = co_await broker.ring().poll(fd, POLLOUT);
+      if (res >= 0) {
+        res = finishConnect(fd);
+      }
+      if (res == 0) {
+        // Closes fd itself if the handshake fails
+        link = make_unique<StreamSubscriber>(broker.ring(), buffers, fd,
+                                             protocol::HANDSHAKE_MUX);
+      } else {
+        ::close(fd);
+        error = strerror(-res);
+      }
+    } catch (const exception &e) {
+      error = e.what();
+    }
+    connecting = false;
+    if (!link) {
+      // Tried again by watch()
+      println(stderr, "\033[31mUpstream {}: {}\033[0m", endpoint.describe(),
+              error);
+      co_return;
+    }
+
+    println("\033[32m[UPSTREAM] Connected to {}\033[0m", endpoint.describe());
+    link->receive([this](Frame frame, uint64_t) {
+      const auto line = frameText(frame);
+      if (line.starts_with(protocol::EXIT_MSG))
+        return false;
+      sessions.clear();
+      const auto message = codec::parseSessions(line, sessions);
+      if (!message)
+        return true;
+      for (uint32_t session : sessions) {
+        if (session < protocol::CHANNEL_COUNT) {
+          broker.forward(static_cast<channel_t>(session), *message);
+        }
+      }
+      return true;
+    });
+    sync();
+  }
+
+  // Opens a session for every newly wanted channel and closes the ones no
+  // longer wanted, in one write
+  void sync() {
+    string frames;
+    for (channel_t ch = 1; ch < protocol::CHANNEL_COUNT; ++ch) {
+      if (wanted.test(ch) == subscribed.test(ch))
+        continue;
+
+      frames += wanted.test(ch)
+                    ? codec::makeSessionControl(true, ch, to_string(ch))
+                    : codec::makeSessionControl(false, ch, "");
+      subscribed.set(ch, wanted.test(ch));
+      println("\033[33m[UPSTREAM] {} channel {}\033[0m",
+              wanted.test(ch) ? "Subscribed to" : "Unsubscribed from", ch);
+    }
+    if (!frames.empty()) {
+      link->sendControl(std::move(frames));
+    }
+  }
+
+  Broker &broker;
+  Endpoint endpoint;
+  BufferRing buffers;
+  unique_ptr<StreamSubscriber> link;
+  bool connecting = false;
+  // Channels local subscribers want, and those with an upstream session
+  ChannelSet wanted;
+  ChannelSet subscribed;
+  // Reused for every delivery's [S:..] header
+  vector<uint32_t> sessions;
+};
+} // namespace
+
+int main(int argc, char *argv[]) {
+  string upstreamHost;
+  uint16_t upstreamPort;
+  string upstreamUnix;
+  string host;
+  uint16_t port;
+  string unixPath;
+  string seqpacketPath;
+  string shmName;
+  string statsPath;
+  bool verbose;
+  bool help;
+
+  po::options_description desc("Relay options");
+  desc.add_options()("help,h", po::bool_switch(&help), "Show help message")(
+      "upstream-host",
+      po::value<string>(&upstreamHost)->default_value("127.0.0.1"),
+      "Upstream broker host address")(
+      "upstream-port",
+      po::value<uint16_t>(&upstreamPort)->default_value(5000),
+      "Upstream broker port")(
+      "upstream-unix", po::value<string>(&upstreamUnix),
+      "Reach the upstream broker through this Unix socket instead")(
+      "host", po::value<string>(&host)->default_value("127.0.0.1"),
+      "Listen host address for local clients")(
+      "port,p", po::value<uint16_t>(&port)->default_value(5100),
+      "Listen port for local clients")(
+      "unix", po::value<string>(&unixPath),
+      "Also listen on this Unix stream socket path")(
+      "seqpacket", po::value<string>(&seqpacketPath),
+      "Also listen on this Unix SOCK_SEQPACKET path, one frame per record")(
+      "shm", po::value<string>(&shmName),
+      "Also serve numeric channels from shared-memory rings under this name")(
+      "stats-socket", po::value<string>(&statsPath),
+      "Serve Prometheus-format counters on this Unix socket path")(
+      "verbose,v", po::bool_switch(&verbose), "Enable verbose logging");
+
+  po::variables_map vm;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+    if (help) {
+      cout << desc << '\n';
+      return 0;
+    }
+  } catch (const po::error &e) {
+    println(stderr, "\033[31mError parsing arguments: {}\033[0m", e.what());
+    cout << desc << '\n';
+    return 1;
+  }
+
+  print(R"( ▄▄▄ ▗▞▀▚▖ █ ▗▞▀▜▌ ▄   ▄    █  ▐▌ ▄▄▄ ▄ ▄▄▄▄    
+█    ▐▛▀▀▘ █ ▐▌ ▐▌ █   █    ▀▄▄▞▘█    ▄ █   █   
+█    ▝▚▄▄▖ █ ▝▚▄▟▌  ▀▀▀█         █    █ █   █   
+           █       ▄   █              █     ▗▄▖ 
+                    ▀▀▀                    ▐▌ ▐▌
+                                            ▝▀▜▌
+                                           ▐▙▄▞▘)");
+
+  Endpoint upstream;
+  upstream.host = upstreamHost;
+  upstream.port = upstreamPort;
+  upstream.unixPath = upstreamUnix;
+
+  println("\n\n--    Press ctrl+c to exit...    --");
+  println("Relaying numeric channels from {}", upstream.describe());
+
+  signal(SIGINT, handleSignal);
+  signal(SIGPIPE, SIG_IGN);
+
+  try {
+    Broker broker(verbose);
+    broker.setupListenSocket(host, port);
+    if (!unixPath.empty()) {
+      broker.setupUnixSocket(unixPath, false);
+    }
+    if (!seqpacketPath.empty()) {
+      broker.setupUnixSocket(seqpacketPath, true);
+    }
+    if (!shmName.empty()) {
+      broker.setupSharedMemory(shmName);
+    }
+
+    optional<StatsServer> stats;
+    if (!statsPath.empty()) {
+      stats.emplace(statsPath,
+                    [&broker] { return broker.metrics().render("relay"); });
+      println("\033[32mStats available on unix:{}\033[0m", statsPath);
+    }
+
+    Upstream source(broker, upstream);
+    broker.onInterest(
+        [&source](const ChannelSet &wanted) { source.update(wanted); });
+    source.watch();
+
+    activeBroker = &broker;
+    broker.run();
+    activeBroker = nullptr;
+
+    source.close();
+  } catch (const exception &e) {
+    println(stderr, "\033[31mFatal error: {}\033[0m", e.what());
+    return 1;
+  }
+
+  return 0;
+}
@@ -1,24 +1,30 @@
 #include <boost/program_options.hpp>
 
 import std;
+import pubsub_uring;
+import pubsub_client;
 
 #include <cerrno>
 #include <csignal>
 #include <cstdio>
 #include <cstdlib>
 
-#include <arpa/inet.h>
-#include <sys/socket.h>
+#include <poll.h>
 #include <unistd.h>
 
 using namespace std;
 namespace po = boost::program_options;
 
-using socket_t = int;
+using namespace pubsub;
 
 namespace {
 constexpr string_view EXIT_MESSAGE = "[[EXIT]]\n";
 
+// Provided buffers shared by every connection on a ring
+constexpr uint16_t RECV_GROUP = 0;
+constexpr uint32_t RECV_BUFFER_COUNT = 256;
+constexpr uint32_t RECV_BUFFER_SIZE = 16 * 1024;
+
 volatile sig_atomic_t STOP_REQUESTED = 0;
 
 void handleSignal(int signum) {
@@ -26,12 +32,215 @@ void handleSignal(int signum) {
     STOP_REQUESTED = 1;
   }
 }
+
+// A stdin line "+1,prices.*" or "-ALL" becomes a [[+SUB:...]] or
+// [[-SUB:...]] frame, sent from the ring
+Task sendControls(Uring &ring, StreamSubscriber &sub) {
+  array<char, 128> buffer;
+  string input;
+
+  // Poll rather than read: a read of a terminal cannot be cancelled
+  while (!sub.closed()) {
+    int res = co_await ring.poll(STDIN_FILENO, POLLIN);
+    if (res == -EBUSY) {
+      co_await ring.yield();
+      continue;
+    }
+    if (res == -EINTR)
+      continue;
+    auto n = res < 0 ? 0 : ::read(STDIN_FILENO, buffer.data(), buffer.size());
+    if (n <= 0)
+      break;
+    input.append(buffer.data(), n);
+
+    for (size_t eol; (eol = input.find('\n')) != string::npos;
+         input.erase(0, eol + 1)) {
+      string_view line = string_view(input).substr(0, eol);
+      while (!line.empty() &&
+             isspace(static_cast<unsigned char>(line.back()))) {
+        line.remove_suffix(1);
+      }
+      if (line.empty())
+        continue;
+
+      ChannelSet channels;
+      vector<string_view> patterns;
+      const string_view list = line.substr(1);
+      if ((line.front() != '+' && line.front() != '-') || list.empty() ||
+          !codec::parseChannelList(list, channels, patterns)) {
+        println(stderr,
+                "\033[31mExpected +CHANNELS or -CHANNELS, e.g. +1,2,prices.* "
+                "or -ALL\033[0m");
+        continue;
+      }
+
+      sub.changeSubscription(line.front() == '+', string(list));
+      println("\033[32mSent: [[{}SUB:{}]]\033[0m", line.front(), list);
+    }
+  }
+}
+
+int runRing(Uring &ring, const deque<StreamSubscriber> &subs) {
+  while (!STOP_REQUESTED) {
+    if (ranges::all_of(subs, &StreamSubscriber::closed))
+      break;
+    if (int ret = ring.waitAndComplete(); ret < 0 && ret != -EINTR) {
+      println(stderr, "\033[31mio_uring wait failed: {}\033[0m",
+              strerror(-ret));
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int receiveInteractive(Uring &ring, deque<StreamSubscriber> &subs) {
+  for (auto &sub : subs) {
+    sub.receive([](Frame frame, uint64_t) {
+      const auto message = frameText(frame);
+      if (message.starts_with(EXIT_MESSAGE)) {
+        println("\033[32mReceived EXIT message from broker\033[0m");
+        STOP_REQUESTED = 1;
+        return false;
+      }
+      // Strip newline for display
+      println("\033[36mReceived: {}\033[0m",
+              message.substr(0, message.size() - 1));
+      return true;
+    });
+  }
+
+  // With a broker pool a change could need a broker not connected to
+  if (subs.size() == 1) {
+    println("Type +CHANNELS or -CHANNELS to change the subscription");
+    sendControls(ring, subs.front());
+  }
+
+  return runRing(ring, subs);
+}
+
+Task reportStats(Uring &ring, MessageSink &sink, chrono::milliseconds every) {
+  while (!STOP_REQUESTED) {
+    if (co_await ring.timeout(every) == -EBUSY) {
+      co_await ring.yield();
+      continue;
+    }
+    sink.report();
+  }
+}
+
+// One [[MUX]] connection carrying sessions 1..count. A frame lists the
+// sessions it is for and is counted once for each, as if every session were
+// a connection of its own.
+int receiveSessions(Uring &ring, deque<StreamSubscriber> &subs,
+                    uint32_t count, string_view channels, bool sinkMode,
+                    chrono::milliseconds interval) {
+  auto &sub = subs.front();
+  MessageSink sink;
+  vector<uint32_t> sessions;
+
+  sub.receive([&](Frame frame, uint64_t recvNs) {
+    sessions.clear();
+    const auto message = codec::parseSessions(frameText(frame), sessions);
+    if (!message) {
+      if (frameText(frame).starts_with(EXIT_MESSAGE)) {
+        STOP_REQUESTED = 1;
+        return false;
+      }
+      return true;
+    }
+    if (!sinkMode) {
+      println("\033[36mReceived for {} session(s): {}\033[0m",
+              sessions.size(), message->substr(0, message->size() - 1));
+      return true;
+    }
+    for (uint32_t session : sessions) {
+      sink.onFrame(*message, recvNs, session);
+    }
+    return true;
+  });
+  sub.openSessions(count, channels);
+  if (sinkMode) {
+    reportStats(ring, sink, interval);
+  }
+
+  const int status = runRing(ring, subs);
+  if (sinkMode) {
+    sink.printTotals();
+  }
+  return status;
+}
+
+// Counts what arrives on every connection without printing it, all
+// connections sharing one ring, one pool of receive buffers and one set of
+// statistics
+int receiveSink(Uring &ring, deque<StreamSubscriber> &subs,
+                chrono::milliseconds interval) {
+  MessageSink sink;
+
+  for (uint32_t i = 0; auto &sub : subs) {
+    sub.receive([&sink, index = i++](Frame frame, uint64_t recvNs) {
+      sink.onFrame(frameText(frame), recvNs, index);
+      return true;
+    });
+  }
+  reportStats(ring, sink, interval);
+
+  const int status = runRing(ring, subs);
+  sink.printTotals();
+  return status;
+}
+
+// Reads the broker's shared-memory rings instead of a connection. Numeric
+// channels only, topics are not mirrored there.
+int receiveShm(const string &name, const ChannelSet &channels, bool sinkMode,
+               chrono::milliseconds interval) {
+  ShmReader reader(name, channels);
+  MessageSink sink;
+  auto lastReport = chrono::steady_clock::now();
+
+  while (!STOP_REQUESTED && !reader.closed()) {
+    const uint64_t recvNs = codec::stampClockNs();
+    while (auto message = reader.next()) {
+      if (sinkMode) {
+        sink.onFrame(*message, recvNs);
+      } else {
+        println("\033[36mReceived: {}\033[0m",
+                message->substr(0, message->size() - 1));
+      }
+    }
+
+    const auto now = chrono::steady_clock::now();
+    if (sinkMode && now - lastReport >= interval) {
+      sink.report();
+      lastReport = now;
+    }
+    // Bounded so ctrl+c and the sink interval are noticed
+    reader.wait(min(interval, chrono::milliseconds(100)));
+  }
+
+  if (reader.closed()) {
+    println("\033[33mBroker closed shm:{}\033[0m", name);
+  }
+  if (sinkMode) {
+    sink.printTotals();
+  }
+  println("Lapped by the broker {} time(s)", reader.overruns());
+  return 0;
+}
 } // namespace
 
 int main(int argc, char *argv[]) {
   string host;
   uint16_t port;
-  uint8_t channels;
+  string channels;
+  string shmName;
+  string unixPath;
+  string seqpacketPath;
+  string brokerList;
+  uint32_t connections;
+  uint32_t sessions;
+  uint32_t intervalMs;
+  bool sinkMode;
   bool help;
 
   po::options_description desc("Subscriber options");
@@ -39,9 +248,32 @@ int main(int argc, char *argv[]) {
       "host", po::value<string>(&host)->default_value("127.0.0.1"),
       "Broker host address")(
       "port,p", po::value<uint16_t>(&port)->default_value(5000), "Broker port")(
-      "channels,c", po::value<uint8_t>(&channels)->default_value(0),
-      "Channels to subscribe to (comma-separated, or 'ALL' for all channels)");
+      "channels,c", po::value<string>(&channels)->default_value("ALL"),
+      "Channels and topic patterns to subscribe to (comma-separated, e.g. "
+      "'1,2,prices.eu.*', or 'ALL' for all channels)")(
+      "sink", po::bool_switch(&sinkMode),
+      "Count messages and report rates instead of printing them")(
+      "connections,n", po::value<uint32_t>(&connections)->default_value(1),
+      "Subscriber connections on one io_uring (sink mode)")(
+      "sessions", po::value<uint32_t>(&sessions)->default_value(0),
+      "Open this many logical subscribers on one [[MUX]] connection instead "
+      "of one connection each, like a gateway would")(
+      "interval", po::value<uint32_t>(&intervalMs)->default_value(1000),
+      "Sink statistics interval in milliseconds")(
+      "shm", po::value<string>(&shmName),
+      "Read the broker's shared-memory rings under this name (broker_tcp "
+      "--shm) instead of connecting; numeric channels only")(
+      "unix", po::value<string>(&unixPath),
+      "Connect to broker_tcp --unix at this path instead of over TCP")(
+      "seqpacket", po::value<string>(&seqpacketPath),
+      "Connect to broker_tcp --seqpacket at this path")(
+      "brokers", po::value<string>(&brokerList),
+      "Partition channels over this pool of brokers (HOST:PORT or "
+      "unix:PATH, comma-separated), one connection per broker that owns "
+      "any of --channels");
 
+  ChannelSet parsed;
+  vector<Endpoint> pool;
   po::variables_map vm;
   try {
     po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -50,6 +282,43 @@ int main(int argc, char *argv[]) {
       cout << desc << '\n';
       return 0;
     }
+    vector<string_view> patterns;
+    if (!codec::parseChannelList(channels, parsed, patterns)) {
+      throw po::validation_error(po::validation_error::invalid_option_value,
+                                 "channels");
+    }
+    if (!shmName.empty() && !patterns.empty()) {
+      throw po::error("--shm carries numeric channels only");
+    }
+    if (sessions > 0 && (connections > 1 || !shmName.empty())) {
+      throw po::error("--sessions share a single broker connection");
+    }
+    if (sessions > protocol::MAX_SESSIONS) {
+      throw po::error(
+          format("--sessions is at most {}", protocol::MAX_SESSIONS));
+    }
+    if (!unixPath.empty() && !seqpacketPath.empty()) {
+      throw po::error("--unix and --seqpacket are mutually exclusive");
+    }
+    if (connections == 0 || intervalMs == 0) {
+      throw po::error("--connections and --interval must be at least 1");
+    }
+    if (!brokerList.empty()) {
+      if (!unixPath.empty() || !seqpacketPath.empty() || !shmName.empty() ||
+          sessions > 0 || connections > 1) {
+        throw po::error("--brokers opens one connection per owning broker "
+                        "and excludes --unix, --seqpacket, --shm, "
+                        "--sessions and --connections");
+      }
+      try {
+        pool = parseEndpoints(brokerList);
+      } catch (const runtime_error &e) {
+        throw po::error(e.what());
+      }
+    }
+    if (connections > 1) {
+      sinkMode = true;
+    }
   } catch (const po::error &e) {
     println(stderr, "\033[31mError parsing arguments: {}\033[0m", e.what());
     cout << desc << '\n';
@@ -64,119 +333,88 @@ int main(int argc, char *argv[]) {
                                    ▝▀▜▌
                                   ▐▙▄▞▘)");
 
-  println("\n\n--    Press ctrl+c to exit...    --");
-  println("Connecting to broker at {}:{}", host, port);
-  println("Subscribing to channels: {}", channels);
-
-  signal(SIGINT, handleSignal);
-
-  socket_t sock = ::socket(AF_INET, SOCK_STREAM, 0);
-  if (sock < 0) {
-    println(stderr, "\033[31mSocket creation failed: {}\033[0m",
-            strerror(errno));
-    return EXIT_FAILURE;
-  }
+  const Endpoint broker{host, port,
+                        unixPath.empty() ? seqpacketPath : unixPath,
+                        !seqpacketPath.empty()};
+  const auto endpoint = broker.describe();
 
-  sockaddr_in serverAddr{};
-  serverAddr.sin_family = AF_INET;
-  serverAddr.sin_port = ::htons(port);
-  if (::inet_pton(AF_INET, host.c_str(), &serverAddr.sin_addr) <= 0) {
-    println(stderr, "\033[31mInvalid address: {}\033[0m", strerror(errno));
-    ::close(sock);
-    return 1;
+  println("\n\n--    Press ctrl+c to exit...    --");
+  if (!pool.empty()) {
+    println("Partitioning channels over {} broker(s)", pool.size());
+  } else if (shmName.empty()) {
+    println("Connecting to broker at {}", endpoint);
+  } else {
+    println("Reading shared memory {}", shmName);
   }
-
-  if (::connect(sock, (sockaddr *)&serverAddr, sizeof(serverAddr)) < 0) {
-    println(stderr, "\033[31mConnection failed: {}\033[0m", strerror(errno));
-    ::close(sock);
-    return 1;
+  println("Subscribing to channels: {}", channels);
+  if (sessions > 0) {
+    println("{} session(s) on one connection", sessions);
+  } else if (sinkMode) {
+    println("Sink mode over {} connection(s)", connections);
   }
 
-  println("\033[32mConnected to broker at {}:{}\033[0m", host, port);
+  signal(SIGINT, handleSignal);
 
-  const auto handshake =
-      channels == 0 ? string("[[SUB:ALL]]") : format("[[SUB:{}]]", channels);
-  const auto handshakeSent =
-      ::send(sock, handshake.data(), handshake.size(), 0);
-  if (handshakeSent < 0) {
-    println(stderr, "\033[31mFailed to send handshake: {}\033[0m",
-            strerror(errno));
-    ::close(sock);
-    return 1;
+  if (!shmName.empty()) {
+    try {
+      return receiveShm(shmName, parsed, sinkMode,
+                        chrono::milliseconds(intervalMs));
+    } catch (const exception &e) {
+      println(stderr, "\033[31mFatal error: {}\033[0m", e.what());
+      return 1;
+    }
   }
-  println("\033[32mHandshake sent: {}\033[0m", handshake);
-  println("Listening for messages...\n");
-
-  array<char, 128> buffer;
-  array<char, 512> recvBuffer;
-  size_t recvBufferLen = 0;
 
-  while (!STOP_REQUESTED) {
-    auto received = ::recv(sock, buffer.data(), buffer.size(), 0);
-
-    if (received < 0) {
-      if (errno == EINTR) {
-        if (STOP_REQUESTED) {
-          break;
-        }
-        continue;
+  const auto handshake = sessions > 0 ? string(protocol::HANDSHAKE_MUX)
+                                      : codec::makeSubHandshake(channels);
+  int status = 0;
+  try {
+    // Every connection shares the ring and its pool of receive buffers
+    Uring ring(sinkMode ? max<unsigned>(256, bit_ceil(connections + 1)) : 64);
+    BufferRing buffers(ring, RECV_GROUP, sinkMode ? RECV_BUFFER_COUNT : 16,
+                       sinkMode ? RECV_BUFFER_SIZE : protocol::BUFFER_SIZE);
+    deque<StreamSubscriber> subs;
+    if (!pool.empty()) {
+      const auto lists = splitChannelList(channels, pool);
+      for (size_t i = 0; i < pool.size(); ++i) {
+        if (lists[i].empty())
+          continue;
+        subs.emplace_back(ring, buffers, pool[i],
+                          codec::makeSubHandshake(lists[i]));
+        println("\033[32mSubscribed to {} at {}\033[0m", lists[i],
+                pool[i].describe());
       }
-      println(stderr, "\033[31mReceive failed: {}\033[0m", strerror(errno));
-      break;
-    } else if (received == 0) {
-      println("\033[33mConnection closed by broker\033[0m");
-      break;
+    } else {
+      for (uint32_t i = 0; i < connections; ++i) {
+        subs.emplace_back(ring, buffers, broker, handshake);
+      }
+      println("\033[32mConnected to broker at {}\033[0m", endpoint);
+      println("\033[32mHandshake sent: {}\033[0m", handshake);
     }
+    println("Listening for messages...\n");
 
-    // Append to buffer and process complete messages (lines)
-    if (recvBufferLen + received > recvBuffer.size()) {
-      println(stderr, "\033[31mReceive buffer overflow\033[0m");
-      break;
+    const chrono::milliseconds interval(intervalMs);
+    if (sessions > 0) {
+      status = receiveSessions(ring, subs, sessions, channels, sinkMode,
+                               interval);
+    } else {
+      status = sinkMode ? receiveSink(ring, subs, interval)
+                        : receiveInteractive(ring, subs);
     }
-    memcpy(recvBuffer.data() + recvBufferLen, buffer.data(), received);
-    recvBufferLen += received;
 
-    while (true) {
-      // Find newline in the buffer
-      char *newline =
-          static_cast<char *>(memchr(recvBuffer.data(), '\n', recvBufferLen));
-      if (!newline) {
-        break; // No complete message yet
-      }
-
-      size_t msgLen = newline - recvBuffer.data() + 1;
-      string_view message(recvBuffer.data(), msgLen);
-
-      // Check for EXIT message
-      if (message.starts_with(EXIT_MESSAGE)) {
-        println("\033[32mReceived EXIT message from broker\033[0m");
-        STOP_REQUESTED = 1;
-        break;
-      }
-
-      // Display received message
-      println("\033[36mReceived: {}\033[0m",
-              string_view(message.data(),
-                          message.size() - 1)); // Strip newline for display
-
-      // Remove processed message by shifting remaining data
-      recvBufferLen -= msgLen;
-      if (recvBufferLen > 0) {
-        memmove(recvBuffer.data(), recvBuffer.data() + msgLen, recvBufferLen);
+    println("\n\033[33mSending EXIT message...\033[0m");
+    for (auto &sub : subs) {
+      if (!sub.sendExit()) {
+        println(stderr, "\033[31mFailed to send EXIT message: {}\033[0m",
+                strerror(errno));
       }
     }
-  }
-
-  println("\n\033[33mSending EXIT message...\033[0m");
-  ssize_t exitSent = ::send(sock, EXIT_MESSAGE.data(), EXIT_MESSAGE.size(), 0);
-  if (exitSent < 0) {
-    println(stderr, "\033[31mFailed to send EXIT message: {}\033[0m",
-            strerror(errno));
-  } else {
     println("\033[32mEXIT message sent\033[0m");
+  } catch (const exception &e) {
+    println(stderr, "\033[31mFatal error: {}\033[0m", e.what());
+    status = 1;
   }
 
-  ::close(sock);
   println("\nExiting subscriber...");
-  return 0;
+  return status;
 }
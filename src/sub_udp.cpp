@@ -1,24 +1,30 @@
 #include <boost/program_options.hpp>
 
 import std;
+import pubsub_uring;
+import pubsub_client;
 
 #include <cerrno>
 #include <csignal>
 #include <cstdio>
 #include <cstdlib>
 
-#include <arpa/inet.h>
-#include <sys/socket.h>
-#include <unistd.h>
-
 using namespace std;
 namespace po = boost::program_options;
 
-using socket_t = int;
+using namespace pubsub;
 
 namespace {
-constexpr string_view EXIT_MESSAGE = "[[EXIT]]";
-constexpr size_t MAX_UDP_PAYLOAD = 2048;
+constexpr string_view EXIT_MESSAGE = protocol::EXIT_MSG;
+constexpr size_t MAX_UDP_PAYLOAD = protocol::MAX_UDP_PAYLOAD;
+
+// Provided buffers shared by every socket on a ring, one datagram each
+constexpr uint16_t RECV_GROUP = 0;
+constexpr uint32_t RECV_BUFFER_COUNT = 1024;
+
+// Bounds how long a stop request waits for the ring when the signal does not
+// interrupt the ring wait
+constexpr chrono::seconds IDLE_TIMEOUT{1};
 
 volatile sig_atomic_t STOP_REQUESTED = 0;
 
@@ -27,12 +33,95 @@ void handleSignal(int signum) {
     STOP_REQUESTED = 1;
   }
 }
+
+int runRing(Uring &ring, const deque<DatagramSubscriber> &subs) {
+  while (!STOP_REQUESTED) {
+    if (ranges::all_of(subs, &DatagramSubscriber::closed))
+      break;
+    if (int ret = ring.waitAndComplete(); ret < 0 && ret != -EINTR) {
+      println(stderr, "\033[31mio_uring wait failed: {}\033[0m",
+              strerror(-ret));
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Wakes the ring now and then so a stop request is noticed
+Task idleTicks(Uring &ring) {
+  while (!STOP_REQUESTED) {
+    if (co_await ring.timeout(IDLE_TIMEOUT) == -EBUSY) {
+      co_await ring.yield();
+    }
+  }
+}
+
+// The socket is connected, so every datagram comes from the broker
+int receiveInteractive(Uring &ring, deque<DatagramSubscriber> &subs,
+                       string_view broker) {
+  subs.front().receive([broker](Frame frame, uint64_t) {
+    const auto message = frameText(frame);
+
+    // Check for EXIT message
+    if (message.starts_with(EXIT_MESSAGE)) {
+      println("\033[32mReceived EXIT message from broker\033[0m");
+      STOP_REQUESTED = 1;
+      return false;
+    }
+
+    // Display received message
+    println("\033[36mReceived from {} [{} bytes]: {}\033[0m", broker,
+            message.size(), message);
+    return true;
+  });
+  idleTicks(ring);
+  return runRing(ring, subs);
+}
+
+Task reportStats(Uring &ring, MessageSink &sink, chrono::milliseconds every) {
+  while (!STOP_REQUESTED) {
+    if (co_await ring.timeout(every) == -EBUSY) {
+      co_await ring.yield();
+      continue;
+    }
+    sink.report();
+  }
+}
+
+// Counts what arrives on every socket without printing it, all sockets
+// sharing one ring, one pool of receive buffers and one set of statistics.
+// Each datagram carries exactly one message, so no reframing is needed.
+int receiveSink(Uring &ring, deque<DatagramSubscriber> &subs,
+                chrono::milliseconds interval) {
+  MessageSink sink;
+
+  for (uint32_t i = 0; auto &sub : subs) {
+    sub.receive([&sink, &sub, index = i++](Frame frame, uint64_t recvNs) {
+      const auto message = frameText(frame);
+      if (message.starts_with(EXIT_MESSAGE)) {
+        println("\033[32mReceived EXIT message from broker on fd={}\033[0m",
+                sub.fd());
+        return false;
+      }
+      sink.onFrame(message, recvNs, index);
+      return true;
+    });
+  }
+  reportStats(ring, sink, interval);
+
+  const int status = runRing(ring, subs);
+  sink.printTotals();
+  return status;
+}
 } // namespace
 
 int main(int argc, char *argv[]) {
   string host;
   uint16_t port;
-  uint8_t channels;
+  string channels;
+  uint32_t connections;
+  uint32_t intervalMs;
+  bool sinkMode;
   bool help;
 
   po::options_description desc("UDP Subscriber options");
@@ -40,8 +129,15 @@ int main(int argc, char *argv[]) {
       "host", po::value<string>(&host)->default_value("127.0.0.1"),
       "Broker host address")(
       "port,p", po::value<uint16_t>(&port)->default_value(5000), "Broker port")(
-      "channels,c", po::value<uint8_t>(&channels)->default_value(0),
-      "Channels to subscribe to (comma-separated, or 'ALL' for all channels)");
+      "channels,c", po::value<string>(&channels)->default_value("ALL"),
+      "Channels and topic patterns to subscribe to (comma-separated, e.g. "
+      "'1,2,prices.eu.*', or 'ALL' for all channels)")(
+      "sink", po::bool_switch(&sinkMode),
+      "Count messages and report rates instead of printing them")(
+      "connections,n", po::value<uint32_t>(&connections)->default_value(1),
+      "Subscriber sockets on one io_uring (sink mode)")(
+      "interval", po::value<uint32_t>(&intervalMs)->default_value(1000),
+      "Sink statistics interval in milliseconds");
 
   po::variables_map vm;
   try {
@@ -51,6 +147,18 @@ int main(int argc, char *argv[]) {
       cout << desc << '\n';
       return 0;
     }
+    ChannelSet parsed;
+    vector<string_view> patterns;
+    if (!codec::parseChannelList(channels, parsed, patterns)) {
+      throw po::validation_error(po::validation_error::invalid_option_value,
+                                 "channels");
+    }
+    if (connections == 0 || intervalMs == 0) {
+      throw po::error("--connections and --interval must be at least 1");
+    }
+    if (connections > 1) {
+      sinkMode = true;
+    }
   } catch (const po::error &e) {
     println(stderr, "\033[31mError parsing arguments: {}\033[0m", e.what());
     cout << desc << '\n';
@@ -69,103 +177,51 @@ int main(int argc, char *argv[]) {
   println("Target broker: {}:{}", host, port);
   println("Subscribing to channels: {}", channels);
   println("Protocol: UDP (datagram-based)\n");
-
-  signal(SIGINT, handleSignal);
-
-  socket_t sock = ::socket(AF_INET, SOCK_DGRAM, 0);
-  if (sock < 0) {
-    println(stderr, "\033[31mSocket creation failed: {}\033[0m",
-            strerror(errno));
-    return EXIT_FAILURE;
+  if (sinkMode) {
+    println("Sink mode over {} socket(s)", connections);
   }
 
-  // Set receive timeout to allow periodic checking of STOP_REQUESTED
-  timeval timeout{};
-  timeout.tv_sec = 1;
-  timeout.tv_usec = 0;
-  if (::setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) <
-      0) {
-    println(stderr, "\033[31mFailed to set socket timeout: {}\033[0m",
-            strerror(errno));
-    ::close(sock);
-    return EXIT_FAILURE;
-  }
-
-  sockaddr_in brokerAddr{};
-  brokerAddr.sin_family = AF_INET;
-  brokerAddr.sin_port = ::htons(port);
-  if (::inet_pton(AF_INET, host.c_str(), &brokerAddr.sin_addr) <= 0) {
-    println(stderr, "\033[31mInvalid address: {}\033[0m", strerror(errno));
-    ::close(sock);
-    return 1;
-  }
-
-  // Send handshake datagram to register as subscriber
-  const auto handshake =
-      channels == 0 ? string("[[SUB:ALL]]") : format("[[SUB:{}]]", channels);
-  const auto handshakeSent =
-      ::sendto(sock, handshake.data(), handshake.size(), 0,
-               (sockaddr *)&brokerAddr, sizeof(brokerAddr));
-  if (handshakeSent < 0) {
-    println(stderr, "\033[31mFailed to send handshake: {}\033[0m",
-            strerror(errno));
-    ::close(sock);
-    return 1;
-  }
-  println("\033[32mHandshake sent: {}\033[0m", handshake);
-  println("Listening for messages...\n");
-
-  array<char, MAX_UDP_PAYLOAD> buffer;
-  sockaddr_in senderAddr{};
-  socklen_t senderAddrLen = sizeof(senderAddr);
+  signal(SIGINT, handleSignal);
 
-  while (!STOP_REQUESTED) {
-    senderAddrLen = sizeof(senderAddr);
-    auto received =
-        ::recvfrom(sock, buffer.data(), buffer.size(), 0,
-                   (sockaddr *)&senderAddr, &senderAddrLen);
-
-    if (received < 0) {
-      if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
-        if (STOP_REQUESTED) {
-          break;
-        }
-        continue;
+  // One socket per emulated subscriber, all on one ring and one pool of
+  // receive buffers
+  Endpoint broker;
+  broker.host = host;
+  broker.port = port;
+  const auto handshake = codec::makeSubHandshake(channels);
+  int status = 0;
+  try {
+    Uring ring(sinkMode ? max<unsigned>(256, bit_ceil(connections + 1)) : 16);
+    BufferRing buffers(ring, RECV_GROUP,
+                       sinkMode ? RECV_BUFFER_COUNT : 16, MAX_UDP_PAYLOAD);
+    deque<DatagramSubscriber> subs;
+    for (uint32_t i = 0; i < connections; ++i) {
+      subs.emplace_back(ring, buffers, broker, handshake);
+    }
+    println("\033[32mHandshake sent: {}\033[0m", handshake);
+    println("Listening for messages...\n");
+
+    status = sinkMode
+                 ? receiveSink(ring, subs, chrono::milliseconds(intervalMs))
+                 : receiveInteractive(ring, subs, broker.describe());
+
+    println("\n\033[33mSending EXIT message...\033[0m");
+    bool exitFailed = false;
+    for (auto &sub : subs) {
+      if (!sub.sendExit()) {
+        println(stderr, "\033[31mFailed to send EXIT message: {}\033[0m",
+                strerror(errno));
+        exitFailed = true;
       }
-      println(stderr, "\033[31mReceive failed: {}\033[0m", strerror(errno));
-      break;
-    } else if (received == 0) {
-      // UDP doesn't close connections, but we got an empty datagram
-      continue;
     }
-
-    string_view message(buffer.data(), received);
-
-    // Check for EXIT message
-    if (message.starts_with(EXIT_MESSAGE)) {
-      println("\033[32mReceived EXIT message from broker\033[0m");
-      STOP_REQUESTED = 1;
-      break;
+    if (!exitFailed) {
+      println("\033[32mEXIT message sent\033[0m");
     }
-
-    // Display received message
-    char senderIP[INET_ADDRSTRLEN];
-    ::inet_ntop(AF_INET, &senderAddr.sin_addr, senderIP, INET_ADDRSTRLEN);
-    println("\033[36mReceived from {}:{} [{} bytes]: {}\033[0m", senderIP,
-            ntohs(senderAddr.sin_port), received, message);
-  }
-
-  println("\n\033[33mSending EXIT message...\033[0m");
-  ssize_t exitSent = ::sendto(sock, EXIT_MESSAGE.data(), EXIT_MESSAGE.size(), 0,
-                               (sockaddr *)&brokerAddr, sizeof(brokerAddr));
-  if (exitSent < 0) {
-    println(stderr, "\033[31mFailed to send EXIT message: {}\033[0m",
-            strerror(errno));
-  } else {
-    println("\033[32mEXIT message sent\033[0m");
+  } catch (const exception &e) {
+    println(stderr, "\033[31mFatal error: {}\033[0m", e.what());
+    status = 1;
   }
 
-  ::close(sock);
   println("\nExiting subscriber...");
-  return 0;
+  return status;
 }